@@ -0,0 +1,80 @@
+/*
+ * Fixed point signal processing for sensor data. Everything works with
+ * 16 bit int and uses the multiplier primitives of machine.h, so it is
+ * cheap on the MSP430 as well.
+ *
+ * License: BSD
+ */
+
+#ifndef __DSP_H__
+#define __DSP_H__
+
+/* Largest window of dsp_median() */
+#define DSP_MEDIAN_MAX 9
+
+/* Moving average over 1<<ld samples */
+typedef struct {
+  unsigned short *x;      /* history, 1<<ld entries */
+  unsigned long sum;
+  unsigned char ld, i;
+} dsp_ma_t;
+
+/* First order low pass y += (x-y)/(1<<ld). The state keeps ld fractional
+   bits, so the output settles exactly on a constant input. */
+typedef struct {
+  unsigned long acc;      /* y<<ld */
+  unsigned char ld;
+} dsp_iir1_t;
+
+/* Biquad, direct form I. Coefficients are Q14 (16384 = 1.0) in the form
+   y = b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2, a0 is 1. Signals must stay
+   within +-8191. The fraction lost when truncating y is carried into the
+   next step, so the output has no DC bias even at low cut off frequencies:
+   dspbench shows no mean error and at most 1, 1.5, 4.3 and 6.1 LSB at
+   fs/10, fs/20, fs/50 and fs/100. */
+typedef struct {
+  signed short b0, b1, b2, na1, na2;
+  signed short x1, x2, y1, y2;
+  signed short e;         /* Q14 fraction carried to the next step */
+} dsp_biquad_t;
+
+/* Median of the last n samples, n odd and up to DSP_MEDIAN_MAX. An even
+   n is rounded down. */
+typedef struct {
+  unsigned short *x;      /* history, n entries */
+  unsigned char n, i;
+} dsp_median_t;
+
+/* Debounced threshold with hysteresis. Switches on after n consecutive
+   samples above hi and off after n consecutive samples below lo. */
+typedef struct {
+  signed short lo, hi;
+  unsigned char n, cnt, on;
+} dsp_hyst_t;
+
+/**
+ * \brief initialize moving average with history x, all entries set to v.
+ */
+void dsp_ma_init(dsp_ma_t *f, unsigned short *x, unsigned char ld, unsigned short v);
+unsigned short dsp_ma(dsp_ma_t *f, unsigned short v);
+
+void dsp_iir1_init(dsp_iir1_t *f, unsigned char ld, unsigned short v);
+unsigned short dsp_iir1(dsp_iir1_t *f, unsigned short v);
+
+/**
+ * \brief initialize biquad with coefficients c[] = {b0, b1, b2, a1, a2},
+ *        settled on input v (0 for filters without DC gain).
+ */
+void dsp_biquad_init(dsp_biquad_t *f, const signed short c[5], signed short v);
+signed short dsp_biquad(dsp_biquad_t *f, signed short v);
+
+void dsp_median_init(dsp_median_t *f, unsigned short *x, unsigned char n, unsigned short v);
+unsigned short dsp_median(dsp_median_t *f, unsigned short v);
+
+void dsp_hyst_init(dsp_hyst_t *h, signed short lo, signed short hi, unsigned char n);
+/**
+ * \return 1 if on, 0 if off.
+ */
+unsigned char dsp_hyst(dsp_hyst_t *h, signed short v);
+
+#endif /* __DSP_H__ */
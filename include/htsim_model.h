@@ -0,0 +1,33 @@
+/*
+ * Heater plant models, shared by util/htsim and util/htloop.
+ *
+ * License: BSD
+ *
+ */
+#ifndef __HTSIM_MODEL_H__
+#define __HTSIM_MODEL_H__
+
+/* Simulation step period in ms, the model constants are tuned to it */
+#define HTSIM_PERIOD 256
+
+typedef struct {
+  float t0;       /* heat exchanger temperature */
+  float t1;       /* nozzle stock temperature */
+  float gkph;     /* nozzle stock heater current */
+  float gkz;      /* glow plug current */
+  float gpr;      /* flame sensor Seebeck voltage */
+} htsim_model_t;
+
+/**
+ * \brief put plant into its cold start state.
+ */
+void htsim_model_init(htsim_model_t *m);
+
+/**
+ * \brief advance plant by HTSIM_PERIOD.
+ * \param d d[0] actuators, d[1] sensors. d[1][SENSOR_HE] must hold the
+ *        virtual sensor of the firmware, all other sensors are computed.
+ */
+void htsim_model_step(htsim_model_t *m, unsigned short d[2][16]);
+
+#endif /* __HTSIM_MODEL_H__ */
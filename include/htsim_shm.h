@@ -0,0 +1,244 @@
+/*
+ * Shared memory exchange between POSIX firmware builds and the heater
+ * plant simulator (util/htsim) or its GUI.
+ *
+ * Author: Manuel Jander
+ * License: BSD
+ *
+ */
+#ifndef __HTSIM_SHM_H__
+#define __HTSIM_SHM_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/*
+ * Instance selection, by environment of both firmware and simulator:
+ *   HTSIM_SHM  path of a file to mmap (e.g. /dev/shm/heater1), takes precedence.
+ *   HTSIM_KEY  SysV shared memory key, default HTSIM_SHM_KEY.
+ */
+#define HTSIM_SHM_KEY 0xb0E1
+#define HTSIM_SHM_MAGIC 0x48545331 /* "HTS1" */
+#define HTSIM_SHM_VERSION 2
+#define HTSIM_NCHAN 16
+
+/* One value block with a single writer. seq is odd while an update is in
+   progress, readers retry until they got an even and unchanged seq. */
+typedef struct {
+  volatile unsigned int seq;
+  volatile unsigned int ref;          /* writer defined, see below */
+  volatile unsigned long long stamp;  /* CLOCK_MONOTONIC time of last update in ns */
+  volatile unsigned short v[HTSIM_NCHAN];
+} htsim_block_t;
+
+typedef struct {
+  volatile unsigned int magic;
+  unsigned int version;
+  unsigned int size;
+  htsim_block_t act;      /* actuators, written by firmware */
+  htsim_block_t virt;     /* virtual sensors, written by firmware */
+  htsim_block_t sensor;   /* sensors, written by simulator. ref is the act.seq they were computed from */
+  volatile int doorbell;  /* incremented by firmware on each actuator update (futex word) */
+  volatile int waiters;   /* amount of processes waiting on doorbell */
+  volatile int sensor_bell;     /* incremented by simulator on each sensor update (futex word) */
+  volatile int sensor_waiters;  /* amount of processes waiting on sensor_bell */
+} htsim_shm_t;
+
+static inline unsigned long long htsim_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (unsigned long long)t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * \brief update n values of a block starting at channel first.
+ */
+static inline void htsim_block_write(htsim_block_t *b, int first, const unsigned short *v, int n, unsigned int ref)
+{
+  int i;
+
+  b->seq++;
+  __sync_synchronize();
+  for (i=0; i<n; i++) {
+    b->v[first+i] = v[i];
+  }
+  b->ref = ref;
+  b->stamp = htsim_now();
+  __sync_synchronize();
+  b->seq++;
+}
+
+/**
+ * \brief get consistent copy of all values of a block. ref and stamp may be NULL.
+ * \return sequence number of the copy.
+ */
+static inline unsigned int htsim_block_read(const htsim_block_t *b, unsigned short *v, unsigned int *ref, unsigned long long *stamp)
+{
+  unsigned int seq, r;
+  unsigned long long s;
+  int i;
+
+  do {
+    while ((seq = b->seq) & 1) {
+      sched_yield();
+    }
+    __sync_synchronize();
+    for (i=0; i<HTSIM_NCHAN; i++) {
+      v[i] = b->v[i];
+    }
+    r = b->ref;
+    s = b->stamp;
+    __sync_synchronize();
+  } while (b->seq != seq);
+
+  if (ref != NULL) {
+    *ref = r;
+  }
+  if (stamp != NULL) {
+    *stamp = s;
+  }
+
+  return seq;
+}
+
+static inline void htsim_bell_ring(volatile int *bell, volatile int *waiters)
+{
+  __sync_fetch_and_add(bell, 1);
+#ifdef __linux__
+  if (*waiters) {
+    syscall(SYS_futex, bell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+#endif
+}
+
+static inline void htsim_bell_wait(volatile int *bell, volatile int *waiters, int old, const struct timespec *timeout)
+{
+#ifdef __linux__
+  __sync_fetch_and_add(waiters, 1);
+  syscall(SYS_futex, bell, FUTEX_WAIT, old, timeout, NULL, 0);
+  __sync_fetch_and_sub(waiters, 1);
+#else
+  if (*bell == old) {
+    nanosleep(timeout, NULL);
+  }
+#endif
+}
+
+/**
+ * \brief wake up everybody waiting for new actuator values.
+ */
+static inline void htsim_doorbell_ring(htsim_shm_t *s)
+{
+  htsim_bell_ring(&s->doorbell, &s->waiters);
+}
+
+/**
+ * \brief wait until doorbell differs from old or timeout elapsed.
+ */
+static inline void htsim_doorbell_wait(htsim_shm_t *s, int old, const struct timespec *timeout)
+{
+  htsim_bell_wait(&s->doorbell, &s->waiters, old, timeout);
+}
+
+/**
+ * \brief wake up everybody waiting for new sensor values.
+ */
+static inline void htsim_sensor_ring(htsim_shm_t *s)
+{
+  htsim_bell_ring(&s->sensor_bell, &s->sensor_waiters);
+}
+
+/**
+ * \brief wait until sensor_bell differs from old or timeout (NULL: none) elapsed.
+ */
+static inline void htsim_sensor_wait(htsim_shm_t *s, int old, const struct timespec *timeout)
+{
+  htsim_bell_wait(&s->sensor_bell, &s->sensor_waiters, old, timeout);
+}
+
+/**
+ * \brief map the shared memory instance selected by environment and
+ *        initialize it if it is new.
+ * \return NULL on error.
+ */
+static inline htsim_shm_t *htsim_shm_attach(void)
+{
+  htsim_shm_t *s;
+  const char *env;
+
+  env = getenv("HTSIM_SHM");
+  if (env != NULL) {
+    int fd;
+    struct stat st;
+
+    fd = open(env, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+      perror(env);
+      return NULL;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(htsim_shm_t)) {
+      if (ftruncate(fd, sizeof(htsim_shm_t)) == -1) {
+        perror("ftruncate()");
+      }
+    }
+    s = mmap(NULL, sizeof(htsim_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+      perror("mmap()");
+      return NULL;
+    }
+  } else {
+    key_t key = HTSIM_SHM_KEY;
+    int shmid;
+
+    env = getenv("HTSIM_KEY");
+    if (env != NULL) {
+      key = strtoul(env, NULL, 0);
+    }
+    shmid = shmget(key, sizeof(htsim_shm_t), 0666 | IPC_CREAT);
+    if (shmid == -1) {
+      perror("shmget()");
+      return NULL;
+    }
+    s = shmat(shmid, NULL, 0);
+    if (s == (void *)-1) {
+      perror("shmat()");
+      return NULL;
+    }
+  }
+
+  /* First one to see a zeroed segment initializes it, others wait. */
+  if (__sync_bool_compare_and_swap(&s->magic, 0, ~HTSIM_SHM_MAGIC)) {
+    s->version = HTSIM_SHM_VERSION;
+    s->size = sizeof(htsim_shm_t);
+    __sync_synchronize();
+    s->magic = HTSIM_SHM_MAGIC;
+  }
+  while (s->magic == ~HTSIM_SHM_MAGIC) {
+    sched_yield();
+  }
+  if (s->magic != HTSIM_SHM_MAGIC || s->version != HTSIM_SHM_VERSION || s->size != sizeof(htsim_shm_t)) {
+    fprintf(stderr, "htsim shared memory has incompatible layout, remove it (ipcrm or rm) and restart.\n");
+    return NULL;
+  }
+
+  return s;
+}
+
+#endif /* __HTSIM_SHM_H__ */
@@ -7,11 +7,14 @@
  * Gruss an die hochgradig gefiltertern und sonstige separatisten :)
  */
 
+/* Maximum amount of tasks. Can be overridden at build time. */
+#ifndef KERNEL_MAX_TASK
 #define KERNEL_MAX_TASK 3
+#endif
 
 #if defined(__linux__) || defined(_WIN32)
 #define TASK_FUNC(x) void x(void)
-#define KERNEL_STACK_SIZE (2*8192*KERNEL_MAX_TASK)
+#define KERNEL_TASK_STACK (2*8192)
 
 #elif defined(__MSP430__)
 #define TASK_FUNC(x) void /* __attribute__ ((naked))*/ x(void)
@@ -31,13 +34,18 @@
 #endif
 
 #if defined(EGG_HW)
-#define KERNEL_STACK_SIZE (96*KERNEL_MAX_TASK)
+#define KERNEL_TASK_STACK 96
 #else
-#define KERNEL_STACK_SIZE (64*KERNEL_MAX_TASK) 
+#define KERNEL_TASK_STACK 64
 #endif
 #elif defined(__arm__)
 #define TASK_FUNC(x) void x(void)
-#define KERNEL_STACK_SIZE (256*KERNEL_MAX_TASK)
+#define KERNEL_TASK_STACK 256
+#endif
+
+/* Total stack memory in int units, shared by all tasks. Can be overridden at build time. */
+#ifndef KERNEL_STACK_SIZE
+#define KERNEL_STACK_SIZE (KERNEL_TASK_STACK*KERNEL_MAX_TASK)
 #endif
 
 typedef void(*kernel_task_t)(void);
@@ -48,10 +56,80 @@ typedef void(*kernel_task_t)(void);
 void kernel_init(void);
 
 /**
- * Register a task.
+ * Register a task. May also be called from a running task, the new task is
+ * started on its first dispatch.
+ * \param stack_size stack size in int units, carved out of KERNEL_STACK_SIZE.
+ * \return task index or -1 if there are no free task slots or stack left.
  */
 int kernel_task_register(kernel_task_t task, int stack_size);
 
+/**
+ * \brief set priority of a task. Ready tasks with higher priority are always
+ *        dispatched first, tasks of equal priority round robin. Default is 0.
+ * \return 0 on success or -1 if task is invalid.
+ */
+int kernel_task_priority(int task, unsigned char prio);
+
+/**
+ * \brief declare a relative deadline in jiffies for a task. Each time the task
+ *        gets ready, it must give back control within that time. Among tasks
+ *        of equal priority the one with the earliest deadline runs first.
+ *        0 removes the deadline.
+ * \return 0 on success or -1 if task is invalid.
+ */
+int kernel_task_deadline(int task, unsigned int deadline);
+
+/* Called with the task index and the amount of jiffies the deadline was missed */
+typedef void (*kernel_deadline_hook_t)(int task, unsigned int late);
+
+/**
+ * \brief set watchdog callback for missed deadlines, NULL to disable.
+ */
+void kernel_deadline_hook(kernel_deadline_hook_t hook);
+
+/**
+ * Register a task which does not rely on cooperative scheduling against other
+ * tasks. With the pthread kernel backend it runs in parallel to all other tasks,
+ * otherwise it is the same as kernel_task_register().
+ */
+int kernel_task_register_parallel(kernel_task_t task, int stack_size);
+
+/**
+ * \brief get stack high water mark of a task. Unused stack memory is painted
+ *        at kernel_init(), the painted area left over is considered unused.
+ * \return maximum stack usage in int units (same as stack_size of
+ *         kernel_task_register()) or -1 if task is invalid.
+ */
+int kernel_stack_usage(int task);
+
+/**
+ * \brief get assigned stack size of a task in int units or -1 if invalid.
+ */
+int kernel_stack_size(int task);
+
+#ifdef KERNEL_PROFILE
+/* Scheduler statistics of one task. Times are in PFREQ units, see machine.h */
+typedef struct {
+  unsigned long dispatches;   /* amount of time slices */
+  unsigned long run_time;     /* accumulated run time */
+  unsigned int max_slice;     /* longest time slice */
+  unsigned long wakeups;      /* dispatches caused by kernel_wakeup() */
+  unsigned long latency;      /* accumulated kernel_wakeup() to dispatch time */
+  unsigned int max_latency;   /* worst kernel_wakeup() to dispatch time */
+} kernel_prof_t;
+
+/**
+ * \brief get scheduler statistics of a task.
+ * \return 0 on success or -1 if task is invalid.
+ */
+int kernel_profile_get(int task, kernel_prof_t *p);
+
+/**
+ * \brief clear scheduler statistics of all tasks.
+ */
+void kernel_profile_reset(void);
+#endif
+
 /**
  * Start the poeli kernel
  */
@@ -88,3 +166,60 @@ void kernel_wakeup(int task);
  * \brief get current task ID. The returned value can be used for kernel_wakeup()
  */
 unsigned int kernel_getTask(void);
+
+/*
+ * Synchronization primitives. Waiting tasks are suspended (or sleep if a
+ * timeout is given) and woken up directly by the producer. Timeouts are in
+ * jiffies, 0 means wait forever. All wait functions must be called from task
+ * context and return 0 on success or -1 on timeout.
+ */
+
+/* Task bit masks of waiters, bit n is task n */
+#define KERNEL_MASK_BITS (8*sizeof(unsigned int))
+#define KERNEL_MASK_WORDS ((KERNEL_MAX_TASK+KERNEL_MASK_BITS-1)/KERNEL_MASK_BITS)
+
+/* Counting semaphore */
+typedef struct {
+  volatile unsigned int count;
+  volatile unsigned int waiters[KERNEL_MASK_WORDS];
+} kernel_sem_t;
+
+void kernel_sem_init(kernel_sem_t *s, unsigned int count);
+int kernel_sem_wait(kernel_sem_t *s, unsigned int timeout);
+/**
+ * \brief increment semaphore and wake up waiting tasks. Not interrupt safe.
+ */
+void kernel_sem_post(kernel_sem_t *s);
+
+/* Auto reset event. Several signals before a wait are merged into one. */
+typedef kernel_sem_t kernel_event_t;
+
+#define kernel_event_init(e) kernel_sem_init(e, 0)
+#define kernel_event_wait(e, timeout) kernel_sem_wait(e, timeout)
+/**
+ * \brief set event and wake up waiting tasks. May be called from interrupt context.
+ */
+void kernel_event_signal(kernel_event_t *e);
+
+/* Message queue of "depth" messages of "size" bytes each */
+typedef struct {
+  unsigned char *buf;
+  unsigned char size;
+  unsigned char depth;
+  unsigned char head;
+  kernel_sem_t msgs;              /* amount of queued messages */
+} kernel_mbox_t;
+
+/**
+ * \brief initialize message queue using caller provided storage of size*depth bytes.
+ */
+void kernel_mbox_init(kernel_mbox_t *m, void *buf, unsigned char size, unsigned char depth);
+/**
+ * \brief copy message into queue and wake up receivers. Does not block.
+ * \return 0 on success or -1 if the queue is full. Not interrupt safe.
+ */
+int kernel_mbox_put(kernel_mbox_t *m, const void *msg);
+/**
+ * \brief wait for a message and copy it into msg.
+ */
+int kernel_mbox_get(kernel_mbox_t *m, void *msg, unsigned int timeout);
@@ -59,6 +59,13 @@ void machine_usleep(unsigned long);
 void machine_msleep(unsigned int);
 void machine_sleep(unsigned int);
 void machine_jsleep(unsigned int);
+/**
+ * Sleep like machine_jsleep(j), but not at all if pending() returns non
+ * zero. pending() is called with interrupts blocked, which are unblocked
+ * atomically with going to sleep, so an interrupt right after the check
+ * still ends the sleep.
+ */
+void machine_idle_sleep(unsigned int j, int (*pending)(void));
 
 /* Timer support */
 
@@ -84,6 +91,19 @@ void machine_timer_destroy(HANDLE_TIMER);
  */
 void machine_timer_reset(HANDLE_TIMER hTimer, int ival);
 
+#ifdef __linux__
+typedef struct {
+  unsigned long count;          /* amount of expirations */
+  unsigned long overruns;       /* periods skipped because of late expiry */
+  unsigned long late_max;       /* worst expiry lateness in microseconds */
+  unsigned long long late_sum;  /* accumulated lateness in microseconds */
+} machine_timer_stats_t;
+/*
+ * Get jitter statistics of a timer. Returns 0 on success.
+ */
+int machine_timer_stats(HANDLE_TIMER hTimer, machine_timer_stats_t *s);
+#endif
+
 void machine_beep(void);
 void machine_led_set(int s);
 #define BACKLIGHT_MAX 10
@@ -105,10 +125,16 @@ unsigned int machine_buttons(int do_read);
 #define TIMER2JIFFIES(x) ((x)<<8)
 #elif defined(__linux__)
 #include <time.h>
-#define JIFFIES2TIMER(x) (x)
-#define TIMER2JIFFIES(x) (x)
-#define TFREQ 100
+#define TFREQ 100 /* Software timer timebase */
+/* Jiffies timebase. Can be overridden at build time, e.g. 1000 or 10000. */
+#ifndef JFREQ
 #define JFREQ 100
+#endif
+#if (JFREQ % TFREQ) != 0
+#error JFREQ must be a multiple of TFREQ
+#endif
+#define JIFFIES2TIMER(x) ((x)/(JFREQ/TFREQ))
+#define TIMER2JIFFIES(x) ((x)*(JFREQ/TFREQ))
 #elif defined(_WIN32)
 #define JIFFIES2TIMER(x) (x)
 #define TIMER2JIFFIES(x) (x)
@@ -134,6 +160,16 @@ unsigned int machine_buttons(int do_read);
 #define MSEC2TIMER(x) ((TFREQ*(long)(x))/1000)
 unsigned int machine_getJiffies(void);
 
+/* Profiling clock running at PFREQ Hz. Falls back to jiffies if the
+   machine has no better time source. */
+#if defined(__linux__)
+#define PFREQ 1000000UL
+unsigned int machine_getProfClock(void);
+#else
+#define PFREQ JFREQ
+#define machine_getProfClock() machine_getJiffies()
+#endif
+
 /* ADC12 */
 
 /*
@@ -162,6 +198,14 @@ void adc_invalidate(void);
  */
 int adc_is_uptodate(void);
 
+/**
+ * Register function to be called each time a new ADC value set is
+ * complete. It is called from interrupt context. Machines without such
+ * a notification never call it.
+ * \return 1 if hook will be called, 0 if the caller has to poll.
+ */
+int adc_ready_hook(void (*hook)(void));
+
 /* Set new actuator values */
 void machine_act(unsigned short a[], int n);
 
@@ -206,18 +250,62 @@ void rtc_getalarm(rtc_time_t *t);
 void rtc_getclock(rtc_time_t *t);
 
 /**
- * if nbytes==0, erase page of fptr and leave uninitialized.
+ * if nbytes==0, erase page of fptr and leave uninitialized. fptr must be
+ *   aligned to a 512 byte segment and the object at least that large.
  * if nbytes!=0 and rptr==NULL, erase and initialze nbytes bytes with zero at fptr.
  * if nbytes!=0 and rptr!=NULL, erase and write nbytes data bytes from rptr into fptr.
  */
 void flash_write(void *fptr, void *rptr, int nbytes);
 
-#ifdef __i386__
+/**
+ * Program nbytes from rptr into already erased flash at fptr without erasing.
+ * Bits can only be cleared. fptr must be word aligned, nbytes is rounded up
+ * to whole words.
+ */
+void flash_program(void *fptr, const void *rptr, int nbytes);
+
+#ifdef __linux__
+/* Data written with flash_write() must be placed with FLASH_EMU. It is kept
+   in a persistent flash image file (FLASH_IMAGE environment variable, default
+   flash.img) with 512 byte segments, erase to 0xff and MSP430 write timing.
+   Erases, busy time and the most worn segment are printed at exit, also on
+   SIGINT and SIGTERM. */
+#define FLASH_EMU __attribute__ ((section ("flash_emu"), aligned(512)))
+
+typedef struct {
+  unsigned long erases;       /* segment erase cycles */
+  unsigned long words;        /* programmed words */
+  unsigned long busy_time;    /* accumulated flash busy time in microseconds */
+  unsigned long max_busy;     /* longest flash_write() in microseconds */
+} flash_stats_t;
+/*
+ * Get flash emulation counters since program start.
+ */
+void flash_stats(flash_stats_t *s);
+/*
+ * Get lifetime erase cycles of the segment containing fptr, or -1 if fptr
+ * is not emulated flash.
+ */
+long flash_erase_count(void *fptr);
+#else
+#define FLASH_EMU
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
 
 #include <setjmp.h>
 #define my_setjmp(a) setjmp(a)
 #define my_longjmp(a,b) longjmp(a,b)
 
+#ifdef __x86_64__
+#define setup_task(stack, function) \
+    asm volatile ( \
+        "movq %0, %%rsp\n" \
+        "andq $-16, %%rsp\n" \
+        "call *%1;\n" \
+        : : "r"(stack), "r"(function) \
+    )
+#else
 #define setup_task(stack, function) \
     asm ( \
         "movl %0, %%esp\n" \
@@ -225,6 +313,7 @@ void flash_write(void *fptr, void *rptr, int nbytes);
         "ret;\n" \
         : : "r"(stack), "r"(function) \
     )
+#endif
 
 static inline unsigned int mult_u16xu16h(const unsigned int a, const unsigned int b)
 {
@@ -246,6 +335,17 @@ static inline int mac_s16xs16_h3(const signed int a1,
   return (a1*b1 + a2*b2 + a3*b3)>>16;
 }
 
+/* Same with the whole 32 bit result */
+static inline signed long mac_s16xs16_3(const signed int a1,
+                                        const signed int b1,
+                                        const signed int a2,
+                                        const signed int b2,
+                                        const signed int a3,
+                                        const signed int b3)
+{
+  return (signed long)a1*b1 + (signed long)a2*b2 + (signed long)a3*b3;
+}
+
 static inline int div_u32_u16(long dividend, int divisor)
 {
   if (divisor == 0) {
@@ -337,6 +437,28 @@ static inline int mac_s16xs16_h3(const signed int a1, const signed int b1, const
   return result;
 }
 
+static inline signed long mac_s16xs16_3(const signed int a1, const signed int b1, const signed int a2, const signed int b2, const signed int a3, const signed int b3)
+{
+  signed long result;
+ 
+  asm("push r2;\n"
+      "dint;\n"
+      "nop;\n"
+      "mov %1, &0x0132;\n"
+      "mov %2, &0x0138;\n"
+      "mov %3, &0x0136;\n"
+      "mov %4, &0x0138;\n"
+      "mov %5, &0x0136;\n"
+      "mov %6, &0x0138;\n"
+      "mov &0x013a, %A0;\n"
+      "mov &0x013c, %B0;\n"
+      "pop r2;\n"
+      : "=r"(result)
+      : "r"(a1), "r"(b1), "r"(a2), "r"(b2), "r"(a3), "r"(b3)
+  );
+  return result;
+}
+
 static inline unsigned int mac_u16xu16_h3(const signed int a1, const signed int b1, const signed int a2, const signed int b2, const signed int a3, const signed int b3)
 {
   unsigned int result;
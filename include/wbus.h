@@ -48,6 +48,16 @@ typedef struct
 
 typedef wb_sensor_t *HANDLE_WBSENSOR;
 
+/* Query pages kept between polls, see wbus_sensors_poll(). Zero before first use. */
+typedef struct
+{
+  unsigned short version;  /* device page version of the contents, 0 if none */
+  unsigned long valid;     /* pages the version applies to */
+  wb_sensor_t page[WB_NUM_SENSORS];
+} wb_sensor_cache_t;
+
+typedef wb_sensor_cache_t *HANDLE_WBSENSOR_CACHE;
+
 typedef struct {
   unsigned char code;
   unsigned char flags;
@@ -73,9 +83,21 @@ typedef wb_errors_t *HANDLE_WBERR;
 
 typedef struct WBUS *HANDLE_WBUS;
 
+/* Link statistics of a W-Bus handle, see wbus_link_stats() */
+typedef struct
+{
+  unsigned short rx_len_err;  /* received frames cut short */
+  unsigned short rx_chk_err;  /* received frames with checksum mismatch */
+  unsigned short tx;          /* answers sent (host) */
+  unsigned short lat_max;     /* longest time from request to answer in jiffies (host) */
+  unsigned short lat;         /* time from request to the last answer in jiffies (host) */
+} wb_link_stats_t;
+
 /* Overall handling stuff */
 int wbus_open(HANDLE_WBUS *pWbus, unsigned char dev_idx);
 void wbus_close(HANDLE_WBUS wbus);
+/* Statistics of the given handle. May be cleared by the caller. */
+wb_link_stats_t *wbus_link_stats(HANDLE_WBUS wbus);
 
 /* Low level W-Bus I/O */
 int wbus_io( HANDLE_WBUS wbus,
@@ -104,6 +126,13 @@ int wbus_host_answer( HANDLE_WBUS wbus,
 
 /* Hight Level I/O */
 int wbus_sensor_read(HANDLE_WBUS wbus, HANDLE_WBSENSOR s, int idx);
+/* Read all query pages set in bitmap pages (bit n is page n) into s[n], s has
+   WB_NUM_SENSORS entries. Pages are fetched several at once if the device
+   supports it, one by one otherwise. Unavailable pages get idx 0xff. */
+int wbus_sensors_read(HANDLE_WBUS wbus, HANDLE_WBSENSOR s, unsigned long pages);
+/* Like wbus_sensors_read() into c->page, but if the device supports it,
+   only pages changed since the last poll are transferred. */
+int wbus_sensors_poll(HANDLE_WBUS wbus, HANDLE_WBSENSOR_CACHE c, unsigned long pages);
 void wbus_sensor_print(char *str, HANDLE_WBSENSOR s);
 
 int wbus_get_wbinfo(HANDLE_WBUS wbus, HANDLE_WBINFO hInfo);
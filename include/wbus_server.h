@@ -87,14 +87,16 @@ typedef union {
   unsigned char fill[128];
 } heater_seqmem_t;
 
+/* Data that is persistent, see wbus_server_store() */
 typedef struct {
-  /* Data that should be persistent some how (flash backup) */
-  struct {
-    rtc_time_t working_duration;
-    rtc_time_t operating_duration;
-    unsigned long counter;
-    unsigned char co2_cal;
-  } static_data;
+  rtc_time_t working_duration;
+  rtc_time_t operating_duration;
+  unsigned long counter;
+  unsigned char co2_cal;
+} heater_static_t;
+
+typedef struct {
+  heater_static_t static_data;
   /* Data which is only relevant during power on */
   struct {
     heater_status_t status;            /* current status                      */
@@ -119,30 +121,142 @@ union seq_d {
   char force_size[512*4];
 } seq_data;
 
+/* Data set bank in use, seq_data only holds the compiled in defaults */
+extern union seq_d *seq_bank;
+
+/* States in which the firmware holds the virtual sensors SENSOR_HE and
+   SENSOR_FD at 0 */
+#define SENSOR_VIRTUAL_OFF ((1<<HT_OFF)|(1<<HT_START)|(1<<HT_PREHEAT)|(1<<HT_GLOW) \
+                           |(1<<HT_END)|(1<<HT_VENT)|(1<<HT_TEST)|(1<<HT_LOCKED))
+
+/* Per state bitmask of sensors (bit n is sensor n) of seq_bank which need
+   checking. Left out are limits no sensor value can pass (0, 0xffff, the
+   range of the virtual sensors) and trips back into a state which loops on
+   itself, without fault counting and error, as such a trip changes nothing. */
+extern unsigned short seq_trip[HT_LAST];
+
+/* Per state bitmask of sensors of seq_trip which can trip to HT_LOCKED */
+extern unsigned short seq_lock[HT_LAST];
+
+/* Incremented on each change of seq_bank, for users caching data set values */
+extern unsigned char seq_gen;
+
+#define WBUS_SERVER_MAX_ERR 11  /* error list entries */
+#define WBUS_SERVER_SNAP_SIZE 17  /* pre-encoded sensor pages, see wbus_server_snapshot() */
+#define WBUS_SERVER_PAGES 21      /* query pages, see query_page[] */
+#define WBUS_SERVER_PAGE_COPY 38  /* sum of state dependent query page sizes */
+
+#define WBUS_SERVER_TM_CMDS 24    /* frame counters per known command, the last one counts unknown commands */
+
+/* Server telemetry, see DIAG_TELEMETRY */
+typedef struct {
+  unsigned short rx[WBUS_SERVER_TM_CMDS]; /* received frames per known command, in command code order */
+  unsigned long snapshots;         /* sensor updates, see wbus_server_snapshot() */
+  unsigned short deadlines;        /* late answers and overlong task run slices */
+  unsigned short faults[HT_LAST];  /* sensor faults per heater state */
+  wb_link_stats_t *link;           /* statistics of the W-Bus handle or NULL, see wbus_link_stats() */
+} wbus_server_tm_t;
+
+#define WBUS_SERVER_LOG_BLOCK 256   /* bytes per log block, see LOG_READ */
+#define WBUS_SERVER_LOG_CH (NUM_SENSOR+NUM_ACT+1)  /* sensors, actuators, status */
+#define WBUS_SERVER_LOG_POST (2*JFREQ/HEATER_PERIOD)  /* records after an error until the log freezes */
+
+/* Heater state log, see WBUS_CMD_LOG */
+typedef struct {
+  unsigned char *buf;              /* nblk blocks of WBUS_SERVER_LOG_BLOCK bytes */
+  unsigned short nblk;
+  unsigned short cur;              /* index of the newest block in buf */
+  unsigned long first, last;       /* oldest and newest block number */
+  unsigned short fill;             /* bytes used in the newest block, 0 before the first record */
+  unsigned short rep;              /* offset of a repeat header which may be incremented, 0 if none */
+  unsigned long tick;              /* records so far, including the ones not recorded while frozen */
+  unsigned short prev[WBUS_SERVER_LOG_CH];
+  unsigned short post;             /* records left after an error until frozen */
+  unsigned char flags;             /* LOG_FROZEN, LOG_FAULT */
+  unsigned int rec_max;            /* longest wbus_server_log() in PFREQ units */
+} wbus_server_log_t;
+
+/* wbus_server_init() flags */
+#define WBUS_SERVER_PERSISTENT 1  /* Counters, error list and data sets in flash. Only one instance may have it. */
+
+/*
+ * One served heater. Everything the server keeps per heater lives here,
+ * so one process can serve many heaters (e.g. load tests, util/wbfarm).
+ */
+typedef struct {
+  heater_state_t *state;
+  unsigned char serial[7];         /* ident serial number */
+  unsigned char flags;
+  volatile signed char snap_cur;   /* -1 until first snapshot */
+  unsigned char snap[2][WBUS_SERVER_SNAP_SIZE];
+  err_info_t errors[WBUS_SERVER_MAX_ERR];
+  unsigned short page_ver_cur;     /* latest query page version, never 0 */
+  unsigned short page_ver[WBUS_SERVER_PAGES];       /* version of last change of each page */
+  unsigned char page_copy[WBUS_SERVER_PAGE_COPY];   /* last seen contents of state dependent pages */
+  wbus_server_tm_t tm;             /* counters to be maintained by the firmware: deadlines, faults, link */
+  unsigned short faulty;           /* sensors whose fault counter may be nonzero, see wbus_server_sensor_check() */
+  wbus_server_log_t *log;          /* heater state log or NULL, see wbus_server_log_init() */
+} wbus_server_t;
+
 /* Global work buffer */
 
 extern unsigned char wbdata[512];
 
 /*
- * Initialize heater state struct.
+ * Initialize server instance serving heater state s. Persistent data and
+ * the error list are restored from flash if flags has WBUS_SERVER_PERSISTENT.
+ * srv->serial may be changed afterwards. All instances share the data
+ * sets of seq_bank.
  */
-void wbus_server_init(heater_state_t *s);
+void wbus_server_init(wbus_server_t *srv, heater_state_t *s, int flags);
 
 /*
- * Store heater state struct into non-volatile memory.
+ * Store static_data of heater state struct into non-volatile memory if it
+ * changed since last time. Takes a few bytes of flash journal space.
+ * Does nothing for instances which are not persistent.
+ */
+void wbus_server_store(wbus_server_t *srv);
+
+/**
+ * \brief Encode sensor dependent query replies from current sensor values.
+ *        Call after each sensor update, queries are then answered from the
+ *        latest snapshot instead of the live heater state.
+ */
+void wbus_server_snapshot(wbus_server_t *srv);
+
+/**
+ * \brief Attach a heater state log of nblk blocks of WBUS_SERVER_LOG_BLOCK
+ *        bytes in buf to the server instance.
+ */
+void wbus_server_log_init(wbus_server_t *srv, wbus_server_log_t *log, unsigned char *buf, int nblk);
+
+/**
+ * \brief Record sensors, actuators and status into the log. Call once per
+ *        HEATER_PERIOD. Takes a bounded time, no matter what changed. The
+ *        log freezes itself shortly after wbus_error_add().
  */
-void wbus_server_store(heater_state_t *s);
+void wbus_server_log(wbus_server_t *srv);
 
 /**
- * \brief Decode given W-Bus message, and generate answer based on given
- *        heater state.
+ * \brief Decode given W-Bus message, and generate answer based on the heater
+ *        state of the given instance.
  */
-int wbus_server_process(unsigned char cmd, unsigned char *data, int *len, heater_state_t *s);
+int wbus_server_process(wbus_server_t *srv, unsigned char cmd, unsigned char *data, int *len);
 
 /**
  * \brief add error to error list
  */
-void wbus_error_add(heater_state_t *state, unsigned char code, unsigned char n, unsigned char* tmp);
+void wbus_error_add(wbus_server_t *srv, unsigned char code, unsigned char n);
+
+/**
+ * \brief Check the sensors of the heater state which are in mask and
+ *        seq_trip of its status against the trip values of seq_bank.
+ *        Fault counters of sensors out of range are incremented, the
+ *        others decremented.
+ * \return first sensor whose fault counter exceeds max_faults, or -1.
+ *        Sensors after it are not checked.
+ */
+int wbus_server_sensor_check(wbus_server_t *srv, unsigned short mask);
 
 #endif /* __WBUS_SERVER_H__ */
 
@@ -0,0 +1,153 @@
+/*
+ * Fixed point signal processing for sensor data.
+ *
+ * License: BSD
+ */
+
+#include "dsp.h"
+#include "machine.h"
+
+void dsp_ma_init(dsp_ma_t *f, unsigned short *x, unsigned char ld, unsigned short v)
+{
+  int i;
+
+  f->x = x;
+  f->ld = ld;
+  f->i = 0;
+  for (i=0; i<(1<<ld); i++) {
+    x[i] = v;
+  }
+  f->sum = (unsigned long)v<<ld;
+}
+
+unsigned short dsp_ma(dsp_ma_t *f, unsigned short v)
+{
+  /* Running sum, no need to add up the whole window */
+  f->sum += v;
+  f->sum -= f->x[f->i];
+  f->x[f->i] = v;
+  f->i = (f->i+1) & ((1<<f->ld)-1);
+
+  /* Rounded */
+  return (f->sum + ((1<<f->ld)>>1)) >> f->ld;
+}
+
+void dsp_iir1_init(dsp_iir1_t *f, unsigned char ld, unsigned short v)
+{
+  f->ld = ld;
+  f->acc = (unsigned long)v<<ld;
+}
+
+unsigned short dsp_iir1(dsp_iir1_t *f, unsigned short v)
+{
+  f->acc -= f->acc >> f->ld;
+  f->acc += v;
+
+  return f->acc >> f->ld;
+}
+
+void dsp_biquad_init(dsp_biquad_t *f, const signed short c[5], signed short v)
+{
+  signed long d;
+
+  f->b0 = c[0];
+  f->b1 = c[1];
+  f->b2 = c[2];
+  f->na1 = -c[3];
+  f->na2 = -c[4];
+  f->e = 0;
+
+  /* Steady state output is v*(b0+b1+b2)/(1+a1+a2) */
+  f->x1 = f->x2 = v;
+  d = 16384L + c[3] + c[4];
+  if (d != 0) {
+    f->y1 = f->y2 = ((signed long)v * ((signed long)c[0] + c[1] + c[2])) / d;
+  } else {
+    f->y1 = f->y2 = 0;
+  }
+}
+
+signed short dsp_biquad(dsp_biquad_t *f, signed short v)
+{
+  signed long acc;
+  signed short y;
+
+  /* The fraction cut off by the truncation to the output is added to the
+     next sum (error feedback). The rounding error then has no DC part, so
+     the feedback cannot pile it up at low cut off frequencies. */
+  acc = mac_s16xs16_3(v, f->b0, f->x1, f->b1, f->x2, f->b2)
+      + mac_s16xs16_3(f->y1, f->na1, f->y2, f->na2, f->e, 1);
+  y = acc >> 14;
+  f->e = acc & 0x3fff;
+
+  f->x2 = f->x1;
+  f->x1 = v;
+  f->y2 = f->y1;
+  f->y1 = y;
+
+  return y;
+}
+
+void dsp_median_init(dsp_median_t *f, unsigned short *x, unsigned char n, unsigned short v)
+{
+  int i;
+
+  if (n > DSP_MEDIAN_MAX) {
+    n = DSP_MEDIAN_MAX;
+  }
+  /* Even windows are rounded down, x may not have room for more */
+  if (n == 0) {
+    n = 1;
+  }
+  f->x = x;
+  f->n = (n-1) | 1;
+  f->i = 0;
+  for (i=0; i<f->n; i++) {
+    x[i] = v;
+  }
+}
+
+unsigned short dsp_median(dsp_median_t *f, unsigned short v)
+{
+  unsigned short s[DSP_MEDIAN_MAX], t;
+  int i, j;
+
+  f->x[f->i] = v;
+  if (++f->i >= f->n) {
+    f->i = 0;
+  }
+
+  /* Insertion sort, the windows are tiny */
+  for (i=0; i<f->n; i++) {
+    t = f->x[i];
+    for (j=i; j>0 && s[j-1] > t; j--) {
+      s[j] = s[j-1];
+    }
+    s[j] = t;
+  }
+
+  return s[f->n>>1];
+}
+
+void dsp_hyst_init(dsp_hyst_t *h, signed short lo, signed short hi, unsigned char n)
+{
+  h->lo = lo;
+  h->hi = hi;
+  h->n = n;
+  h->cnt = 0;
+  h->on = 0;
+}
+
+unsigned char dsp_hyst(dsp_hyst_t *h, signed short v)
+{
+  if ( (h->on == 0 && v > h->hi) || (h->on != 0 && v < h->lo) ) {
+    if (++h->cnt >= h->n) {
+      h->on = !h->on;
+      h->cnt = 0;
+    }
+  } else {
+    h->cnt = 0;
+  }
+
+  return h->on;
+}
@@ -6,17 +6,42 @@
 
 #define TS_SUSPEND  1    /* Suspended until explicit wakeup */
 #define TS_SLEEP    2    /* Suspended until timeout         */
+#define TS_READY    4    /* Task is queued in the ready list */
+#define TS_NEW      8    /* Task was never dispatched yet    */
+#define TS_WOKEN   16    /* kernel_wakeup() time stamp valid */
 #define TASK_RUNNING(t)  ((t.flags & TS_SUSPEND) == 0)
 #define TASK_SLEEPING(t) (t.flags & TS_SLEEP)
 
 #define min(a,b) (((a)<(b))?(a):(b))
 
+/* Marks a task which is not in the sleep queue */
+#define KQ_NONE 0xff
+#if (KERNEL_MAX_TASK >= KQ_NONE)
+#error KERNEL_MAX_TASK too large
+#endif
+/* Fill pattern of unused stack memory, for high water mark detection */
+#define KERNEL_STACK_PAINT 0xa5
+/* Longest time the idle loop sleeps without looking at the queues */
+#define KERNEL_IDLE_MAX MSEC2JIFFIES(1000)
+/* Bits per pending wakeup word */
+#define WP_BITS (8*sizeof(unsigned int))
+
 typedef struct {
   jmp_buf jb;
   kernel_task_t func;
-  unsigned int st;
+  unsigned long wake;         /* sleep time in jiffies, absolute once queued */
+  int *stack;                 /* initial stack pointer (top of stack area) */
   unsigned int stack_size;
   unsigned char flags;
+  unsigned char sq;           /* position in sleep queue or KQ_NONE */
+  unsigned char rq;           /* position in ready queue if TS_READY */
+  unsigned int rseq;          /* ready queue arrival, FIFO among equals */
+  unsigned char prio;         /* higher values are dispatched first */
+  unsigned int deadline;      /* relative deadline in jiffies, 0 if none */
+  unsigned long due;          /* absolute deadline of current activation */
+#ifdef KERNEL_PROFILE
+  unsigned int woken;         /* time of first pending kernel_wakeup() */
+#endif
 } uTask_t;
 
 static jmp_buf kTask;                   /* Kernel task buffer         */
@@ -24,20 +49,51 @@ static uTask_t uTask[KERNEL_MAX_TASK];  /* User task context struct   */
 static unsigned int iTask;              /* Current user task          */
 static unsigned int nTask;		 /* Number of registered tasks */
 static int uStack[KERNEL_STACK_SIZE];
+static int *pStack;                     /* Top of unassigned stack    */
+
+/* Sleep queue: min-heap of task indices ordered by absolute wake time */
+static unsigned char sleepq[KERNEL_MAX_TASK];
+static unsigned char nSleep;
+/* Ready queue: heap of runnable task indices in dispatch order */
+static unsigned char readyq[KERNEL_MAX_TASK];
+static unsigned char nReady;
+static unsigned int rSeq;
+static kernel_deadline_hook_t kDeadlineHook;
+/* Wakeups requested by kernel_wakeup(), possibly from interrupt context.
+   Only the scheduler moves tasks between queues. */
+static volatile unsigned int wPend[(KERNEL_MAX_TASK+WP_BITS-1)/WP_BITS];
+/* Time base. Extends machine_getJiffies() to long to avoid wrap around
+   trouble with 16 bit timers. */
+static unsigned long kNow;
+static unsigned int pct;
+
+#ifdef KERNEL_PROFILE
+static kernel_prof_t uProf[KERNEL_MAX_TASK];
+static unsigned int tDispatch;          /* Start of current time slice */
+#endif
 
 void kernel_init(void)
 {
   machine_init();
   memset(uTask, 0, sizeof(uTask));
-  memset(uStack, 0, sizeof(uStack)); 
+  memset(uStack, KERNEL_STACK_PAINT, sizeof(uStack));
+  memset((void*)wPend, 0, sizeof(wPend));
+  pStack = uStack+KERNEL_STACK_SIZE-1;
   nTask = 0;
+  nSleep = 0;
+  nReady = 0;
+  rSeq = 0;
+  kDeadlineHook = NULL;
+#ifdef KERNEL_PROFILE
+  memset(uProf, 0, sizeof(uProf));
+#endif
 }
 
 #if defined(__linux__) || defined(_WIN32)
 static int gKernelRunning=0;
 int kernel_running(void)
 {
-  return gKernelRunning;     
+  return gKernelRunning;
 }
 #endif
 
@@ -49,7 +105,8 @@ void kernel_suspend(void)
 
 void kernel_sleep(unsigned int j)
 {
-  uTask[iTask].st = j;
+  /* Relative for now, made absolute when the task is queued */
+  uTask[iTask].wake = j;
   uTask[iTask].flags |= TS_SLEEP;
 }
 
@@ -57,22 +114,32 @@ void kernel_yield(void)
 {
   if (my_setjmp(uTask[iTask].jb) == 0) {
     my_longjmp(kTask, 1);
-  }    
+  }
 }
 
 void kernel_wakeup(int task)
 {
   if (task == -1) {
     int i;
-    
+
     for (i=0; i<nTask; i++) {
-      uTask[i].flags &= ~(TS_SLEEP|TS_SUSPEND);
+      kernel_wakeup(i);
     }
   } else {
     uTask[task].flags &= ~(TS_SLEEP|TS_SUSPEND);
+#ifdef KERNEL_PROFILE
+    if ((uTask[task].flags & TS_WOKEN) == 0) {
+      uTask[task].woken = machine_getProfClock();
+      uTask[task].flags |= TS_WOKEN;
+    }
+#endif
+    wPend[task/WP_BITS] |= 1U<<(task%WP_BITS);
   }
 }
 
+static void readyq_put(unsigned char t);
+static void readyq_update(unsigned char t);
+
 unsigned int kernel_getTask(void)
 {
   return iTask;
@@ -80,93 +147,572 @@ unsigned int kernel_getTask(void)
 
 int kernel_task_register(kernel_task_t task, int stack_size)
 {
+  if (nTask >= KERNEL_MAX_TASK || stack_size <= 0 || stack_size > pStack-uStack+1) {
+    PRINTF("kernel_task_register() failed, %d tasks, %d stack left\n", nTask, (int)(pStack-uStack+1));
+    return -1;
+  }
+
   uTask[nTask].func = task;
-  uTask[nTask].flags = 0;
+  uTask[nTask].flags = TS_NEW;
+  uTask[nTask].stack = pStack;
   uTask[nTask].stack_size = stack_size;
+  uTask[nTask].sq = KQ_NONE;
+  pStack -= stack_size;
   nTask++;
-  
+
+  /* The task is started on its first dispatch */
+  readyq_put(nTask-1);
+
   return nTask-1;
 }
 
-static unsigned int pct = 0;
+int kernel_task_priority(int task, unsigned char prio)
+{
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  uTask[task].prio = prio;
+  readyq_update(task);
 
-unsigned char kernel_get_next_task(unsigned char t)
+  return 0;
+}
+
+int kernel_task_deadline(int task, unsigned int deadline)
 {
-  unsigned int ct, kt;
-  unsigned char i;
-  
-  do {
-    kt = machine_getJiffies();
-    ct = kt - pct;
-    pct = kt;
-    kt = (unsigned int)0xffffffff;
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  uTask[task].deadline = deadline;
+  readyq_update(task);
 
-    /* decrement sleep time counters */
-    for (i=0; i<nTask; i++) {
-      if (uTask[i].st < ct) {
-        uTask[i].st = 0;
-      } else {
-        uTask[i].st -= ct;
+  return 0;
+}
+
+void kernel_deadline_hook(kernel_deadline_hook_t hook)
+{
+  kDeadlineHook = hook;
+}
+
+int kernel_task_register_parallel(kernel_task_t task, int stack_size)
+{
+  /* Everything runs on one stack of execution anyway */
+  return kernel_task_register(task, stack_size);
+}
+
+int kernel_stack_usage(int task)
+{
+  unsigned char *p, *end;
+
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  /* Scan upwards from the bottom until the paint pattern was overwritten */
+  p = (unsigned char*)(uTask[task].stack - uTask[task].stack_size + 1);
+  end = (unsigned char*)(uTask[task].stack + 1);
+  while (p < end && *p == KERNEL_STACK_PAINT) {
+    p++;
+  }
+
+  return (end-p+sizeof(int)-1)/sizeof(int);
+}
+
+int kernel_stack_size(int task)
+{
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  return uTask[task].stack_size;
+}
+
+#ifdef KERNEL_PROFILE
+int kernel_profile_get(int task, kernel_prof_t *p)
+{
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  *p = uProf[task];
+
+  return 0;
+}
+
+void kernel_profile_reset(void)
+{
+  memset(uProf, 0, sizeof(uProf));
+}
+
+/* Account the start of a time slice of task t */
+static
+void kernel_profile_dispatch(unsigned char t)
+{
+  tDispatch = machine_getProfClock();
+  uProf[t].dispatches++;
+  if (uTask[t].flags & TS_WOKEN) {
+    unsigned int l = tDispatch - uTask[t].woken;
+
+    uTask[t].flags &= ~TS_WOKEN;
+    uProf[t].wakeups++;
+    uProf[t].latency += l;
+    if (l > uProf[t].max_latency) {
+      uProf[t].max_latency = l;
+    }
+  }
+}
+
+/* Account the end of a time slice of task t, after it yielded */
+static
+void kernel_profile_return(unsigned char t)
+{
+  unsigned int s = machine_getProfClock() - tDispatch;
+
+  uProf[t].run_time += s;
+  if (s > uProf[t].max_slice) {
+    uProf[t].max_slice = s;
+  }
+}
+#else
+#define kernel_profile_dispatch(t)
+#define kernel_profile_return(t)
+#endif
+
+void kernel_sem_init(kernel_sem_t *s, unsigned int count)
+{
+  s->count = count;
+  memset((void*)s->waiters, 0, sizeof(s->waiters));
+}
+
+int kernel_sem_wait(kernel_sem_t *s, unsigned int timeout)
+{
+  volatile unsigned int *wm = &s->waiters[iTask/KERNEL_MASK_BITS];
+  unsigned int m = 1U<<(iTask%KERNEL_MASK_BITS);
+  unsigned int t0 = machine_getJiffies();
+
+  while (s->count == 0) {
+    if (timeout != 0) {
+      unsigned int el = machine_getJiffies() - t0;
+
+      if (el >= timeout) {
+        return -1;
       }
+      kernel_sleep(timeout - el);
+    } else {
+      kernel_suspend();
     }
+    /* Register as waiter before checking again, so that a post in between
+       is not lost. */
+    *wm |= m;
+    if (s->count != 0) {
+      uTask[iTask].flags &= ~(TS_SLEEP|TS_SUSPEND);
+      *wm &= ~m;
+      break;
+    }
+    kernel_yield();
+    *wm &= ~m;
+  }
+  s->count--;
 
-    for (i=nTask; i!=0; i--) {
-      t++;
-      if (t>=nTask) {
-        t=0;
-      }    
-      if ( TASK_SLEEPING(uTask[t]) ) {
-        if ( uTask[t].st == 0 ) {
-          uTask[t].flags &= ~TS_SLEEP;
-          kt = 0;
-          break;
-        }
-        /* task is sleeping, see if it is time to wake it up */
-        kt = min(uTask[t].st, kt);
-      } else {
-        if (TASK_RUNNING(uTask[t])) {
-          /* task i is not sleeping, so take it */
-          kt = 0;
-          break;
-        }
+  return 0;
+}
+
+static
+void kernel_sem_wake(kernel_sem_t *s)
+{
+  unsigned int m;
+  int w, t;
+
+  for (w=0; w<KERNEL_MASK_WORDS; w++) {
+    for (t=w*KERNEL_MASK_BITS, m=s->waiters[w]; m!=0; t++, m>>=1) {
+      if (m & 1) {
+        kernel_wakeup(t);
       }
     }
+  }
+}
+
+void kernel_sem_post(kernel_sem_t *s)
+{
+  s->count++;
+  kernel_sem_wake(s);
+}
+
+void kernel_event_signal(kernel_event_t *e)
+{
+  e->count = 1;
+  kernel_sem_wake(e);
+}
+
+void kernel_mbox_init(kernel_mbox_t *m, void *buf, unsigned char size, unsigned char depth)
+{
+  m->buf = buf;
+  m->size = size;
+  m->depth = depth;
+  m->head = 0;
+  kernel_sem_init(&m->msgs, 0);
+}
+
+int kernel_mbox_put(kernel_mbox_t *m, const void *msg)
+{
+  if (m->msgs.count >= m->depth) {
+    return -1;
+  }
+  memcpy(m->buf + ((m->head + m->msgs.count) % m->depth) * m->size, msg, m->size);
+  kernel_sem_post(&m->msgs);
+
+  return 0;
+}
 
-    if (kt != 0) {
-      /* nothing to do until kt jiffies */
-      machine_jsleep(kt);
+int kernel_mbox_get(kernel_mbox_t *m, void *msg, unsigned int timeout)
+{
+  if (kernel_sem_wait(&m->msgs, timeout) != 0) {
+    return -1;
+  }
+  memcpy(msg, m->buf + m->head * m->size, m->size);
+  m->head = (m->head + 1) % m->depth;
+
+  return 0;
+}
+
+/* Wrap around safe time comparison */
+#define WAKE_BEFORE(a,b) ((signed long)(uTask[a].wake - uTask[b].wake) < 0)
+
+static
+void sleepq_swap(unsigned char i, unsigned char j)
+{
+  unsigned char t;
+
+  t = sleepq[i];
+  sleepq[i] = sleepq[j];
+  sleepq[j] = t;
+  uTask[sleepq[i]].sq = i;
+  uTask[sleepq[j]].sq = j;
+}
+
+static
+void sleepq_up(unsigned char i)
+{
+  while (i > 0) {
+    unsigned char p = (i-1)>>1;
+
+    if (!WAKE_BEFORE(sleepq[i], sleepq[p])) {
+      break;
     }
+    sleepq_swap(i, p);
+    i = p;
+  }
+}
+
+static
+void sleepq_down(unsigned char i)
+{
+  while (1) {
+    unsigned char c = (i<<1)+1;
+
+    if (c >= nSleep) {
+      break;
+    }
+    if (c+1 < nSleep && WAKE_BEFORE(sleepq[c+1], sleepq[c])) {
+      c++;
+    }
+    if (!WAKE_BEFORE(sleepq[c], sleepq[i])) {
+      break;
+    }
+    sleepq_swap(i, c);
+    i = c;
+  }
+}
+
+static
+void sleepq_insert(unsigned char t)
+{
+  sleepq[nSleep] = t;
+  uTask[t].sq = nSleep;
+  nSleep++;
+  sleepq_up(nSleep-1);
+}
+
+static
+void sleepq_remove(unsigned char t)
+{
+  unsigned char i = uTask[t].sq;
+
+  uTask[t].sq = KQ_NONE;
+  nSleep--;
+  if (i != nSleep) {
+    sleepq[i] = sleepq[nSleep];
+    uTask[sleepq[i]].sq = i;
+    sleepq_down(i);
+    sleepq_up(i);
+  }
+}
+
+static
+void kernel_update_time(void)
+{
+  unsigned int kt;
+
+  kt = machine_getJiffies();
+  kNow += (unsigned int)(kt - pct);
+  pct = kt;
+}
+
+/* Dispatch order: priority first, then earliest deadline, tasks without
+   deadline last, then FIFO */
+static
+int readyq_before(unsigned char a, unsigned char b)
+{
+  if (uTask[a].prio != uTask[b].prio) {
+    return uTask[a].prio > uTask[b].prio;
+  }
+  if ((uTask[a].deadline != 0) != (uTask[b].deadline != 0)) {
+    return uTask[a].deadline != 0;
+  }
+  if (uTask[a].deadline != 0 && uTask[a].due != uTask[b].due) {
+    return (signed long)(uTask[a].due - uTask[b].due) < 0;
+  }
+  return (signed int)(uTask[a].rseq - uTask[b].rseq) < 0;
+}
+
+static
+void readyq_swap(unsigned char i, unsigned char j)
+{
+  unsigned char t;
+
+  t = readyq[i];
+  readyq[i] = readyq[j];
+  readyq[j] = t;
+  uTask[readyq[i]].rq = i;
+  uTask[readyq[j]].rq = j;
+}
+
+static
+void readyq_up(unsigned char i)
+{
+  while (i > 0) {
+    unsigned char p = (i-1)>>1;
+
+    if (!readyq_before(readyq[i], readyq[p])) {
+      break;
+    }
+    readyq_swap(i, p);
+    i = p;
+  }
+}
+
+static
+void readyq_down(unsigned char i)
+{
+  while (1) {
+    unsigned char c = (i<<1)+1;
+
+    if (c >= nReady) {
+      break;
+    }
+    if (c+1 < nReady && readyq_before(readyq[c+1], readyq[c])) {
+      c++;
+    }
+    if (!readyq_before(readyq[c], readyq[i])) {
+      break;
+    }
+    readyq_swap(i, c);
+    i = c;
+  }
+}
+
+static
+void readyq_put(unsigned char t)
+{
+  if (uTask[t].flags & TS_READY) {
+    return;
+  }
+  uTask[t].flags |= TS_READY;
+  if (uTask[t].deadline != 0) {
+    kernel_update_time();
+    uTask[t].due = kNow + uTask[t].deadline;
+  }
+  uTask[t].rseq = rSeq++;
+  readyq[nReady] = t;
+  uTask[t].rq = nReady;
+  nReady++;
+  readyq_up(nReady-1);
+}
+
+static
+unsigned char readyq_get(void)
+{
+  unsigned char t = readyq[0];
+
+  nReady--;
+  if (nReady > 0) {
+    readyq[0] = readyq[nReady];
+    uTask[readyq[0]].rq = 0;
+    readyq_down(0);
+  }
+  uTask[t].flags &= ~TS_READY;
 
-  } while ( (!TASK_RUNNING(uTask[t])) || TASK_SLEEPING(uTask[t]));
-  
   return t;
 }
 
+/* Restore the order after the priority or deadline of t changed */
+static
+void readyq_update(unsigned char t)
+{
+  if (uTask[t].flags & TS_READY) {
+    readyq_down(uTask[t].rq);
+    readyq_up(uTask[t].rq);
+  }
+}
+
+/* Report a task which gave back control after its deadline passed */
+static
+void kernel_check_deadline(unsigned char t)
+{
+  signed long late;
+
+  if (uTask[t].deadline == 0 || kDeadlineHook == NULL) {
+    return;
+  }
+  kernel_update_time();
+  late = kNow - uTask[t].due;
+  if (late > 0) {
+    kDeadlineHook(t, late);
+  }
+}
+
+/* Put a task which just gave back control into the queue it belongs to. */
+static
+void kernel_requeue(unsigned char t)
+{
+  if (!TASK_RUNNING(uTask[t])) {
+    return;
+  }
+  if (TASK_SLEEPING(uTask[t])) {
+    kernel_update_time();
+    uTask[t].wake += kNow;
+    sleepq_insert(t);
+  } else {
+    readyq_put(t);
+  }
+}
+
+/* Move tasks woken up through kernel_wakeup() into the ready list. */
+static
+void kernel_drain_wakeups(void)
+{
+  unsigned char w;
+
+  for (w=0; w<sizeof(wPend)/sizeof(wPend[0]); w++) {
+    unsigned int m;
+    unsigned char t;
+
+    if (wPend[w] == 0) {
+      continue;
+    }
+    m = wPend[w];
+    wPend[w] &= ~m;
+    for (t=w*WP_BITS; m!=0; t++, m>>=1) {
+      if ((m & 1) == 0) {
+        continue;
+      }
+      /* The task may have gone back to sleep since. */
+      if (uTask[t].flags & (TS_SLEEP|TS_SUSPEND)) {
+        continue;
+      }
+      if (uTask[t].sq != KQ_NONE) {
+        sleepq_remove(t);
+      }
+      readyq_put(t);
+    }
+  }
+}
+
+/* Wakeups that came in since the last kernel_drain_wakeups() */
+static
+int kernel_wakeups_pending(void)
+{
+  unsigned char w;
+
+  for (w=0; w<sizeof(wPend)/sizeof(wPend[0]); w++) {
+    if (wPend[w] != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Move all tasks whose wake time has passed into the ready list. */
+static
+void kernel_expire_sleepers(void)
+{
+  kernel_update_time();
+  while (nSleep > 0 && (signed long)(uTask[sleepq[0]].wake - kNow) <= 0) {
+    unsigned char t = sleepq[0];
+
+    sleepq_remove(t);
+    uTask[t].flags &= ~TS_SLEEP;
+    readyq_put(t);
+  }
+}
+
+unsigned char kernel_get_next_task(void)
+{
+  while (1) {
+    unsigned long kt;
+
+    kernel_drain_wakeups();
+    if (nSleep > 0) {
+      kernel_expire_sleepers();
+    }
+    if (nReady > 0) {
+      break;
+    }
+
+    /* nothing to do until the first sleeper is due */
+    kt = KERNEL_IDLE_MAX;
+    if (nSleep > 0) {
+      kt = min(uTask[sleepq[0]].wake - kNow, kt);
+    }
+    machine_idle_sleep(kt, kernel_wakeups_pending);
+  }
+
+  return readyq_get();
+}
+
 void kernel_run_threads(void)
 {
-  iTask = nTask-1;
   while (1) {
-    iTask = kernel_get_next_task(iTask);
+    iTask = kernel_get_next_task();
+    kernel_profile_dispatch(iTask);
     if ( my_setjmp(kTask) == 0) {
-      my_longjmp(uTask[iTask].jb, 1);
+      if (uTask[iTask].flags & TS_NEW) {
+        uTask[iTask].flags &= ~TS_NEW;
+        setup_task(uTask[iTask].stack, uTask[iTask].func);
+      } else {
+        my_longjmp(uTask[iTask].jb, 1);
+      }
     }
+    kernel_profile_return(iTask);
+    kernel_check_deadline(iTask);
+    kernel_requeue(iTask);
   }
 }
 
 void kernel_run(void)
 {
-  int *pStack = uStack+KERNEL_STACK_SIZE-1;
-
 #if defined(__linux__) || defined(_WIN32)
   gKernelRunning = 1;
 #endif
 
-  for (iTask=0; iTask<nTask; iTask++) {
-    if ( my_setjmp(kTask) == 0 ) {
-      setup_task(pStack, uTask[iTask].func);
+  kNow = 0;
+  pct = machine_getJiffies();
+  {
+    unsigned char t;
+
+    /* First activation of all tasks starts now */
+    for (t=0; t<nTask; t++) {
+      uTask[t].due = uTask[t].deadline;
+      readyq_update(t);
     }
-    pStack -= uTask[iTask].stack_size;
-  }  
+  }
 
-  kernel_run_threads();  
+  kernel_run_threads();
 }
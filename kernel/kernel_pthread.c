@@ -0,0 +1,608 @@
+/*
+ * Kernel API on top of POSIX threads
+ *
+ * Author: Manuel Jander
+ * License: BSD
+ *
+ * Every task gets its own thread. Tasks registered with kernel_task_register()
+ * share one lock, which is only released while the task is blocked in
+ * kernel_yield(), so they keep their cooperative semantics among each other.
+ * Tasks registered with kernel_task_register_parallel() do not take that lock
+ * and run in parallel to everything else. They should talk to other tasks
+ * only through the kernel synchronization primitives.
+ *
+ * Priorities are stored, but the order in which threads get the lock is up
+ * to the operating system. Deadlines are checked, see kernel_task_deadline().
+ *
+ * Signals used as interrupts (SIGALRM, SIGIO) are blocked in all threads and
+ * handled by the thread which called kernel_run(). Their handlers are called
+ * there once that thread got the lock, so unlike a real interrupt they never
+ * preempt a cooperative task, but wait until it blocks in kernel_yield().
+ * Their latency is bounded by the longest run slice of any such task.
+ *
+ * Thread stacks are allocated and painted here, so kernel_stack_usage()
+ * works as with the cooperative kernel. The stack also holds the thread
+ * control block and TLS of the C library, which count as used.
+ */
+
+#ifndef __linux__
+#error The pthread kernel backend requires Linux
+#endif
+
+#include "machine.h"
+#include "kernel.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TS_SUSPEND  1    /* Suspended until explicit wakeup */
+#define TS_SLEEP    2    /* Suspended until timeout         */
+#define TS_WOKEN   16    /* kernel_wakeup() time stamp valid */
+
+#define KERNEL_STACK_PAINT 0xa5
+
+
+typedef struct {
+  pthread_t thread;
+  pthread_cond_t cv;
+  kernel_task_t func;
+  struct timespec wake;       /* absolute CLOCK_MONOTONIC wake up time */
+  unsigned char *stack;       /* lowest address of the thread stack */
+  unsigned int stack_size;
+  unsigned char flags;
+  unsigned char parallel;     /* does not take the kernel lock */
+  unsigned char prio;
+  unsigned int deadline;      /* relative deadline in jiffies, 0 if none */
+  unsigned int ready;         /* jiffies when the task got ready */
+#ifdef KERNEL_PROFILE
+  unsigned int woken;         /* time of first pending kernel_wakeup() */
+  unsigned int tDispatch;     /* start of current time slice */
+#endif
+} uTask_t;
+
+static pthread_mutex_t kLock = PTHREAD_MUTEX_INITIALIZER;
+static uTask_t uTask[KERNEL_MAX_TASK];  /* User task context struct   */
+static unsigned int nTask;              /* Number of registered tasks */
+static int gKernelRunning=0;
+static kernel_deadline_hook_t kDeadlineHook;
+
+static __thread int iTask;              /* Current user task          */
+static __thread int kHeld;              /* Current thread holds kLock */
+
+#ifdef KERNEL_PROFILE
+static kernel_prof_t uProf[KERNEL_MAX_TASK];
+#endif
+
+/* Take kLock unless already held. Returns 1 if it must be released again. */
+static
+int kernel_lock(void)
+{
+  if (kHeld) {
+    return 0;
+  }
+  pthread_mutex_lock(&kLock);
+  kHeld = 1;
+
+  return 1;
+}
+
+static
+void kernel_unlock(int taken)
+{
+  if (taken) {
+    kHeld = 0;
+    pthread_mutex_unlock(&kLock);
+  }
+}
+
+void kernel_init(void)
+{
+  machine_init();
+  memset(uTask, 0, sizeof(uTask));
+  nTask = 0;
+#ifdef KERNEL_PROFILE
+  memset(uProf, 0, sizeof(uProf));
+#endif
+}
+
+int kernel_running(void)
+{
+  return gKernelRunning;
+}
+
+#ifdef KERNEL_PROFILE
+int kernel_profile_get(int task, kernel_prof_t *p)
+{
+  int l;
+
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  l = kernel_lock();
+  *p = uProf[task];
+  kernel_unlock(l);
+
+  return 0;
+}
+
+void kernel_profile_reset(void)
+{
+  int l;
+
+  l = kernel_lock();
+  memset(uProf, 0, sizeof(uProf));
+  kernel_unlock(l);
+}
+
+/* Called with kLock held */
+static
+void kernel_profile_dispatch(int t)
+{
+  uTask[t].tDispatch = machine_getProfClock();
+  uProf[t].dispatches++;
+  if (uTask[t].flags & TS_WOKEN) {
+    unsigned int l = uTask[t].tDispatch - uTask[t].woken;
+
+    uTask[t].flags &= ~TS_WOKEN;
+    uProf[t].wakeups++;
+    uProf[t].latency += l;
+    if (l > uProf[t].max_latency) {
+      uProf[t].max_latency = l;
+    }
+  }
+}
+
+/* Called with kLock held */
+static
+void kernel_profile_return(int t)
+{
+  unsigned int s = machine_getProfClock() - uTask[t].tDispatch;
+
+  uProf[t].run_time += s;
+  if (s > uProf[t].max_slice) {
+    uProf[t].max_slice = s;
+  }
+}
+#else
+#define kernel_profile_dispatch(t)
+#define kernel_profile_return(t)
+#endif
+
+void kernel_suspend(void)
+{
+  int l;
+
+  l = kernel_lock();
+  uTask[iTask].flags |= TS_SUSPEND;
+  kernel_unlock(l);
+}
+
+void kernel_sleep(unsigned int j)
+{
+  struct timespec *w = &uTask[iTask].wake;
+  int l;
+
+  l = kernel_lock();
+  clock_gettime(CLOCK_MONOTONIC, w);
+  w->tv_sec += j/JFREQ;
+  w->tv_nsec += (long long)(j%JFREQ)*1000000000/JFREQ;
+  if (w->tv_nsec >= 1000000000) {
+    w->tv_nsec -= 1000000000;
+    w->tv_sec++;
+  }
+  uTask[iTask].flags |= TS_SLEEP;
+  kernel_unlock(l);
+}
+
+/* Wait until the current task is woken up. Called with kLock held. */
+static
+void kernel_block(void)
+{
+  uTask_t *t = &uTask[iTask];
+
+  while (t->flags & (TS_SLEEP|TS_SUSPEND)) {
+    if (t->flags & TS_SUSPEND) {
+      pthread_cond_wait(&t->cv, &kLock);
+    } else if (pthread_cond_timedwait(&t->cv, &kLock, &t->wake) == ETIMEDOUT) {
+      t->flags &= ~TS_SLEEP;
+      t->ready = machine_getJiffies();
+    }
+  }
+}
+
+/* Report if the current task gives back control after its deadline. Called with kLock held. */
+static
+void kernel_check_deadline(void)
+{
+  signed int late;
+
+  if (uTask[iTask].deadline == 0 || kDeadlineHook == NULL) {
+    return;
+  }
+  late = machine_getJiffies() - uTask[iTask].ready - uTask[iTask].deadline;
+  if (late > 0) {
+    kDeadlineHook(iTask, late);
+  }
+}
+
+void kernel_yield(void)
+{
+  int l;
+
+  l = kernel_lock();
+  kernel_profile_return(iTask);
+  kernel_check_deadline();
+  if (uTask[iTask].flags & (TS_SLEEP|TS_SUSPEND)) {
+    kernel_block();
+  } else {
+    if (!uTask[iTask].parallel) {
+      /* Give other cooperative tasks a chance to get the lock */
+      pthread_mutex_unlock(&kLock);
+      sched_yield();
+      pthread_mutex_lock(&kLock);
+    }
+    uTask[iTask].ready = machine_getJiffies();
+  }
+  kernel_profile_dispatch(iTask);
+  kernel_unlock(l);
+}
+
+/* Called with kLock held */
+static
+void kernel_wakeup_locked(int task)
+{
+  if (uTask[task].flags & (TS_SLEEP|TS_SUSPEND)) {
+    uTask[task].ready = machine_getJiffies();
+  }
+  uTask[task].flags &= ~(TS_SLEEP|TS_SUSPEND);
+#ifdef KERNEL_PROFILE
+  if ((uTask[task].flags & TS_WOKEN) == 0) {
+    uTask[task].woken = machine_getProfClock();
+    uTask[task].flags |= TS_WOKEN;
+  }
+#endif
+  pthread_cond_signal(&uTask[task].cv);
+}
+
+void kernel_wakeup(int task)
+{
+  int l;
+
+  l = kernel_lock();
+  if (task == -1) {
+    int i;
+
+    for (i=0; i<nTask; i++) {
+      kernel_wakeup_locked(i);
+    }
+  } else {
+    kernel_wakeup_locked(task);
+  }
+  kernel_unlock(l);
+}
+
+unsigned int kernel_getTask(void)
+{
+  return iTask;
+}
+
+static
+void *kernel_thread(void *arg)
+{
+  int l;
+
+  iTask = (uTask_t*)arg - uTask;
+  l = kernel_lock();
+  uTask[iTask].ready = machine_getJiffies();
+  kernel_profile_dispatch(iTask);
+  if (uTask[iTask].parallel) {
+    kernel_unlock(l);
+  }
+  uTask[iTask].func();
+  kernel_unlock(kHeld);
+
+  return NULL;
+}
+
+static
+int kernel_thread_start(int task)
+{
+  pthread_attr_t attr;
+  size_t ss;
+  int err;
+
+  ss = uTask[task].stack_size*sizeof(int);
+  if (ss < PTHREAD_STACK_MIN) {
+    ss = PTHREAD_STACK_MIN;
+  }
+  err = posix_memalign((void**)&uTask[task].stack, sizeof(long long)*2, ss);
+  if (err != 0) {
+    PRINTF("posix_memalign() failed: %s\n", strerror(err));
+    return -1;
+  }
+  memset(uTask[task].stack, KERNEL_STACK_PAINT, ss);
+  /* Report what the thread really got */
+  uTask[task].stack_size = ss/sizeof(int);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, uTask[task].stack, ss);
+  err = pthread_create(&uTask[task].thread, &attr, kernel_thread, &uTask[task]);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    PRINTF("pthread_create() failed: %s\n", strerror(err));
+    free(uTask[task].stack);
+    uTask[task].stack = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static
+int kernel_register(kernel_task_t task, int stack_size, int parallel)
+{
+  pthread_condattr_t ca;
+  int l, t;
+
+  l = kernel_lock();
+  if (nTask >= KERNEL_MAX_TASK || stack_size <= 0) {
+    PRINTF("kernel_task_register() failed, %d tasks\n", nTask);
+    kernel_unlock(l);
+    return -1;
+  }
+  t = nTask;
+  uTask[t].func = task;
+  uTask[t].stack_size = stack_size;
+  uTask[t].parallel = parallel;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&uTask[t].cv, &ca);
+  pthread_condattr_destroy(&ca);
+  if (gKernelRunning && kernel_thread_start(t) != 0) {
+    kernel_unlock(l);
+    return -1;
+  }
+  nTask++;
+  kernel_unlock(l);
+
+  return t;
+}
+
+int kernel_task_register(kernel_task_t task, int stack_size)
+{
+  return kernel_register(task, stack_size, 0);
+}
+
+int kernel_task_register_parallel(kernel_task_t task, int stack_size)
+{
+  return kernel_register(task, stack_size, 1);
+}
+
+int kernel_task_priority(int task, unsigned char prio)
+{
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  uTask[task].prio = prio;
+
+  return 0;
+}
+
+int kernel_task_deadline(int task, unsigned int deadline)
+{
+  int l;
+
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  l = kernel_lock();
+  uTask[task].deadline = deadline;
+  uTask[task].ready = machine_getJiffies();
+  kernel_unlock(l);
+
+  return 0;
+}
+
+void kernel_deadline_hook(kernel_deadline_hook_t hook)
+{
+  kDeadlineHook = hook;
+}
+
+int kernel_stack_usage(int task)
+{
+  unsigned char *p, *end;
+
+  if (task < 0 || task >= nTask || uTask[task].stack == NULL) {
+    return -1;
+  }
+  /* Stacks grow downwards, scan upwards from the bottom like kernel.c */
+  p = uTask[task].stack;
+  end = p + uTask[task].stack_size*sizeof(int);
+  while (p < end && *p == KERNEL_STACK_PAINT) {
+    p++;
+  }
+
+  return (end-p+sizeof(int)-1)/sizeof(int);
+}
+
+int kernel_stack_size(int task)
+{
+  if (task < 0 || task >= nTask) {
+    return -1;
+  }
+  return uTask[task].stack_size;
+}
+
+void kernel_sem_init(kernel_sem_t *s, unsigned int count)
+{
+  s->count = count;
+  memset((void*)s->waiters, 0, sizeof(s->waiters));
+}
+
+/* Called with kLock held */
+static
+int kernel_sem_wait_locked(kernel_sem_t *s, unsigned int timeout)
+{
+  volatile unsigned int *wm = &s->waiters[iTask/KERNEL_MASK_BITS];
+  unsigned int m = 1U<<(iTask%KERNEL_MASK_BITS);
+
+  if (s->count == 0 && timeout != 0) {
+    kernel_sleep(timeout);
+  }
+  while (s->count == 0) {
+    if (timeout != 0) {
+      if ((uTask[iTask].flags & TS_SLEEP) == 0) {
+        return -1;
+      }
+    } else {
+      uTask[iTask].flags |= TS_SUSPEND;
+    }
+    *wm |= m;
+    kernel_yield();
+    *wm &= ~m;
+    if (timeout != 0 && s->count == 0) {
+      /* Woken up for something else. Keep on sleeping if time is left. */
+      struct timespec now, *w = &uTask[iTask].wake;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > w->tv_sec || (now.tv_sec == w->tv_sec && now.tv_nsec >= w->tv_nsec)) {
+        return -1;
+      }
+      uTask[iTask].flags |= TS_SLEEP;
+    }
+  }
+  uTask[iTask].flags &= ~(TS_SLEEP|TS_SUSPEND);
+  s->count--;
+
+  return 0;
+}
+
+int kernel_sem_wait(kernel_sem_t *s, unsigned int timeout)
+{
+  int l, err;
+
+  l = kernel_lock();
+  err = kernel_sem_wait_locked(s, timeout);
+  kernel_unlock(l);
+
+  return err;
+}
+
+/* Called with kLock held */
+static
+void kernel_sem_wake(kernel_sem_t *s)
+{
+  unsigned int m;
+  int w, t;
+
+  for (w=0; w<KERNEL_MASK_WORDS; w++) {
+    for (t=w*KERNEL_MASK_BITS, m=s->waiters[w]; m!=0; t++, m>>=1) {
+      if (m & 1) {
+        kernel_wakeup_locked(t);
+      }
+    }
+  }
+}
+
+void kernel_sem_post(kernel_sem_t *s)
+{
+  int l;
+
+  l = kernel_lock();
+  s->count++;
+  kernel_sem_wake(s);
+  kernel_unlock(l);
+}
+
+void kernel_event_signal(kernel_event_t *e)
+{
+  int l;
+
+  l = kernel_lock();
+  e->count = 1;
+  kernel_sem_wake(e);
+  kernel_unlock(l);
+}
+
+void kernel_mbox_init(kernel_mbox_t *m, void *buf, unsigned char size, unsigned char depth)
+{
+  m->buf = buf;
+  m->size = size;
+  m->depth = depth;
+  m->head = 0;
+  kernel_sem_init(&m->msgs, 0);
+}
+
+int kernel_mbox_put(kernel_mbox_t *m, const void *msg)
+{
+  int l, err = -1;
+
+  l = kernel_lock();
+  if (m->msgs.count < m->depth) {
+    memcpy(m->buf + ((m->head + m->msgs.count) % m->depth) * m->size, msg, m->size);
+    m->msgs.count++;
+    kernel_sem_wake(&m->msgs);
+    err = 0;
+  }
+  kernel_unlock(l);
+
+  return err;
+}
+
+int kernel_mbox_get(kernel_mbox_t *m, void *msg, unsigned int timeout)
+{
+  int l, err;
+
+  l = kernel_lock();
+  err = kernel_sem_wait_locked(&m->msgs, timeout);
+  if (err == 0) {
+    memcpy(msg, m->buf + m->head * m->size, m->size);
+    m->head = (m->head + 1) % m->depth;
+  }
+  kernel_unlock(l);
+
+  return err;
+}
+
+void kernel_run(void)
+{
+  sigset_t ss;
+  int i;
+
+  /* Interrupt signals are only handled by this thread, through sigwait().
+     Threads inherit the blocked signal mask. */
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGALRM);
+  sigaddset(&ss, SIGIO);
+  pthread_sigmask(SIG_BLOCK, &ss, NULL);
+
+  pthread_mutex_lock(&kLock);
+  gKernelRunning = 1;
+  for (i=0; i<nTask; i++) {
+    kernel_thread_start(i);
+  }
+  pthread_mutex_unlock(&kLock);
+
+  while (1) {
+    struct sigaction sa;
+    int sig;
+
+    if (sigwait(&ss, &sig) != 0) {
+      continue;
+    }
+    sigaction(sig, NULL, &sa);
+    if (sa.sa_handler == SIG_DFL || sa.sa_handler == SIG_IGN) {
+      continue;
+    }
+    pthread_mutex_lock(&kLock);
+    kHeld = 1;
+    sa.sa_handler(sig);
+    kHeld = 0;
+    pthread_mutex_unlock(&kLock);
+  }
+}
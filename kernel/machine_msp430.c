@@ -746,6 +746,24 @@ void machine_jsleep(unsigned int j)
   machine_timer_destroy(hSleepTimer);
 }
 
+void machine_idle_sleep(unsigned int j, int (*pending)(void))
+{
+  j = JIFFIES2TIMER(j);
+
+  if (j==0) {
+    return;
+  }
+  hSleepTimer = machine_timer_create(j, sleep_timer, NULL);
+  dint();
+  if (pending()) {
+    eint();
+  } else {
+    /* Enabling interrupts and entering LPM0 in one instruction */
+    _BIS_SR(LPM0_bits | GIE);
+  }
+  machine_timer_destroy(hSleepTimer);
+}
+
 void machine_msleep(unsigned int b)
 {
   machine_jsleep(b*(JFREQ/1000));
@@ -1074,3 +1092,43 @@ void flash_write(void *_fptr, void *_rptr, int nbytes)
   eint();
 }
 #endif
+
+void flash_program(void *_fptr, const void *_rptr, int nbytes)
+{
+  int wdg;
+  int *fptr = _fptr;
+  const int *rptr = _rptr;
+  int words = (nbytes+1)>>1, i;
+
+  /* Disable interrupts and watchdog */
+  dint();
+  wdg = WDTCTL & 0x00ff;
+  WDTCTL=WDTPW|WDTHOLD;
+
+  /* Setup flash */
+#ifdef __MSP430_449__
+  FCTL2 = FWKEY | FSSEL_2 | (16-1);   /* Use 4.91MHz SMCLK / 16 = 300kHz */
+#else
+  FCTL2 = FWKEY | FSSEL_1 | (17-1);   /* Use 8.00MHz MCLK / 17 = 470.588kHz */
+#endif
+
+  /* Write data into erased flash, no segment erase */
+  for (i=0; i<words; i++)
+  {
+    FCTL3 = FWKEY;          /* Unlock */
+    FCTL1 = FWKEY | WRT;
+    *fptr++ = *rptr++;
+    FCTL1 = FWKEY;
+    FCTL3 = FWKEY|LOCK;     /* Lock */
+  }
+
+  /* Reset timers to avoid compare register reload trouble. */
+  machine_init_timer();
+#ifdef BACKLIGHT_PWM
+  machine_backlight_set(machine_backlight_get());
+#endif
+
+  /* restore watchdog and interrupts */
+  WDTCTL = wdg | WDTPW;
+  eint();
+}
@@ -14,69 +14,287 @@
 #include <time.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <errno.h>
 
-#define MAX_FASTTIMERS 6
-#define MAX_SLOWTIMERS 6
+/* Monotonic jiffies, not truncated to int */
+static unsigned long long machine_jiffies64(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (unsigned long long)t.tv_sec*JFREQ + (unsigned long long)t.tv_nsec*JFREQ/1000000000;
+}
 
 unsigned int machine_getJiffies(void)
 {
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  return (t.tv_usec*JFREQ/1000000) + (t.tv_sec*JFREQ);
+  return machine_jiffies64();
+}
+
+unsigned int machine_getProfClock(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_nsec/1000) + (t.tv_sec*1000000);
 }
 
 struct timer
 {
-  unsigned int ticks;
-  unsigned int reload;
+  unsigned long long due;     /* expiry time in jiffies */
+  unsigned int period;        /* in jiffies */
   int (*func)(HANDLE_TIMER, void*);
   void *data;
-  unsigned char enabled;
+  unsigned char slow;         /* period given in seconds instead of TFREQ ticks */
+  unsigned char destroyed;    /* destroyed from within its own callback */
+  int idx;                    /* heap position */
+  machine_timer_stats_t stats;
+  struct timer *next;         /* in tFree */
 };
 
-static struct timer ftimers[MAX_FASTTIMERS];
-static struct timer stimers[MAX_SLOWTIMERS];
+/* There is no periodic tick. All timers, including the RTC second, are kept
+   in a min-heap ordered by expiry time and one timerfd is armed for the top.
+   A helper thread waits on it and raises SIGALRM in the main thread, so timer
+   callbacks still run in "interrupt" context. Heap changes are done with
+   SIGALRM blocked and tLock held, the latter for other threads. */
+static struct timer **theap;
+static int nTimers, maxTimers;
+static struct timer *tCurrent;         /* timer whose callback is running */
+/* Nothing is allocated or freed in the SIGALRM handler, the main thread may
+   be inside malloc() when it comes. Timers come from and go to a reserve,
+   which is kept at TIMER_SPARE timers, with heap room for as many, outside
+   of callbacks. Callbacks can create that many timers in a row. */
+#define TIMER_SPARE 4
+static struct timer *tFree;
+static int nFree;
+static pthread_mutex_t tLock;
+static int tfd = -1;
+static pthread_t tMain;
+
+#define TIMER_BEFORE(a,b) (theap[a]->due < theap[b]->due)
+
+static void theap_swap(int i, int j)
+{
+  struct timer *t;
+
+  t = theap[i];
+  theap[i] = theap[j];
+  theap[j] = t;
+  theap[i]->idx = i;
+  theap[j]->idx = j;
+}
+
+static void theap_up(int i)
+{
+  while (i > 0 && TIMER_BEFORE(i, (i-1)/2)) {
+    theap_swap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static void theap_down(int i)
+{
+  while (1) {
+    int c = 2*i+1;
+
+    if (c >= nTimers) {
+      break;
+    }
+    if (c+1 < nTimers && TIMER_BEFORE(c+1, c)) {
+      c++;
+    }
+    if (!TIMER_BEFORE(c, i)) {
+      break;
+    }
+    theap_swap(i, c);
+    i = c;
+  }
+}
+
+static int theap_insert(struct timer *t)
+{
+  if (nTimers == maxTimers) {
+    return -1;
+  }
+  theap[nTimers] = t;
+  t->idx = nTimers;
+  nTimers++;
+  theap_up(nTimers-1);
+
+  return 0;
+}
+
+static void theap_remove(struct timer *t)
+{
+  int i = t->idx;
+
+  if (i < 0) {
+    return;
+  }
+  t->idx = -1;
+  nTimers--;
+  if (i != nTimers) {
+    theap[i] = theap[nTimers];
+    theap[i]->idx = i;
+    theap_down(i);
+    theap_up(i);
+  }
+}
+
+/* Arm the timerfd for the next due event. Call with timers locked. */
+static void machine_timer_arm(void)
+{
+  unsigned long long j;
+  struct itimerspec its;
+
+  if (nTimers == 0) {
+    return;
+  }
+  j = theap[0]->due;
+  /* Start of jiffy j, rounded up so that machine_getJiffies() already reached it */
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = j/JFREQ;
+  its.it_value.tv_nsec = ((j%JFREQ)*1000000000 + JFREQ-1)/JFREQ;
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void machine_timer_lock(sigset_t *os)
+{
+  sigset_t ss;
+
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGALRM);
+  sigprocmask(SIG_BLOCK, &ss, os);
+  pthread_mutex_lock(&tLock);
+}
+
+static void machine_timer_unlock(sigset_t *os)
+{
+  pthread_mutex_unlock(&tLock);
+  sigprocmask(SIG_SETMASK, os, NULL);
+}
+
+/* Fill up or trim the reserve and make heap room for it. Call with timers
+   locked, never from a callback. */
+static void machine_timer_reserve(void)
+{
+  struct timer *t;
+
+  while (nFree < TIMER_SPARE+1 && (t = malloc(sizeof(struct timer))) != NULL) {
+    t->next = tFree;
+    tFree = t;
+    nFree++;
+  }
+  while (nFree > 2*TIMER_SPARE) {
+    t = tFree;
+    tFree = t->next;
+    nFree--;
+    free(t);
+  }
+  if (maxTimers < nTimers + TIMER_SPARE+1) {
+    struct timer **h;
+    int n = 2*(nTimers + TIMER_SPARE+1);
+
+    h = realloc(theap, n*sizeof(*theap));
+    if (h != NULL) {
+      theap = h;
+      maxTimers = n;
+    }
+  }
+}
+
+static void machine_timer_put(struct timer *t)
+{
+  t->next = tFree;
+  tFree = t;
+  nFree++;
+}
+
+/* Timer period in jiffies */
+static unsigned int machine_timer_period(int ival, int slow)
+{
+  if (ival < 0) {
+    ival = -ival;
+  }
+  if (ival == 0) {
+    ival = 1;
+  }
+  return slow ? ival*JFREQ : TIMER2JIFFIES(ival);
+}
 
 HANDLE_TIMER machine_timer_create(int ival, timer_func func, void *data)
 {
-   int i, max;
-   struct timer *t;
-   
-   if (ival < 0) {
-     max = MAX_SLOWTIMERS;
-     t = stimers;
-     ival = -ival;
-   } else {
-     max = MAX_FASTTIMERS;
-     t = ftimers;
-   }
-   
-   for  (i=0; i<max; i++)
-   {
-     if (t[i].enabled == 0)
-       break;
-   }
-   if (i==max)
-     return NULL;
-  
-   t[i].func = func;
-   t[i].data = data;
-   t[i].ticks = t[i].reload = ival;
-   t[i].enabled=1;
-   
-   return (HANDLE_TIMER)&t[i];
+  struct timer *t;
+  sigset_t os;
+
+  machine_timer_lock(&os);
+  if (tCurrent == NULL) {
+    machine_timer_reserve();
+  }
+  t = tFree;
+  if (t == NULL || nTimers == maxTimers) {
+    machine_timer_unlock(&os);
+    return NULL;
+  }
+  tFree = t->next;
+  nFree--;
+
+  memset(t, 0, sizeof(struct timer));
+  t->func = func;
+  t->data = data;
+  t->slow = (ival < 0);
+  t->period = machine_timer_period(ival, t->slow);
+  t->due = machine_jiffies64() + t->period;
+  theap_insert(t);
+  machine_timer_arm();
+  machine_timer_unlock(&os);
+
+  return (HANDLE_TIMER)t;
 }
 
 void machine_timer_destroy(HANDLE_TIMER hTimer)
 {
   struct timer *timer = (struct timer*) hTimer;
-  
-  timer->enabled = 0;
+  sigset_t os;
+
+  if (timer == NULL) {
+    return;
+  }
+  machine_timer_lock(&os);
+  theap_remove(timer);
+  if (timer == tCurrent) {
+    /* Given back after the callback returned */
+    timer->destroyed = 1;
+  } else {
+    machine_timer_put(timer);
+  }
+  if (tCurrent == NULL) {
+    machine_timer_reserve();
+  }
+  machine_timer_unlock(&os);
 }
 
 void machine_timer_reset(HANDLE_TIMER hTimer, int ival)
 {
-  hTimer->reload = ival;
+  sigset_t os;
+
+  /* Takes effect with the next expiry, like a reload value */
+  machine_timer_lock(&os);
+  hTimer->period = machine_timer_period(ival, hTimer->slow);
+  machine_timer_unlock(&os);
+}
+
+int machine_timer_stats(HANDLE_TIMER hTimer, machine_timer_stats_t *s)
+{
+  sigset_t os;
+
+  if (hTimer == NULL) {
+    return -1;
+  }
+  machine_timer_lock(&os);
+  *s = hTimer->stats;
+  machine_timer_unlock(&os);
+
+  return 0;
 }
 
 
@@ -131,60 +349,122 @@ static int rtc_time_isequal(rtc_time_t *a, rtc_time_t *b)
 
 void rtc_tick(int val)
 {
-  int wup = 0;
-
   rtc_add(&rtc_now, 1);
   if (rtc_time_isequal(&rtc_now, &rtc_alarm))
   {
     if (rtc_alarm_cb != NULL)
       rtc_alarm_cb(rtc_alarm_data);
   }
+}
 
-  /* Slow timers */
-#if (MAX_SLOWTIMERS > 0)
-  {
-    int i;
+static int rtc_timer_cb(HANDLE_TIMER hTimer, void *data)
+{
+  rtc_tick(0);
+  return 0;
+}
 
-    for (i=0; i<MAX_SLOWTIMERS; i++)
-    {
-      if (stimers[i].enabled)
-      {
-        stimers[i].ticks--;
-        if (stimers[i].ticks==0)
-        {
-          stimers[i].ticks = stimers[i].reload;
-          wup |= stimers[i].func((HANDLE_TIMER)&stimers[i], stimers[i].data);
-        }
-      }  
-    }    
-  }      
-#endif   
+#include "wbus_server.h"
+#include "htsim_shm.h"
 
-}
+/* Plant simulator connection. Without simulator all sensors read 0. */
+static htsim_shm_t *sim, simLocal;
+static unsigned int simActSeq;  /* actuator generation at last adc_invalidate() */
+static void (*adcHook)(void);
+static volatile int adcPending; /* sensor update not yet reported to adcHook */
 
 void machine_basic_timer_isr(int val)
 {
-  static int count = 0;
-  int i;
-  int wup = 0;
-  
-  for (i=0; i<MAX_FASTTIMERS; i++)
-  {
-    if (ftimers[i].enabled)
-    {
-      ftimers[i].ticks--;
-      if (ftimers[i].ticks==0)
-      {
-        ftimers[i].ticks = ftimers[i].reload;
-        wup |= ftimers[i].func((HANDLE_TIMER)&ftimers[i], ftimers[i].data);
-      }
-    }  
+  if (adcPending) {
+    adcPending = 0;
+    if (adcHook != NULL) {
+      adcHook();
+    }
+  }
+
+  pthread_mutex_lock(&tLock);
+  while (nTimers > 0) {
+    struct timer *t = theap[0];
+    struct timespec ts;
+    unsigned long long now;
+    unsigned long late;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (unsigned long long)ts.tv_sec*JFREQ + (unsigned long long)ts.tv_nsec*JFREQ/1000000000;
+    if (t->due > now) {
+      break;
+    }
+
+    /* Jitter statistics in microseconds. Only the lateness in jiffies plus the
+       fraction of the current jiffy is scaled, absolute times would overflow. */
+    late = ((now - t->due)*1000000000 + (unsigned long long)ts.tv_nsec*JFREQ%1000000000)/JFREQ/1000;
+    t->stats.count++;
+    t->stats.late_sum += late;
+    if (late > t->stats.late_max) {
+      t->stats.late_max = late;
+    }
+
+    t->due += t->period;
+    /* Skip periods missed due to overrun */
+    if (t->due <= now) {
+      t->stats.overruns += (now - t->due)/t->period + 1;
+      t->due = now + t->period;
+    }
+    theap_down(0);
+
+    tCurrent = t;
+    t->func((HANDLE_TIMER)t, t->data);
+    tCurrent = NULL;
+    if (t->destroyed) {
+      machine_timer_put(t);
+    }
+  }
+  machine_timer_arm();
+  pthread_mutex_unlock(&tLock);
+}
+
+static void *machine_timer_thread(void *arg)
+{
+  unsigned long long n;
+
+  while (1) {
+    if (read(tfd, &n, sizeof(n)) == sizeof(n)) {
+      pthread_kill(tMain, SIGALRM);
+    } else if (errno != EINTR) {
+      break;
+    }
   }
+  return NULL;
+}
 
-  if (count++ > TFREQ) {
-    count = 0;
-    rtc_tick(val);
+/* Simulator sensor updates are the ADC completion interrupts */
+static void *machine_sensor_thread(void *arg)
+{
+  int bell;
+
+  while (1) {
+    bell = sim->sensor_bell;
+    htsim_sensor_wait(sim, bell, NULL);
+    if (sim->sensor_bell != bell) {
+      adcPending = 1;
+      pthread_kill(tMain, SIGALRM);
+    }
   }
+  return NULL;
+}
+
+/* SIGINT and SIGTERM end the program through exit(), so atexit() handlers
+   like the flash report run also when stopped by Ctrl-C or kill */
+static void *machine_exit_thread(void *arg)
+{
+  sigset_t ss;
+  int sig;
+
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGINT);
+  sigaddset(&ss, SIGTERM);
+  sigwait(&ss, &sig);
+  exit(128+sig);
+  return NULL;
 }
 
 static void rtc_init(void)
@@ -214,66 +494,64 @@ void rtc_getalarm(rtc_time_t *t)
   memcpy(t, &rtc_alarm, sizeof(rtc_time_t));
 }
 
-#include "wbus_server.h"
-
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/time.h>
-
-static int shmid;
-static unsigned short (*d)[16];
+static int flash_init(void);
+static void flash_report(void);
 
 void machine_init(void)
 {
-  int i;
+  pthread_mutexattr_t ma;
+  int persistent;
 
   rtc_init();
   
-  shmid = shmget(0xb0E1, 4096, 0666 | IPC_CREAT);
-  if (shmid == -1) {
-    printf("shmget() failed\n");
-  }
-  d = shmat(shmid, (void *)0, 0);
-  if ((int)d == -1) {
-    printf("shmat() failed (d)\n");
-  }
+  persistent = flash_init();
 
-  /* Set all timers disabled */
-#if (MAX_FASTTIMERS > 0)   
-  for (i=0; i<MAX_FASTTIMERS; i++) {
-    ftimers[i].enabled = 0;
+  sim = htsim_shm_attach();
+  if (sim == NULL) {
+    printf("htsim_shm_attach() failed, running without simulator\n");
+    sim = &simLocal;
   }
-#endif
-#if (MAX_SLOWTIMERS > 0)
-  for (i=0; i<MAX_SLOWTIMERS; i++) {
-    stimers[i].enabled = 0;
-  }
-#endif
+
+  /* Timer callbacks may create, reset or destroy timers, see TIMER_SPARE */
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_settype(&ma, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&tLock, &ma);
+  pthread_mutexattr_destroy(&ma);
 
   adc_invalidate();
   
   /* Add signals for timers */
-  //signal(SIGALRM, rtc_tick);
   signal(SIGALRM, machine_basic_timer_isr);
+  tMain = pthread_self();
+  tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (tfd == -1) {
+    printf("timerfd_create() failed: %s\n", strerror(errno));
+  }
   {
-    struct itimerval it;
-    int err;
-#if 0
-    it.it_interval.tv_sec = 1;
-    it.it_interval.tv_usec = 0000000;
-    it.it_value.tv_sec = 1;
-    it.it_value.tv_usec = 000000;
-#else
-    it.it_interval.tv_sec = 0;
-    it.it_interval.tv_usec = 1000000/TFREQ;
-    it.it_value.tv_sec = 0;
-    it.it_value.tv_usec = 1000000/TFREQ;
-#endif
-    err = setitimer(ITIMER_REAL, &it, NULL);
-    if (err != 0) {
-      printf("Error setitimer: %s\n", strerror(err));
+    pthread_t t;
+    sigset_t ss, os;
+
+    /* Signals must be handled by the main thread only */
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, &os);
+    if (pthread_create(&t, NULL, machine_timer_thread, NULL) != 0) {
+      printf("Error creating timer thread\n");
     }
-  }  
+    if (sim != &simLocal && pthread_create(&t, NULL, machine_sensor_thread, NULL) != 0) {
+      printf("Error creating sensor thread\n");
+    }
+    if (persistent) {
+      atexit(flash_report);
+      /* Only the exit thread takes them from now on */
+      if (pthread_create(&t, NULL, machine_exit_thread, NULL) == 0) {
+        sigaddset(&os, SIGINT);
+        sigaddset(&os, SIGTERM);
+      }
+    }
+    pthread_sigmask(SIG_SETMASK, &os, NULL);
+  }
+  /* RTC second tick */
+  machine_timer_create(-1, rtc_timer_cb, NULL);
 }
 
 #include <sys/select.h>
@@ -306,7 +584,34 @@ void machine_sleep(unsigned int b)
 
 void machine_jsleep(unsigned int j)
 {
-  machine_usleep(j*1000000/JFREQ);
+  struct timespec ts;
+  unsigned long long ns = (unsigned long long)j*1000000000/JFREQ;
+
+  ts.tv_sec = ns/1000000000;
+  ts.tv_nsec = ns%1000000000;
+  /* Returns early on signals (timers, serial I/O), so that the kernel
+     can look at woken up tasks. */
+  nanosleep(&ts, NULL);
+}
+
+void machine_idle_sleep(unsigned int j, int (*pending)(void))
+{
+  struct timespec ts;
+  sigset_t ss, os;
+  unsigned long long ns = (unsigned long long)j*1000000000/JFREQ;
+
+  ts.tv_sec = ns/1000000000;
+  ts.tv_nsec = ns%1000000000;
+  /* Timer and serial I/O signals that arrive after the check are held
+     back until pselect() unblocks them, which then returns at once. */
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGALRM);
+  sigaddset(&ss, SIGIO);
+  pthread_sigmask(SIG_BLOCK, &ss, &os);
+  if (!pending()) {
+    pselect(0, NULL, NULL, NULL, &ts, &os);
+  }
+  pthread_sigmask(SIG_SETMASK, &os, NULL);
 }
 
 void machine_beep(void)
@@ -347,38 +652,58 @@ unsigned int machine_buttons(int do_read)
 
 int adc_read_single(int c)
 {
-  return d[1][c];
+  unsigned short v[HTSIM_NCHAN];
+
+  if (c == SENSOR_HE || c == SENSOR_FD) {
+    htsim_block_read(&sim->virt, v, NULL, NULL);
+  } else {
+    htsim_block_read(&sim->sensor, v, NULL, NULL);
+  }
+  return v[c];
 }
 
 void adc_read(unsigned short *s, int n)
 {
+  unsigned short v[HTSIM_NCHAN];
   int i;
+
   /* Write back virtual sensors */
-  d[1][10] = s[10];
-  d[1][9] = s[9];
+  htsim_block_write(&sim->virt, SENSOR_HE, &s[SENSOR_HE], 2, 0);
 
+  htsim_block_read(&sim->sensor, v, NULL, NULL);
   for (i=0; i<n; i++) {
-    s[i] = d[1][i];
+    if (i != SENSOR_HE && i != SENSOR_FD) {
+      s[i] = v[i];
+    }
   }
 }
 
 void adc_invalidate(void)
 {
-  d[2][0] = 0;
+  simActSeq = sim->act.seq;
 }
    
+int adc_ready_hook(void (*hook)(void))
+{
+  adcHook = hook;
+  /* Only the simulator rings the sensor bell */
+  return sim != &simLocal;
+}
+
 int adc_is_uptodate(void)
 {
-  return d[2][0];
+  unsigned short v[HTSIM_NCHAN];
+  unsigned int ref;
+
+  /* Up to date once the simulator computed sensors from current actuators */
+  htsim_block_read(&sim->sensor, v, &ref, NULL);
+  return (int)(ref - simActSeq) >= 0;
 }
 
 void machine_act(unsigned short a[], int n)
 {
-  int i;
-
-  for (i=0; i<n; i++) {
-    d[0][i] = a[i];
-  }  
+  htsim_block_write(&sim->act, 0, a, n, 0);
+  htsim_doorbell_ring(sim);
 }
 
 void machine_ack(int ack)
@@ -409,10 +734,218 @@ void machine_suspend(void)
   sleep(1);
 }
 
+/*
+ * Flash emulation. FLASH_EMU variables end up in section flash_emu, which is
+ * mirrored into an image file. At startup the image contents replace the
+ * compiled in defaults, or the defaults are written into a new image.
+ * Image layout: flash_image_t header with per segment erase counters, padded
+ * to a segment boundary, followed by the segments. The header records the
+ * section size and a hash of the compiled in defaults, so an image of another
+ * build, whose variables may sit elsewhere, is not taken for this one.
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FLASH_SEG 512
+/* MSP430 flash timing in microseconds at 470kHz flash clock: segment erase
+   takes 4819 clock cycles, programming a word 35. 0 disables the delay. */
+#ifndef FLASH_T_ERASE
+#define FLASH_T_ERASE 10240
+#endif
+#ifndef FLASH_T_WORD
+#define FLASH_T_WORD 75
+#endif
+/* Guaranteed erase cycles per segment */
+#define FLASH_ENDURANCE 100000
+
+extern unsigned char __start_flash_emu[] __attribute__ ((weak));
+extern unsigned char __stop_flash_emu[] __attribute__ ((weak));
+
+typedef struct {
+  char magic[8];
+  unsigned int seg_size;
+  unsigned int nseg;
+  unsigned int size;          /* flash_emu section size */
+  unsigned int defaults;      /* FNV-1a hash of the compiled in section contents */
+  unsigned int erases[];
+} flash_image_t;
+
+static flash_image_t *fImage;
+static unsigned char *fData;   /* segments inside fImage */
+static unsigned int fSize;     /* size of flash_emu section */
+static flash_stats_t fStats;
+
+/* Returns 1 if flash is kept in the image file */
+static
+int flash_init(void)
+{
+  const char *path;
+  unsigned int nseg, off, total, hash, i;
+  struct stat st;
+  void *p;
+  int fd;
+
+  if (__start_flash_emu == NULL) {
+    return 0;
+  }
+  fSize = __stop_flash_emu - __start_flash_emu;
+  if (fSize == 0) {
+    return 0;
+  }
+  nseg = (fSize + FLASH_SEG-1)/FLASH_SEG;
+  hash = 2166136261U;
+  for (i=0; i<fSize; i++) {
+    hash = (hash ^ __start_flash_emu[i])*16777619U;
+  }
+  off = (sizeof(flash_image_t) + nseg*sizeof(unsigned int) + FLASH_SEG-1) & ~(FLASH_SEG-1);
+  total = off + nseg*FLASH_SEG;
+
+  path = getenv("FLASH_IMAGE");
+  if (path == NULL) {
+    path = "flash.img";
+  }
+  fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    printf("Flash image %s not available, flash is not persistent\n", path);
+    return 0;
+  }
+  if (st.st_size != total && ftruncate(fd, total) == -1) {
+    printf("ftruncate() failed\n");
+  }
+  p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    printf("mmap() failed, flash is not persistent\n");
+    return 0;
+  }
+  fImage = p;
+  fData = (unsigned char *)p + off;
+
+  if (st.st_size != total || memcmp(fImage->magic, "WBFLASH", 8) != 0
+      || fImage->seg_size != FLASH_SEG || fImage->nseg != nseg
+      || fImage->size != fSize || fImage->defaults != hash)
+  {
+    /* New image or another build. Start over from defaults, like
+       programming new firmware into a real part. */
+    printf("Initializing flash image %s\n", path);
+    memset(p, 0, off);
+    memcpy(fImage->magic, "WBFLASH", 8);
+    fImage->seg_size = FLASH_SEG;
+    fImage->nseg = nseg;
+    fImage->size = fSize;
+    fImage->defaults = hash;
+    memset(fData, 0xff, nseg*FLASH_SEG);
+    memcpy(fData, __start_flash_emu, fSize);
+  } else {
+    memcpy(__start_flash_emu, fData, fSize);
+  }
+
+  return 1;
+}
+
+static
+void flash_busy(unsigned long us)
+{
+  struct timespec t;
+
+  if (us > fStats.max_busy) {
+    fStats.max_busy = us;
+  }
+  fStats.busy_time += us;
+
+  t.tv_sec = us / 1000000;
+  t.tv_nsec = (us % 1000000) * 1000;
+  while (nanosleep(&t, &t) == -1 && errno == EINTR) ;
+}
+
+static
+int flash_emulated(const void *fptr)
+{
+  return fImage != NULL && (unsigned char *)fptr >= __start_flash_emu
+      && (unsigned char *)fptr < __stop_flash_emu;
+}
+
+/* Erase touched segments if requested and program nbytes of rptr (zero if NULL) */
+static
+void flash_emu(unsigned char *fptr, const unsigned char *rptr, int nbytes, int erase)
+{
+  unsigned int off, seg, first, last, end;
+  unsigned long busy = 0;
+  sigset_t set, oset;
+  int i;
+
+  off = fptr - __start_flash_emu;
+  if (off + nbytes > fSize) {
+    printf("flash_write() beyond flash end\n");
+    nbytes = fSize - off;
+  }
+  first = off/FLASH_SEG;
+  last = (nbytes > 0) ? (off+nbytes-1)/FLASH_SEG : first;
+
+  /* Flash controller blocks the CPU, interrupts are held off meanwhile */
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigaddset(&set, SIGIO);
+  pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+  /* Every touched segment is erased, including data outside of the range */
+  for (seg=first; erase && seg<=last; seg++) {
+    memset(fData + seg*FLASH_SEG, 0xff, FLASH_SEG);
+    fImage->erases[seg]++;
+    if (fImage->erases[seg] == FLASH_ENDURANCE) {
+      printf("Flash segment %d exceeded %d erase cycles\n", seg, FLASH_ENDURANCE);
+    }
+    fStats.erases++;
+    busy += FLASH_T_ERASE;
+  }
+
+  /* Programming can only clear bits */
+  for (i=0; i<nbytes; i++) {
+    fData[off+i] &= (rptr != NULL) ? rptr[i] : 0;
+  }
+  fStats.words += (nbytes+1)/2;
+  busy += (unsigned long)FLASH_T_WORD*((nbytes+1)/2);
+
+  end = (last+1)*FLASH_SEG;
+  if (end > fSize) {
+    end = fSize;
+  }
+  memcpy(__start_flash_emu + first*FLASH_SEG, fData + first*FLASH_SEG, end - first*FLASH_SEG);
+
+  flash_busy(busy);
+  pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+/* Erase a whole segment. Smaller objects would be overrun, so only segment
+   aligned ones are erased, and not beyond the end of the flash_emu section. */
+static
+void flash_erase_plain(unsigned char *fptr)
+{
+  unsigned int n = FLASH_SEG;
+
+  if (((unsigned long)fptr & (FLASH_SEG-1)) != 0) {
+    printf("flash_write() erase of unaligned %p ignored\n", (void *)fptr);
+    return;
+  }
+  if (fptr >= __start_flash_emu && fptr < __stop_flash_emu
+      && fptr + n > __stop_flash_emu)
+  {
+    n = __stop_flash_emu - fptr;
+  }
+  memset(fptr, 0xff, n);
+}
+
 void flash_write(void *_fptr, void *_rptr, int nbytes)
 {
+  if (flash_emulated(_fptr)) {
+    flash_emu(_fptr, _rptr, nbytes, 1);
+    return;
+  }
+
+  /* Not emulated, plain memory */
   if (nbytes == 0) {
-    memset(_fptr, 0, 128);
+    flash_erase_plain(_fptr);
     return;
   }
   if (_rptr != NULL) {
@@ -421,3 +954,46 @@ void flash_write(void *_fptr, void *_rptr, int nbytes)
     memset(_fptr, 0, nbytes);
   }
 }
+
+void flash_program(void *fptr, const void *rptr, int nbytes)
+{
+  if (flash_emulated(fptr)) {
+    flash_emu(fptr, rptr, nbytes, 0);
+  } else {
+    memcpy(fptr, rptr, nbytes);
+  }
+}
+
+void flash_stats(flash_stats_t *s)
+{
+  *s = fStats;
+}
+
+long flash_erase_count(void *fptr)
+{
+  if (!flash_emulated(fptr)) {
+    return -1;
+  }
+  return fImage->erases[((unsigned char *)fptr - __start_flash_emu)/FLASH_SEG];
+}
+
+/* Wear and busy time of this run, printed at exit */
+static
+void flash_report(void)
+{
+  flash_stats_t s;
+  unsigned int off, worst = 0;
+  long n;
+
+  flash_stats(&s);
+  for (off=0; off<fSize; off+=FLASH_SEG) {
+    n = flash_erase_count(__start_flash_emu + off);
+    if (n > flash_erase_count(__start_flash_emu + worst)) {
+      worst = off;
+    }
+  }
+  printf("Flash: %lu erases, %lu words programmed, %lu us busy, longest write %lu us\n",
+         s.erases, s.words, s.busy_time, s.max_busy);
+  printf("Flash: most worn segment %u with %ld of %d erase cycles\n",
+         worst/FLASH_SEG, flash_erase_count(__start_flash_emu + worst), FLASH_ENDURANCE);
+}
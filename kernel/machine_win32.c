@@ -277,6 +277,13 @@ void machine_jsleep(unsigned int j)
   machine_usleep(j*1000000/JFREQ);
 }
 
+void machine_idle_sleep(unsigned int j, int (*pending)(void))
+{
+  if (!pending()) {
+    machine_jsleep(j);
+  }
+}
+
 void machine_beep(void)
 {
   printf("\b");
@@ -379,6 +386,11 @@ int adc_is_uptodate(void)
   return d[2][0];
 }
 
+int adc_ready_hook(void (*hook)(void))
+{
+  return 0;
+}
+
 void machine_act(unsigned short a[], int n)
 {
   int i;
@@ -419,7 +431,10 @@ void machine_suspend(void)
 void flash_write(void *_fptr, void *_rptr, int nbytes)
 {
   if (nbytes == 0) {
-    memset(_fptr, 0, 128);
+    /* Erase whole segments only, smaller objects would be overrun */
+    if (((unsigned long)_fptr & 511) == 0) {
+      memset(_fptr, 0xff, 512);
+    }
     return;
   }
   if (_rptr != NULL) {
@@ -428,3 +443,8 @@ void flash_write(void *_fptr, void *_rptr, int nbytes)
     memset(_fptr, 0, nbytes);
   }
 }
+
+void flash_program(void *fptr, const void *rptr, int nbytes)
+{
+  memcpy(fptr, rptr, nbytes);
+}
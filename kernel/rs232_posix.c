@@ -41,9 +41,10 @@ void rs232_isr(int signum)
 {
   int result, err, i;
 
+  /* Several ports may be waiting at the same time */
   for (i=0; i<NO_RS232; i++) {
-    /* skip rs232 ports that are not opened */
-    if (grs232[i] == NULL) {
+    /* skip rs232 ports that are not opened or not waiting */
+    if (grs232[i] == NULL || grs232[i]->rx_waitbytes == 0) {
       continue ;
     }
     err = ioctl(grs232[i]->fd, FIONREAD, &result);
@@ -55,15 +56,9 @@ void rs232_isr(int signum)
       printf("received %d bytes\n", result);  
       continue;
     }
-    break;
+    grs232[i]->rx_waitbytes = 0;
+    kernel_wakeup(grs232[i]->task);
   }
-
-  if (i == NO_RS232) {
-    return;
-  }
-
-  kernel_wakeup(grs232[i]->task);
-  grs232[i]->rx_waitbytes = 0;
 }
 
 static
@@ -90,9 +85,18 @@ void rs232_isr_start(HANDLE_RS232 rs232)
 static
 void rs232_isr_end(HANDLE_RS232 rs232)   
 {
-  int err;
+  int err, i;
 
-  signal(SIGIO, SIG_DFL);
+  rs232->rx_waitbytes = 0;
+  /* Keep the handler while other ports still wait for data */
+  for (i=0; i<NO_RS232; i++) {
+    if (grs232[i] != NULL && grs232[i]->rx_waitbytes != 0) {
+      break;
+    }
+  }
+  if (i == NO_RS232) {
+    signal(SIGIO, SIG_DFL);
+  }
 
   err = fcntl(rs232->fd, F_GETFL);
   err = fcntl(rs232->fd, F_SETFL, err & ~FASYNC);
@@ -197,7 +197,8 @@ static signed int fHeaterOn;
 static unsigned char fTimerOn;
 /* current heater mode */
 static unsigned char heaterMode;
-static int wbus_task;
+/* Signalled on fHeaterOn changes to be handled by openegg_wbus_thread */
+static kernel_event_t heaterEvent;
 
 /* Heater/Vent time in Minutes */
 typedef struct {
@@ -211,7 +212,10 @@ typedef struct {
 
 static settings_t settings;
 
+#ifdef __MSP430__
 __attribute__ ((section (".infomem")))
+#endif
+FLASH_EMU
 settings_t fsettings = 
 {
   { { 0, 0, 7 },{ 0, 0, 12 },{ 0, 0, 19 } },
@@ -230,7 +234,7 @@ static void turn_on_heater(void)
   if (fHeaterOn == 0) {
     machine_beep();
     fHeaterOn = 1;
-    kernel_wakeup(wbus_task);
+    kernel_event_signal(&heaterEvent);
   }
 }
 
@@ -252,6 +256,7 @@ static void turn_on_heater_alarm(void *data)
 static void turn_off_heater()
 {
   fHeaterOn = -1;
+  kernel_event_signal(&heaterEvent);
   if (fTimerOn > 0) {
     /* Disable timer. */
     rtc_setalarm(&settings.alarm[fTimerOn-1], NULL, NULL);
@@ -722,13 +727,14 @@ TASK_FUNC(openegg_wbus_thread)
         //strcpy(data, "Fehler");
       }
     }
-    {
+    if (fHeaterOn == 0) {
+      kernel_event_wait(&heaterEvent, 0);
+    } else {
       int i;
-      
+
+      /* Keep alive every 15 seconds. Split up to fit jiffies into an int. */
       for (i=0; i<10; i++) {
-        kernel_sleep(MSEC2JIFFIES(15000/10));
-        kernel_yield();
-        if (fHeaterOn == 1 || fHeaterOn == -1) {
+        if (kernel_event_wait(&heaterEvent, MSEC2JIFFIES(15000/10)) == 0) {
           break;
         }
       }
@@ -833,6 +839,8 @@ TASK_FUNC(openegg_gsmctl_thread)
 
 void main(void)
 {
+  int t;
+
   kernel_init();
 
   memcpy(&settings, &fsettings, sizeof(settings_t));
@@ -842,7 +850,10 @@ void main(void)
   ptime = &openegg_time;
 
   kernel_task_register(openegg_thread, KERNEL_STACK_SIZE/2);
-  wbus_task = kernel_task_register(openegg_wbus_thread, KERNEL_STACK_SIZE/4); 
+  kernel_event_init(&heaterEvent);
+  /* Heater commands go before display updates */
+  t = kernel_task_register(openegg_wbus_thread, KERNEL_STACK_SIZE/4);
+  kernel_task_priority(t, 1);
   kernel_task_register(openegg_gsmctl_thread, KERNEL_STACK_SIZE/4);
       
   kernel_run();
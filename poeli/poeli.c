@@ -5,6 +5,7 @@
 #include "kernel.h"
 #include "machine.h"
 #include "poeli_ctrl.h"
+#include "dsp.h"
 #include "wbus.h"
 #include "wbus_server.h"
 #include <stdio.h>
@@ -12,10 +13,57 @@
 
 /* Static data */
 static heater_state_t heater_state;
-static HANDLE_WBUS w;
+static wbus_server_t server;            /* W-Bus server instance of heater_state */
+/* Actuator ramps. acc[i] is act_step[i]*time of the current sequence, kept
+   up to date by subtracting act_step[i] each tick instead of multiplying. */
+static struct {
+  signed long acc[NUM_ACT];
+  unsigned int time;                    /* time acc belongs to */
+  heater_status_t status;               /* sequence acc belongs to */
+  unsigned char gen;                    /* seq_gen acc belongs to */
+} ramp;
 static unsigned char gfActive;          /* Flag indicating W-Bus active mode, fast sensor monitoring/update. */
 static unsigned char gSensorsUpdated;   /* Flag indicating up to date sensor data.  */
+static unsigned short gSensorsNew;      /* Sensors not yet checked by the control task, bit n is sensor n. */
+static unsigned short gSensorsStale;    /* Sensors not checked since the last state change. */
+#ifndef POELI_SIM
+static unsigned char gAdcNotify;        /* Flag indicating that the ADC wakes up the sensor task. */
+static HANDLE_WBUS w;
 static unsigned int gActiveTimout;      /* Last W-Bus received time stamp. */
+static kernel_event_t gHeaterEvent;     /* Signalled on new heater state requests and sensor data to check. */
+static kernel_event_t gSensorEvent;     /* Signalled on new ADC values and when W-Bus active mode is entered. */
+#endif
+
+/* Sensor sets per check of a sensor which can not trip to HT_LOCKED. While
+   burning (HT_IGNITE up to HT_STOP) every set is checked, and sensors which
+   can trip to HT_LOCKED, e.g. on over heat, always are. */
+#ifndef SENSOR_DECIMATION
+#define SENSOR_DECIMATION 4
+#endif
+
+/* Heater state log size in blocks of WBUS_SERVER_LOG_BLOCK bytes, 0 for
+   none. The MSP430F1x9 parts have 2 KB RAM, too little to spare any. */
+#ifndef LOG_BLOCKS
+#ifdef __MSP430__
+#define LOG_BLOCKS 0
+#else
+#define LOG_BLOCKS 16
+#endif
+#endif
+#if LOG_BLOCKS > 0
+static wbus_server_log_t heater_log;
+static unsigned char heater_log_buf[LOG_BLOCKS*WBUS_SERVER_LOG_BLOCK];
+#endif
+
+/* Maximum time from W-Bus request reception until the answer was sent. A 32 byte
+   answer alone takes about 150 ms at 2400 baud. Later answers are counted as
+   missed deadlines by the listener task. */
+#define WBUS_ANSWER_MAX MSEC2JIFFIES(250)
+
+/* Maximum run slice of the listener task, from getting ready until it gives back
+   control, checked by the kernel. This does not cover the whole request, which
+   spans many slices blocked on the UART. */
+#define WBUS_RUN_SLICE MSEC2JIFFIES(250)
 
 #ifdef __linux__
 #include <stdlib.h>
@@ -31,88 +79,180 @@ enum {
   S_CC
 };
 
+/* Flame detector observer m = x*5 + dx*350, computed in units of 16 with
+   dx scaled by 64. Flame is on above 3400 and off below 3000. */
+#define FD_K1 (5<<12)
+#define FD_K2 (350<<6)
+#define FD_DX_MAX 511
+#define FD_TH_LO (3000>>4)
+#define FD_TH_HI (3400>>4)
+#define FD_DEBOUNCE 3
+
+/* Heating power per dosing pump Hz*10 in Q10, see poeli_calc_he() */
+#define HE_K 45158
+/* Heat exchanger lag, moving average over 1<<HE_LD sensor sets */
+#define HE_LD 4
+
+static dsp_median_t fdSpike;
+static unsigned short fdSpikeX[3];
+static dsp_iir1_t fdLowPass;
+static dsp_hyst_t fdThreshold;
+static signed short fdX1;
+static dsp_ma_t heLag;
+static unsigned short heLagX[1<<HE_LD];
+
+static
+void poeli_calc_init(void)
+{
+  dsp_median_init(&fdSpike, fdSpikeX, 3, 0);
+  dsp_iir1_init(&fdLowPass, 2, 0);
+  dsp_hyst_init(&fdThreshold, FD_TH_LO, FD_TH_HI, FD_DEBOUNCE);
+  fdX1 = 0;
+  dsp_ma_init(&heLag, heLagX, HE_LD, 0);
+}
+
 static
 unsigned short poeli_calc_fd(heater_state_t *hs)
 {
-  static unsigned short x1=0, x=0;
-  static const int K1=5, K2=350, thm = 3200, thl = 3000, thh = 3400;
-  static short dx, th, m;
+  signed short x, dx, m;
 
-  /* Averaging filter. */
-  x = (x*3 + hs->volatile_data.sensor[SENSOR_GPR])>>2;
-  /* derivative. */
-  dx=(x-x1);
+  /* Drop single sample spikes, then low pass. */
+  x = dsp_median(&fdSpike, hs->volatile_data.sensor[SENSOR_GPR]);
+  x = dsp_iir1(&fdLowPass, x);
 
-  /* Adaptive observer threshold selection. */
-  th = thm;
-  if (dx < -10) {
-    th = thl;
+  /* derivative. */
+  dx = x - fdX1;
+  fdX1 = x;
+  if (dx > FD_DX_MAX) {
+    dx = FD_DX_MAX;
   }
-  if (dx > 10) {
-    th = thh;
+  if (dx < -FD_DX_MAX) {
+    dx = -FD_DX_MAX;
   }
 
-  /* Calculate observer value. */
-  m =  x*K1 + dx*K2;
-
-  /* Store previous sensor value for derivative. */
-  x1=x;
+  /* Observer value, the 32 bit accumulator can not overflow. */
+  m = mac_s16xs16_h3(x, FD_K1, dx<<6, FD_K2, 0, 0);
 
-  /* Apply adaptive threshold to observer value. */
-  return (m > th) ? 1 : 0;
+  /* The slope term lifts m early while heating up, the hysteresis keeps the
+     flag from chattering around the threshold. */
+  return dsp_hyst(&fdThreshold, m);
 }
 
 static
 unsigned short poeli_calc_he(heater_state_t *hs)
 {
-  int nrg = 0;
+  unsigned short nrg;
   /* 
    Heating power in Watt P = [Wh/L] * 3600[s] * [L/s] * [1/s] * efficiency
    Energy density assumed: 10000 [Wh/L]
    Dosing pump liter per puls:  0.000035 [L/s]
    Dosing pump frequency: hs->volatile_data.act[ACT_DP] 1/20 [Hz]
    Estimated efficiency: 70 %
-   const int factor = (int)(10000.0 * 3600.0 * 0.000035 * (1.0/20.0) * 0.7);
+   factor = 10000.0 * 3600.0 * 0.000035 * (1.0/20.0) * 0.7 = 44.1
    */
-  nrg = hs->volatile_data.act[ACT_DP] * 44;
-  
-  return nrg;
+  nrg = mult_u16xu16h(hs->volatile_data.act[ACT_DP]<<6, HE_K);
+
+  /* Heat reaches the exchanger with some delay. */
+  return dsp_ma(&heLag, nrg);
+}
+
+/**
+ * Read one sensor set, compute the virtual sensors and hand the sensors
+ * which need a check over to the control task in gSensorsNew.
+ * \return time until the next read if the ADC does not report earlier.
+ */
+static
+unsigned int poeli_sensors_update(void)
+{
+  static unsigned char n = 0, gen;
+  static unsigned short prev[NUM_SENSOR];  /* values last handed over */
+  unsigned short *s = heater_state.volatile_data.sensor;
+  unsigned short mask;
+  unsigned int sleept;
+  int i, maybeSensorsUpdated;
+  heater_status_t st;
+
+  maybeSensorsUpdated = adc_is_uptodate();
+
+  poeli_ctrl_read(heater_state.volatile_data.sensor, 9);
+
+  sleept = MSEC2JIFFIES(100);
+
+  st = heater_state.volatile_data.status;
+  if (st == HT_OFF || st == HT_LOCKED) {
+    sleept += MSEC2JIFFIES(9900);
+  }
+  /* seq_trip relies on these being 0 in SENSOR_VIRTUAL_OFF states */
+  if (SENSOR_VIRTUAL_OFF & (1<<st)) {
+    heater_state.volatile_data.sensor[SENSOR_FD] = 0;
+    heater_state.volatile_data.sensor[SENSOR_HE] = 0;
+  } else {
+    /* calculate virtual sensors */
+    heater_state.volatile_data.sensor[SENSOR_FD] = poeli_calc_fd(&heater_state);
+    heater_state.volatile_data.sensor[SENSOR_HE] = poeli_calc_he(&heater_state);
+  }
+
+  /* Publish consistent W-Bus sensor replies */
+  wbus_server_snapshot(&server);
+
+  if (maybeSensorsUpdated && gSensorsUpdated == 0) {
+    gSensorsUpdated = 1;
+  }
+
+  /* Without up to date values the control task checks nothing */
+  if (!gSensorsUpdated) {
+    return sleept;
+  }
+
+  n++;
+  mask = seq_lock[st];
+  if (n >= SENSOR_DECIMATION || (st >= HT_IGNITE && st < HT_STOP)) {
+    n = 0;
+    mask = seq_trip[st];
+  }
+
+  /* Once counting faults a sensor is checked on every set, so max_faults
+     keeps its meaning. Checking an unchanged sensor again changes nothing,
+     as long as it has no fault count and limits and state are the same. */
+  if (gen != seq_gen) {
+    gen = seq_gen;
+    gSensorsStale = 0xffff;
+  }
+  for (i=0; i<NUM_SENSOR; i++) {
+    if (heater_state.volatile_data.faults[i] != 0) {
+      mask |= 1<<i;
+    } else if (s[i] == prev[i] && !(gSensorsStale & (1<<i))) {
+      mask &= ~(1<<i);
+    }
+    if (mask & (1<<i)) {
+      prev[i] = s[i];
+    }
+  }
+  mask &= seq_trip[st];
+  gSensorsStale &= ~mask;
+  gSensorsNew |= mask;
+
+  return sleept;
+}
+
+/* POELI_SIM leaves out the tasks and main(), util/htloop.c includes this
+   file and runs the functions above from a virtual clock instead. */
+#ifndef POELI_SIM
+/* ADC completion, interrupt context */
+static
+void poeli_adc_ready(void)
+{
+  kernel_event_signal(&gSensorEvent);
 }
 
 TASK_FUNC(poeli_read_sensors)
 {
   while (1) {
     unsigned int sleept;
-    int maybeSensorsUpdated;
-    
-    maybeSensorsUpdated = adc_is_uptodate();
-
-    poeli_ctrl_read(heater_state.volatile_data.sensor, 9);
-
-    sleept = MSEC2JIFFIES(100);
-
-    switch (heater_state.volatile_data.status) {
-      case HT_OFF:
-      case HT_LOCKED:
-        sleept += MSEC2JIFFIES(9900);
-      case HT_START:
-      case HT_GLOW:
-      case HT_TEST:
-      case HT_PREHEAT:
-      case HT_VENT:
-      case HT_END:
-        heater_state.volatile_data.sensor[SENSOR_FD] = 0;
-        heater_state.volatile_data.sensor[SENSOR_HE] = 0;
-        break;
-      default:
-        /* calculate virtual sensors */
-        heater_state.volatile_data.sensor[SENSOR_FD] = poeli_calc_fd(&heater_state);
-        heater_state.volatile_data.sensor[SENSOR_HE] = poeli_calc_he(&heater_state);
-        break;
-    }
 
-    if (maybeSensorsUpdated && gSensorsUpdated == 0) {
-      gSensorsUpdated = 1;
+    sleept = poeli_sensors_update();
+    if (gSensorsNew) {
+      kernel_event_signal(&gHeaterEvent);
     }
 
     /* Increase sensor update frequency in case of W-Bus activity. */
@@ -123,8 +263,46 @@ TASK_FUNC(poeli_read_sensors)
       sleept = MSEC2JIFFIES(100);
     }
 
-    kernel_sleep(sleept);
-    kernel_yield();
+    /* Woken up by the ADC if it can, else poll */
+    kernel_event_wait(&gSensorEvent, gAdcNotify ? 0 : sleept);
+  }
+}
+#endif /* POELI_SIM */
+
+/**
+ * Restart actuator ramps from the current sequence time.
+ */
+static
+void poeli_ramp_seed(heater_state_t *h, const heater_seq_t *seq)
+{
+  int i;
+
+  for (i=0; i<NUM_ACT; i++) {
+    ramp.acc[i] = (signed long)seq->act_step[i]*(long)h->volatile_data.time;
+  }
+  ramp.time = h->volatile_data.time;
+  ramp.status = h->volatile_data.status;
+  ramp.gen = seq_gen;
+}
+
+/**
+ * Advance actuator ramps to the current sequence time. Time normally
+ * counts down by one per tick, anything else needs a new seed.
+ */
+static
+void poeli_ramp_update(heater_state_t *h, const heater_seq_t *seq)
+{
+  int i;
+
+  if (ramp.status != h->volatile_data.status || ramp.gen != seq_gen) {
+    poeli_ramp_seed(h, seq);
+  } else if (ramp.time == h->volatile_data.time+1) {
+    for (i=0; i<NUM_ACT; i++) {
+      ramp.acc[i] -= seq->act_step[i];
+    }
+    ramp.time = h->volatile_data.time;
+  } else if (ramp.time != h->volatile_data.time) {
+    poeli_ramp_seed(h, seq);
   }
 }
 
@@ -148,7 +326,15 @@ int poeli_heater_switch_status(heater_state_t *h, heater_status_t s)
     h->volatile_data.status_sched = HT_NONE;
   }
   h->volatile_data.status = s;
-  seq = &seq_data.heater_seq[s];
+  seq = &seq_bank->heater_seq[s];
+
+  /* Count starts, checkpoint counters at begin and end of each run */
+  if (ps != s && (s == HT_START || s == HT_OFF)) {
+    if (s == HT_START) {
+      h->static_data.counter++;
+    }
+    wbus_server_store(&server);
+  }
 
   switch (s) {
     case HT_VENT:
@@ -176,6 +362,9 @@ int poeli_heater_switch_status(heater_state_t *h, heater_status_t s)
   for (i=0; i<HT_LAST; i++) {
     h->volatile_data.faults[i]=0;
   }
+  gSensorsStale = 0xffff;
+
+  poeli_ramp_seed(h, &seq->seq);
   
   return (ps != s); 
 }
@@ -184,76 +373,119 @@ int poeli_heater_switch_status(heater_state_t *h, heater_status_t s)
 static const unsigned char sensor_code[NUM_SENSOR] = 
 { ERR_INTGP, ERR_INTT, ERR_INTNSH, ERR_INTFPW, ERR_INTGP2, ERR_P, ERR_OH, ERR_VCCLOW, ERR_INTCAF, ERR_UNKNOWN, ERR_SCGP };
 
+/**
+ * Check sensors against the trip values of the current sequence and take
+ * the failure path if a sensor keeps failing.
+ * \param mask sensors to check, bit n is sensor n
+ * \return state changed
+ */
+static
+int poeli_heater_check(heater_state_t *h, unsigned short mask)
+{
+  const heater_seqmem_t *seq;
+  int i, stateChanged = 0;
+
+  seq = &seq_bank->heater_seq[h->volatile_data.status];
+
+  if (gSensorsUpdated)
+  {
+    unsigned short *s = h->volatile_data.sensor;
+
+    /* if too many faults, then take "if failure" state to continue */
+    i = wbus_server_sensor_check(&server, mask);
+    if (i >= 0) {
+      heater_status_t next_status;
+      PRINTF("State %d Sensor %d failure, current = %d, min = %d, max = %d\n", h->volatile_data.status, i, s[i], seq->seq.sensor_min[i], seq->seq.sensor_max[i]);
+      if (s[i] < seq->seq.sensor_min[i]) {
+        next_status = seq->seq.on_sensor_min[i];
+      } else {
+        next_status = seq->seq.on_sensor_max[i];
+      }
+
+      /* register error if next state indicates a serious error. */
+      if ( ! (seq->seq.fault_mask & (1<<i)) )
+      {
+        /* Turn off everything as a first thing. */
+        machine_ack(0);
+        /* Record the error */
+        wbus_error_add(&server, sensor_code[i], i);
+        PRINTF("fault mask %d\n", seq->seq.fault_mask);
+      }
+
+      stateChanged = poeli_heater_switch_status(h, next_status);
+#ifdef __linux__
+      for (i=0; i<NUM_ACT; i++) {
+        PRINTF("act[%d] = %d\n", i, h->volatile_data.act[i]);
+      }
+      for (i=0; i<NUM_SENSOR; i++) {
+        PRINTF("sensor[%d] = %d\n", i, s[i]);
+      }
+#endif
+    }
+  }
+
+  return stateChanged;
+}
+
+/**
+ * Compute and apply actuator values of the current sequence.
+ */
+static
+void poeli_heater_act(heater_state_t *h, int stateChanged)
+{
+  const heater_seqmem_t *seq;
+  int i;
+
+  seq = &seq_bank->heater_seq[h->volatile_data.status];
+
+  /* Handle actuators */
+  if (h->volatile_data.status != HT_TEST)
+  {
+    unsigned short *a = h->volatile_data.act;
+
+    poeli_ramp_update(h, &seq->seq);
+    for (i=0; i<NUM_ACT; i++) {
+      signed long step;
+      
+      step = ramp.acc[i];
+      if (i==ACT_DP) {
+        a[i] = seq->seq.act_target[i] - (step>>STEP_SCALE);
+      } else {
+        a[i] = (unsigned short)((((signed long)seq->seq.act_target[i]<<STEP_SCALE) - step)>>(STEP_SCALE-ACTMAX_LD2));
+      }
+    }
+    /* Add CO2 calibration factor to combustion air fan value */
+    a[ACT_CF] = (unsigned short) (((unsigned long)h->static_data.co2_cal * (unsigned long)a[ACT_CF])>>7);
+  }
+  /* Update actuators, changes to sensors might take a while. */
+  machine_act(h->volatile_data.act, NUM_ACT);
+
+
+  /* if the state changed, after updated hw ACTs, invalidate ADC values. */
+  if (stateChanged) {
+    gSensorsUpdated = 0;
+    adc_invalidate();
+  }
+}
+
 static
 void poeli_heater_iterate(heater_state_t *h)
 {
   const heater_seqmem_t *seq;
   static unsigned char tsec = 0;
-  int i, stateChanged;
+  int stateChanged;
 
   stateChanged = 0;
 
   /* Current sequence */
-  seq = &seq_data.heater_seq[h->volatile_data.status];
+  seq = &seq_bank->heater_seq[h->volatile_data.status];
 
   /* check time */
   if (h->volatile_data.time > 0) {
     h->volatile_data.time --;
   } else {
     stateChanged = poeli_heater_switch_status(h, seq->seq.status_next);
-    seq = &seq_data.heater_seq[h->volatile_data.status];
-  }
-
-  /* check sensors */
-  if (gSensorsUpdated && !stateChanged)
-  {
-    unsigned short *s = h->volatile_data.sensor;
-    unsigned char *f = h->volatile_data.faults;
-
-    for (i=0; i<NUM_SENSOR; i++) {
-      if (s[i] < seq->seq.sensor_min[i] || s[i] > seq->seq.sensor_max[i]) {
-        PRINTF("State %d Sensor %d failure, current = %d, min = %d, max = %d\n", h->volatile_data.status, i, s[i], seq->seq.sensor_min[i], seq->seq.sensor_max[i]);
-        /* increment fault counter */
-        f[i]++;
-
-        /* if too many faults, then take "if failure" state to continue */
-        if ( f[i] > seq->seq.max_faults ) {
-          heater_status_t next_status;
-          if (s[i] < seq->seq.sensor_min[i]) {
-            next_status = seq->seq.on_sensor_min[i];
-          } else {
-            next_status = seq->seq.on_sensor_max[i];
-          }
-
-          /* register error if next state indicates a serious error. */
-          if ( ! (seq->seq.fault_mask & (1<<i)) )
-          {
-            /* Turn off everything as a first thing. */
-            machine_ack(0);
-            /* Record the error */
-            wbus_error_add(h, sensor_code[i], i, wbdata+128);
-            PRINTF("fault mask %d\n", seq->seq.fault_mask);
-          }
-
-          stateChanged = poeli_heater_switch_status(h, next_status);
-          seq = &seq_data.heater_seq[h->volatile_data.status];
-#ifdef __linux__
-          for (i=0; i<NUM_ACT; i++) {
-            PRINTF("act[%d] = %d\n", i, h->volatile_data.act[i]);
-          }
-          for (i=0; i<NUM_SENSOR; i++) {
-            PRINTF("sensor[%d] = %d\n", i, s[i]);
-          }
-#endif
-          break;
-        }
-      } else {
-        /* if sensor value is in the desired range, decrement fault counter */
-        if ( f[i] > 0 ) {
-          f[i]--;
-        }
-      }
-    }
+    seq = &seq_bank->heater_seq[h->volatile_data.status];
   }
 
   /* Command refresh handling */
@@ -275,9 +507,9 @@ void poeli_heater_iterate(heater_state_t *h)
       {
         ns = HT_STOP;
       }
-      wbus_error_add(h, ERR_REFRESH, 0, wbdata+128);
+      wbus_error_add(&server, ERR_REFRESH, 0);
       stateChanged = poeli_heater_switch_status(h, ns);
-      seq = &seq_data.heater_seq[h->volatile_data.status];
+      seq = &seq_bank->heater_seq[h->volatile_data.status];
       h->volatile_data.cmd_refresh = 0;
     }
   } 
@@ -285,32 +517,9 @@ void poeli_heater_iterate(heater_state_t *h)
     h->volatile_data.cmd_refresh = 0;
   }
 
-  /* Handle actuators */
-  if (h->volatile_data.status != HT_TEST)
-  {
-    unsigned short *a = h->volatile_data.act;
-    for (i=0; i<NUM_ACT; i++) {
-      signed long step;
-      
-      step = (signed long)seq->seq.act_step[i]*(long)h->volatile_data.time;
-      if (i==ACT_DP) {
-        a[i] = seq->seq.act_target[i] - (step>>STEP_SCALE);
-      } else {
-        a[i] = (unsigned short)((((signed long)seq->seq.act_target[i]<<STEP_SCALE) - step)>>(STEP_SCALE-ACTMAX_LD2));
-      }
-    }
-    /* Add CO2 calibration factor to combustion air fan value */
-    a[ACT_CF] = (unsigned short) (((unsigned long)h->static_data.co2_cal * (unsigned long)a[ACT_CF])>>7);
-  }
-  /* Update actuators, changes to sensors might take a while. */
-  machine_act(h->volatile_data.act, NUM_ACT);
-
+  poeli_heater_act(h, stateChanged);
 
-  /* if the state changed, after updated hw ACTs, invalidate ADC values. */
-  if (stateChanged) {
-    gSensorsUpdated = 0;
-    adc_invalidate();
-  }
+  wbus_server_log(&server);
 
   /* Do duration accounting */
   tsec++;
@@ -322,21 +531,61 @@ void poeli_heater_iterate(heater_state_t *h)
       rtc_add(&heater_state.static_data.working_duration, 1);
     }
     tsec = 0;
+    /* Checkpoint counters every 10 minutes */
+    if (heater_state.static_data.operating_duration.seconds == 0
+     && heater_state.static_data.operating_duration.minutes % 10 == 0)
+    {
+      wbus_server_store(&server);
+    }
+  }
+}
+
+/**
+ * One pass of the control task: advance the sequence if the iteration at
+ * *due is due and check sensor data handed over by poeli_sensors_update().
+ */
+static
+void poeli_heater_poll(unsigned int *due)
+{
+  unsigned int now;
+
+  /* Sequences advance once per HEATER_PERIOD */
+  now = machine_getJiffies();
+  if ((signed int)(now - *due) >= 0) {
+    poeli_heater_iterate(&heater_state);
+    *due += HEATER_PERIOD;
+    if ((signed int)(now - *due) >= 0) {
+      *due = now + HEATER_PERIOD;
+    }
+  }
+
+  /* Sensor faults are handled as soon as the data is there */
+  if (gSensorsNew) {
+    unsigned short mask = gSensorsNew;
+
+    gSensorsNew = 0;
+    if (poeli_heater_check(&heater_state, mask)) {
+      poeli_heater_act(&heater_state, 1);
+    }
   }
 }
 
+#ifndef POELI_SIM
 #ifdef POELI_UART1_ON
 static int prev_button = 0;
 #endif
 
 TASK_FUNC(poeli_heater_ctrl)
 {
+  unsigned int due, now;
+
   heater_state.volatile_data.status = HT_OFF;
   heater_state.volatile_data.status_sched = HT_NONE;
+  due = machine_getJiffies();
   
   while (1)
   {
-    poeli_heater_iterate(&heater_state);
+    poeli_heater_poll(&due);
 
 #ifdef POELI_UART1_ON
     gfActive = 1;
@@ -344,11 +593,18 @@ TASK_FUNC(poeli_heater_ctrl)
 
     if (heater_state.volatile_data.status == HT_OFF && !gfActive) {
       machine_ack(0);
-      kernel_suspend();
-      kernel_yield();
+      kernel_event_wait(&gHeaterEvent, 0);
+      /* Only state requests need an iteration right away */
+      due = machine_getJiffies();
+      if (heater_state.volatile_data.status_sched == HT_NONE) {
+        due += HEATER_PERIOD;
+      }
     } else {
       machine_ack(1);
-      kernel_sleep(HEATER_PERIOD);
+      now = machine_getJiffies();
+      if ((signed int)(due - now) > 0) {
+        kernel_event_wait(&gHeaterEvent, due - now);
+      }
       kernel_yield();
     }
 
@@ -389,6 +645,7 @@ TASK_FUNC(poeli_listen_wbus)
     exit(-1);
   }
 #endif
+  server.tm.link = wbus_link_stats(w);
 
   while (1) {
     /* Listen to W-Bus message. Blocking I/O */
@@ -396,13 +653,16 @@ TASK_FUNC(poeli_listen_wbus)
 
     /* Assemble W-Bus response using current state info. */
     if (err ==  0) {
-      err = wbus_server_process(cmd, wbdata, &len, &heater_state);
-      gfActive = 1;
+      err = wbus_server_process(&server, cmd, wbdata, &len);
+      if (!gfActive) {
+        gfActive = 1;
+        kernel_event_signal(&gSensorEvent);
+      }
       gActiveTimout = machine_getJiffies();
     }
 
     if (heater_state.volatile_data.status_sched != HT_NONE) {
-      kernel_wakeup(-1);
+      kernel_event_signal(&gHeaterEvent);
     }
 
     /* Sent assembled W-Bus message back to client. */
@@ -410,26 +670,52 @@ TASK_FUNC(poeli_listen_wbus)
     if (err) {
       PRINTF("wbus_host_answer() failed\n");
     }
+    if (server.tm.link->lat > WBUS_ANSWER_MAX) {
+      PRINTF("W-Bus answer late by %u jiffies\n", (unsigned int)(server.tm.link->lat - WBUS_ANSWER_MAX));
+      server.tm.deadlines++;
+    }
 
     kernel_yield();
   }
 }
 
+static
+void poeli_deadline_missed(int task, unsigned int late)
+{
+  PRINTF("Task %d missed its deadline by %u jiffies\n", task, late);
+  server.tm.deadlines++;
+}
+
 void main(void)
 {
+  int t;
+
   gActiveTimout=0;
   gfActive=1;
   gSensorsUpdated=0;
   kernel_init();
+  kernel_event_init(&gHeaterEvent);
+  kernel_event_init(&gSensorEvent);
+  gAdcNotify = adc_ready_hook(poeli_adc_ready);
   poeli_ctrl_init();
+  poeli_calc_init();
 
-  wbus_server_init(&heater_state);
+  wbus_server_init(&server, &heater_state, WBUS_SERVER_PERSISTENT);
+#if LOG_BLOCKS > 0
+  wbus_server_log_init(&server, &heater_log, heater_log_buf, LOG_BLOCKS);
+#endif
 
   PRINTF("size of seq_data.heater_seq = %d\n", sizeof(seq_data));
 
   kernel_task_register(poeli_read_sensors, KERNEL_STACK_SIZE/3);
-  kernel_task_register(poeli_heater_ctrl, KERNEL_STACK_SIZE/3);
-  kernel_task_register(poeli_listen_wbus, KERNEL_STACK_SIZE/3);
+  t = kernel_task_register(poeli_heater_ctrl, KERNEL_STACK_SIZE/3);
+  kernel_task_priority(t, 1);
+  /* W-Bus replies have tight timing, never let them wait for other tasks */
+  t = kernel_task_register(poeli_listen_wbus, KERNEL_STACK_SIZE/3);
+  kernel_task_priority(t, 2);
+  kernel_task_deadline(t, WBUS_RUN_SLICE);
+  kernel_deadline_hook(poeli_deadline_missed);
 
   kernel_run();
 }
+#endif /* POELI_SIM */
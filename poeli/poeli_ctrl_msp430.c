@@ -98,6 +98,7 @@ static unsigned int msp430_check_actuators(void)
 }
 
 static unsigned char gADCstatus=0;
+static void (*gADCHook)(void);
 
 interrupt(ADC12_VECTOR) msp430_adc12_interrupt(void)
 {
@@ -116,6 +117,11 @@ interrupt(ADC12_VECTOR) msp430_adc12_interrupt(void)
     if (gADCstatus == 3) {
       gADCstatus |= 4;
     }
+    /* End of sequence */
+    if (gADCHook != NULL) {
+      gADCHook();
+      machine_wakeup();
+    }
   }
 
   /* Reset all flags */
@@ -153,6 +159,17 @@ int adc_is_uptodate(void)
   return ( gADCstatus == 7 );
 }
 
+int adc_ready_hook(void (*hook)(void))
+{
+  gADCHook = hook;
+#ifdef POELI_HW
+  /* Timer triggered sequences, see adc_init() */
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 #define VREF 3300
 #define VCCREF 12500
 
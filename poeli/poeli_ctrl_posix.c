@@ -21,13 +21,6 @@
 /* Modulate GK and Nozzle stock preheating power */
 //#define GK_MODULATE
 
-#include <sys/ipc.h> 
-#include <sys/shm.h> 
-#include <sys/time.h>
-
-static int shmid;
-static unsigned short (*d)[16];
-
 /* Actuator ouput pin state while driver on or off. */
 unsigned char gP2StateOff, gP2StateOn;
 
@@ -58,26 +51,20 @@ void poeli_ctrl_adc12_interrupt(void)
 static unsigned int gCafPeriod = 0;
 static unsigned int gCafCounter = 0;
 
+/* Sensors come from the plant simulator through machine_posix.c */
 int poeli_ctrl_read_single(int c)
 {
-  return d[1][c];
+  return adc_read_single(c);
 }
  
 void poeli_ctrl_read(unsigned short *s, int n)
 {
-  int i;
-  /* Write back virtual sensors */
-  d[1][10] = s[10];
-  d[1][9] = s[9];  
-
-  for (i=0; i<n; i++) {
-    s[i] = d[1][i];
-  }
+  adc_read(s, n);
 }  
    
 void poeli_ctrl_invalidate(void)
 {
-  d[2][0] = 0;
+  adc_invalidate();
 }
 
 int poeli_ctrl_is_uptodate(void)
@@ -433,15 +420,6 @@ void poeli_ctrl_ack(int ack)
 
 void poeli_ctrl_init(void)
 {
-  shmid = shmget(0xb0E1, 4096, 0666 | IPC_CREAT);
-  if (shmid == -1) {
-    printf("shmget() failed\n");
-  }
-  d = shmat(shmid, (void *)0, 0);
-  if ((int)d == -1) {
-    printf("shmat() failed (d)\n");
-  }
-
   adc_invalidate();
   pack=0;
   hTimerFp=NULL;
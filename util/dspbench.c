@@ -0,0 +1,284 @@
+/*
+ * Check the fixed point filters of dsp.c against float reference
+ * implementations: deviation from the reference and time per sample.
+ * The input is a synthetic sensor signal with steps, ramps, noise and
+ * single sample spikes.
+ *
+ * License: BSD
+ */
+
+#include "dsp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+static int n = 1000000;
+static unsigned short *in;
+static unsigned short *outFix;
+static float *outRef;
+static volatile unsigned long sink;
+
+static
+double bench_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static
+void bench_signal(void)
+{
+  unsigned long rnd = 1;
+  int i, level = 1000;
+
+  for (i=0; i<n; i++) {
+    /* Steps every 5000 samples, a ramp in between and noise of +-16 */
+    if ((i % 5000) == 0) {
+      level = 500 + (i/5000 % 7) * 500;
+    }
+    rnd = rnd*1103515245 + 12345;
+    in[i] = level + (i % 5000)/10 + ((rnd>>16) & 31) - 16;
+    /* Spikes */
+    if ((i % 97) == 0) {
+      in[i] += 1500;
+    }
+  }
+}
+
+static
+void bench_report(const char *name, double tFix, double tRef)
+{
+  double err, maxErr = 0, sumErr = 0;
+  int i;
+
+  for (i=0; i<n; i++) {
+    err = (signed short)outFix[i] - outRef[i];
+    sumErr += err;
+    if (fabs(err) > maxErr) {
+      maxErr = fabs(err);
+    }
+  }
+  printf("%-22s %8.2f %8.2f %10.3f %10.3f\n", name, tFix*1e9/n, tRef*1e9/n, maxErr, sumErr/n);
+}
+
+static
+void bench_ma(unsigned char ld)
+{
+  dsp_ma_t f;
+  unsigned short x[1<<15];
+  float sum = 0, r[1<<15];
+  double t0, t1, t2;
+  char name[32];
+  int i, j = 0;
+
+  dsp_ma_init(&f, x, ld, in[0]);
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    outFix[i] = dsp_ma(&f, in[i]);
+  }
+  t1 = bench_now();
+  for (i=0; i<(1<<ld); i++) {
+    r[i] = in[0];
+    sum += in[0];
+  }
+  for (i=0; i<n; i++) {
+    sum += in[i] - r[j];
+    r[j] = in[i];
+    j = (j+1) & ((1<<ld)-1);
+    outRef[i] = sum / (1<<ld);
+  }
+  t2 = bench_now();
+
+  sprintf(name, "moving average %d", 1<<ld);
+  bench_report(name, t1-t0, t2-t1);
+}
+
+static
+void bench_iir1(unsigned char ld)
+{
+  dsp_iir1_t f;
+  float y = in[0];
+  double t0, t1, t2;
+  char name[32];
+  int i;
+
+  dsp_iir1_init(&f, ld, in[0]);
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    outFix[i] = dsp_iir1(&f, in[i]);
+  }
+  t1 = bench_now();
+  for (i=0; i<n; i++) {
+    y += (in[i] - y) / (1<<ld);
+    outRef[i] = y;
+  }
+  t2 = bench_now();
+
+  sprintf(name, "iir1 1/%d", 1<<ld);
+  bench_report(name, t1-t0, t2-t1);
+}
+
+/* Butterworth low pass with cut off fs/div */
+static
+void bench_biquad(int div)
+{
+  dsp_biquad_t f;
+  double w, alpha, a0, c[5];
+  signed short q[5];
+  float x1, x2, y1, y2, y;
+  double t0, t1, t2;
+  char name[32];
+  int i;
+
+  w = 2*M_PI/div;
+  alpha = sin(w)/(2*M_SQRT1_2);
+  a0 = 1 + alpha;
+  c[0] = (1 - cos(w))/2/a0;
+  c[1] = (1 - cos(w))/a0;
+  c[2] = c[0];
+  c[3] = -2*cos(w)/a0;
+  c[4] = (1 - alpha)/a0;
+  for (i=0; i<5; i++) {
+    q[i] = lrint(c[i]*16384);
+  }
+  /* Keep the DC gain at exactly 1 despite rounding */
+  q[1] = 16384 + q[3] + q[4] - 2*q[0];
+
+  dsp_biquad_init(&f, q, in[0]);
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    outFix[i] = dsp_biquad(&f, in[i]);
+  }
+  t1 = bench_now();
+  x1 = x2 = y1 = y2 = in[0];
+  for (i=0; i<n; i++) {
+    y = c[0]*in[i] + c[1]*x1 + c[2]*x2 - c[3]*y1 - c[4]*y2;
+    x2 = x1;
+    x1 = in[i];
+    y2 = y1;
+    y1 = y;
+    outRef[i] = y;
+  }
+  t2 = bench_now();
+
+  sprintf(name, "biquad fs/%d", div);
+  bench_report(name, t1-t0, t2-t1);
+}
+
+static
+int bench_cmp(const void *a, const void *b)
+{
+  float fa = *(const float*)a, fb = *(const float*)b;
+
+  return (fa > fb) - (fa < fb);
+}
+
+static
+void bench_median(unsigned char len)
+{
+  dsp_median_t f;
+  unsigned short x[DSP_MEDIAN_MAX];
+  float r[DSP_MEDIAN_MAX], s[DSP_MEDIAN_MAX];
+  double t0, t1, t2;
+  char name[32];
+  int i, j = 0;
+
+  dsp_median_init(&f, x, len, in[0]);
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    outFix[i] = dsp_median(&f, in[i]);
+  }
+  t1 = bench_now();
+  for (i=0; i<len; i++) {
+    r[i] = in[0];
+  }
+  for (i=0; i<n; i++) {
+    r[j] = in[i];
+    if (++j >= len) {
+      j = 0;
+    }
+    memcpy(s, r, sizeof(float)*len);
+    qsort(s, len, sizeof(float), bench_cmp);
+    outRef[i] = s[len/2];
+  }
+  t2 = bench_now();
+
+  sprintf(name, "median %d", len);
+  bench_report(name, t1-t0, t2-t1);
+}
+
+static
+void bench_hyst(void)
+{
+  dsp_hyst_t h;
+  int i, on = 0, cnt = 0;
+  double t0, t1, t2;
+
+  dsp_hyst_init(&h, 1500, 2500, 3);
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    outFix[i] = dsp_hyst(&h, in[i]);
+  }
+  t1 = bench_now();
+  for (i=0; i<n; i++) {
+    if ((!on && (float)in[i] > 2500.0f) || (on && (float)in[i] < 1500.0f)) {
+      if (++cnt >= 3) {
+        on = !on;
+        cnt = 0;
+      }
+    } else {
+      cnt = 0;
+    }
+    outRef[i] = on;
+  }
+  t2 = bench_now();
+
+  bench_report("hysteresis", t1-t0, t2-t1);
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    n = atoi(argv[2]);
+  }
+  if (n <= 0) {
+    fprintf(stderr, "usage: %s [-n samples]\n", argv[0]);
+    return -1;
+  }
+
+  in = malloc(n*sizeof(unsigned short));
+  outFix = malloc(n*sizeof(unsigned short));
+  outRef = malloc(n*sizeof(float));
+  if (in == NULL || outFix == NULL || outRef == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  bench_signal();
+
+  printf("%d samples\n", n);
+  printf("%-22s %8s %8s %10s %10s\n", "filter", "ns fix", "ns float", "max err", "mean err");
+  bench_ma(4);
+  bench_ma(6);
+  bench_iir1(2);
+  bench_iir1(5);
+  bench_biquad(10);
+  bench_biquad(20);
+  bench_biquad(50);
+  bench_biquad(100);
+  bench_median(3);
+  bench_median(9);
+  bench_hyst();
+
+  for (i=0; i<n; i++) {
+    sink += outFix[i];
+  }
+
+  return 0;
+}
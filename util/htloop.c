@@ -0,0 +1,750 @@
+/*
+ * Closed loop heater simulation in a single process. The control code of
+ * poeli runs against the plant models of htsim on a virtual clock, so a
+ * whole heater run takes a fraction of a second and gives the same result
+ * every time. The heater is operated through wbus_server_process() like a
+ * W-Bus client would: switch on, keep the command alive, optionally switch
+ * off early.
+ *
+ * With -r the sensors come from a recorded trace instead of the plant
+ * models, interpolated linearly between samples at the plant rate. Holding
+ * samples instead makes steps of up to the sample interval, which the flame
+ * detector and the trip checks react to. Traces should be sampled at least
+ * once per plant step (HTSIM_PERIOD, about 4 Hz); slower traces, like 1 Hz
+ * Thermo Test exports, are replayed with a warning, fast transients between
+ * their samples are lost. Accepted traces are:
+ * - Logs of this project, one sample per line: time in seconds, status,
+ *   then the sensors in firmware units (wbtool -L, htloop output). The
+ *   virtual sensors HE and FD are computed again, not taken from the log.
+ * - Thermo Test exports as plotted by plot_log.sh: UTF-16 or plain text,
+ *   tab separated, date and time in columns 1 and 2. -c maps columns to
+ *   sensors, e.g. -c t0=3:1:50,vcc=5:1000 for T0 = col3*1+50 and
+ *   VCC = col5*1000. Sensors without column keep the values of a cold
+ *   plant.
+ *
+ * With -d the actuator ramps of poeli are checked instead: the accumulators
+ * must equal act_step*time, the formula they replace, on every tick of every
+ * data set entry, also with the steps negated and at their extremes.
+ *
+ * Prints each state change with sensors and actuators, with -r also every
+ * 10 s (-p). Exit status is 0 if the heater went through its sequence back
+ * to off without errors. With -g the output is compared against a golden
+ * file from an earlier run instead, exit status is 0 if it is the same.
+ * make check runs the reference trace and golden files of util/check.
+ *
+ * License: BSD
+ */
+
+#define _GNU_SOURCE
+#include "machine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Firmware debug output only if asked for */
+static int verbose;
+#undef PRINTF
+#define PRINTF(fmt, ...) { if (verbose) printf(fmt, ## __VA_ARGS__); }
+
+#define POELI_SIM
+#include "../poeli/poeli.c"
+#include "htsim_model.h"
+
+/* Interval of the W-Bus command refresh in ms */
+#define HTLOOP_REFRESH 10000
+/* Longest trace line and largest column number */
+#define TRACE_LINE 1024
+#define TRACE_COLS 64
+/* Golden file mismatches shown */
+#define GOLDEN_SHOW 10
+
+static const char *status_name[HT_LAST] = {
+  "off", "start", "preheat", "glow", "ignite", "stabilize", "rampup", "burn_h",
+  "rampdown", "burn_l", "stop", "cooldown", "end", "vent", "test", "locked"
+};
+
+static const char *sensor_name[NUM_SENSOR] = {
+  "gpr", "t0", "t1", "gkph", "gkz", "p", "overheat", "vcc", "caf", "he", "fd"
+};
+
+/* Virtual machine */
+static unsigned int simJiffies;
+static htsim_model_t model;
+static unsigned short plant[2][16];   /* d[0]: actuators, d[1]: sensors */
+static unsigned int actSeq;           /* actuator generation */
+static unsigned int sensorRef;        /* actuator generation the sensors were computed from */
+static unsigned int invalidSeq;       /* actuator generation at last adc_invalidate() */
+
+unsigned int machine_getJiffies(void)
+{
+  return simJiffies;
+}
+
+unsigned int machine_getProfClock(void)
+{
+  return simJiffies*(PFREQ/JFREQ);
+}
+
+void machine_act(unsigned short a[], int n)
+{
+  memcpy(plant[0], a, n*sizeof(unsigned short));
+  actSeq++;
+}
+
+void machine_ack(int ack)
+{
+}
+
+void adc_invalidate(void)
+{
+  invalidSeq = actSeq;
+}
+
+int adc_is_uptodate(void)
+{
+  return (int)(sensorRef - invalidSeq) >= 0;
+}
+
+void poeli_ctrl_read(unsigned short s[], int n)
+{
+  int i;
+
+  /* Virtual sensors go to the plant, like adc_read() of machine_posix.c */
+  plant[1][SENSOR_HE] = s[SENSOR_HE];
+  plant[1][SENSOR_FD] = s[SENSOR_FD];
+  for (i=0; i<n; i++) {
+    if (i != SENSOR_HE && i != SENSOR_FD) {
+      s[i] = plant[1][i];
+    }
+  }
+}
+
+void rtc_add(rtc_time_t *t, signed char secs)
+{
+  t->seconds += secs;
+  while (t->seconds >= 60) {
+    t->seconds -= 60;
+    t->minutes++;
+  }
+  while (t->minutes >= 60) {
+    t->minutes -= 60;
+    t->hours++;
+  }
+}
+
+/* Nothing is persistent, wbus_server runs without WBUS_SERVER_PERSISTENT */
+void flash_write(void *fptr, void *rptr, int nbytes)
+{
+}
+
+void flash_program(void *fptr, const void *rptr, int nbytes)
+{
+}
+
+#ifdef KERNEL_PROFILE
+/* No kernel, DIAG_SCHED sees a single task without statistics */
+int kernel_stack_size(int task)
+{
+  return (task == 0) ? 0 : -1;
+}
+
+int kernel_stack_usage(int task)
+{
+  return (task == 0) ? 0 : -1;
+}
+
+int kernel_profile_get(int task, kernel_prof_t *p)
+{
+  return -1;
+}
+
+void kernel_profile_reset(void)
+{
+}
+#endif
+
+/* Recorded sensors */
+static struct {
+  FILE *f;
+  unsigned char utf16;        /* UTF-16LE, Thermo Test default */
+  unsigned char foreign;      /* Thermo Test export, columns mapped by map[] */
+  unsigned char eof;
+  long first;                 /* time stamp of the first sample in s, -1 before */
+  double firstSec;            /* same for logs of this project */
+  unsigned char slow;         /* warned about the sample interval */
+  unsigned char held;         /* a sample has been applied, v0 is valid */
+  unsigned long long ms;      /* time of the sample in v */
+  unsigned short v[NUM_SENSOR];
+  unsigned long long ms0;     /* time of the last applied sample in v0 */
+  unsigned short v0[NUM_SENSOR];
+} trace;
+
+/* Thermo Test column of each sensor (0: none) and its conversion */
+static struct {
+  int col;
+  double scale, offset;
+} map[NUM_SENSOR];
+
+/* Output comparison */
+static FILE *golden;
+static unsigned long goldenLine, goldenDiff;
+
+static
+int trace_map(char *spec)
+{
+  char *tok, *eq;
+  int i;
+
+  for (tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    eq = strchr(tok, '=');
+    if (eq == NULL) {
+      return -1;
+    }
+    *eq++ = 0;
+    for (i=0; i<SENSOR_HE; i++) {
+      if (strcasecmp(tok, sensor_name[i]) == 0) {
+        break;
+      }
+    }
+    if (i >= SENSOR_HE) {
+      fprintf(stderr, "Unknown sensor %s\n", tok);
+      return -1;
+    }
+    map[i].scale = 1;
+    map[i].offset = 0;
+    if (sscanf(eq, "%d:%lf:%lf", &map[i].col, &map[i].scale, &map[i].offset) < 1
+     || map[i].col < 1 || map[i].col > TRACE_COLS) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static
+char *trace_gets(char *buf, int size)
+{
+  int c, c2, n = 0;
+
+  if (!trace.utf16) {
+    return fgets(buf, size, trace.f);
+  }
+
+  /* Only ASCII matters, everything else becomes '?' */
+  while (n < size-1) {
+    c = fgetc(trace.f);
+    c2 = fgetc(trace.f);
+    if (c == EOF || c2 == EOF) {
+      break;
+    }
+    c |= c2<<8;
+    buf[n++] = (c > 0x7f) ? '?' : c;
+    if (c == '\n') {
+      break;
+    }
+  }
+  if (n == 0) {
+    return NULL;
+  }
+  buf[n] = 0;
+
+  return buf;
+}
+
+/* One Thermo Test line, columns counted from 1 like plot_log.sh does */
+static
+int trace_foreign(char *line)
+{
+  char *col[TRACE_COLS+1], *p;
+  struct tm tm;
+  long t;
+  int n, i;
+
+  n = 0;
+  for (p = strtok(line, "\t\r\n"); p != NULL && n < TRACE_COLS; p = strtok(NULL, "\t\r\n")) {
+    col[++n] = p;
+  }
+  memset(&tm, 0, sizeof(tm));
+  if (n < 2
+   || sscanf(col[1], "%d.%d.%d", &tm.tm_mday, &tm.tm_mon, &tm.tm_year) != 3
+   || sscanf(col[2], "%d:%d:%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 3) {
+    return -1;
+  }
+  tm.tm_mon -= 1;
+  tm.tm_year += 100;
+  t = timegm(&tm);
+  if (trace.first < 0) {
+    trace.first = t;
+  }
+  trace.ms = (unsigned long long)(t - trace.first)*1000;
+
+  for (i=0; i<SENSOR_HE; i++) {
+    if (map[i].col > 0 && map[i].col <= n) {
+      /* Decimal comma of german exports */
+      for (p = col[map[i].col]; *p; p++) {
+        if (*p == ',') {
+          *p = '.';
+        }
+      }
+      trace.v[i] = (unsigned short)(strtod(col[map[i].col], NULL)*map[i].scale + map[i].offset + 0.5);
+    }
+  }
+
+  return 0;
+}
+
+/* One line of wbtool -L or htloop: time, status, sensors */
+static
+int trace_native(char *line)
+{
+  unsigned short v[NUM_SENSOR];
+  double sec;
+  char *p, *end;
+  int i;
+
+  sec = strtod(line, &end);
+  if (end == line) {
+    return -1;
+  }
+  p = end;
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  while (*p && !isspace((unsigned char)*p)) {
+    p++;
+  }
+  for (i=0; i<NUM_SENSOR; i++) {
+    v[i] = strtol(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    p = end;
+  }
+  if (trace.first < 0) {
+    trace.first = 0;
+    trace.firstSec = sec;
+  }
+  trace.ms = (unsigned long long)((sec - trace.firstSec)*1000 + 0.5);
+  for (i=0; i<SENSOR_HE; i++) {
+    trace.v[i] = v[i];
+  }
+
+  return 0;
+}
+
+/**
+ * \brief read next sample into trace.v. Sensors without data keep their value.
+ * \return 0 on success, -1 at end of trace.
+ */
+static
+int trace_next(void)
+{
+  char line[TRACE_LINE];
+
+  while (trace_gets(line, sizeof(line)) != NULL) {
+    if (line[0] == '#' || line[0] == '\r' || line[0] == '\n') {
+      continue;
+    }
+    if (strstr(line, "Date") != NULL) {
+      trace.foreign = 1;
+      continue;
+    }
+    if (!trace.foreign && strchr(line, '\t') != NULL && isdigit((unsigned char)line[0])
+     && line[1] && line[2] == '.') {
+      trace.foreign = 1;
+    }
+    if ((trace.foreign ? trace_foreign(line) : trace_native(line)) == 0) {
+      return 0;
+    }
+  }
+  trace.eof = 1;
+
+  return -1;
+}
+
+static
+int trace_open(const char *name)
+{
+  int c, c2;
+
+  trace.f = fopen(name, "rb");
+  if (trace.f == NULL) {
+    perror(name);
+    return -1;
+  }
+  c = fgetc(trace.f);
+  c2 = fgetc(trace.f);
+  if (c == 0xff && c2 == 0xfe) {
+    trace.utf16 = 1;
+  } else {
+    rewind(trace.f);
+  }
+  trace.first = -1;
+
+  /* Cold plant for everything that was not recorded */
+  htsim_model_step(&model, plant);
+  memcpy(trace.v, plant[1], sizeof(trace.v));
+
+  if (trace_next() != 0) {
+    fprintf(stderr, "%s: no samples\n", name);
+    return -1;
+  }
+  if (trace.foreign) {
+    for (c=0; c<SENSOR_HE && map[c].col == 0; c++);
+    if (c >= SENSOR_HE) {
+      fprintf(stderr, "%s: Thermo Test export needs a column map (-c)\n", name);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * \brief set the sensors to the trace at ms, interpolated between the
+ *        samples around it. The last sample is held.
+ * \return 0 if the sensors did not change, before the first sample and
+ *         after the last one.
+ */
+static
+int trace_read(unsigned long long ms)
+{
+  int i, n = 0;
+
+  while (!trace.eof && trace.ms <= ms) {
+    trace.ms0 = trace.ms;
+    memcpy(trace.v0, trace.v, sizeof(trace.v0));
+    trace.held = 1;
+    trace_next();
+    n++;
+  }
+  if (!trace.held) {
+    return 0;
+  }
+  if (trace.eof) {
+    for (i=0; i<SENSOR_HE; i++) {
+      plant[1][i] = trace.v0[i];
+    }
+    return n;
+  }
+
+  /* Logs of this project have 10 ms resolution */
+  if (!trace.slow && trace.ms - trace.ms0 > HTSIM_PERIOD + 10) {
+    fprintf(stderr, "trace: %llu ms between samples at %.2f s, longer than the plant step of %d ms, interpolated\n",
+            trace.ms - trace.ms0, trace.ms0/1000.0, HTSIM_PERIOD);
+    trace.slow = 1;
+  }
+  for (i=0; i<SENSOR_HE; i++) {
+    plant[1][i] = trace.v0[i] + ((long)trace.v[i] - trace.v0[i])*(long long)(ms - trace.ms0)/(long long)(trace.ms - trace.ms0);
+  }
+
+  return 1;
+}
+
+static
+void htloop_out(const char *line)
+{
+  char g[TRACE_LINE];
+
+  if (golden == NULL) {
+    fputs(line, stdout);
+    return;
+  }
+
+  goldenLine++;
+  if (fgets(g, sizeof(g), golden) == NULL) {
+    g[0] = 0;
+  }
+  if (strcmp(g, line) != 0) {
+    if (goldenDiff < GOLDEN_SHOW) {
+      printf("line %lu:\n- %s+ %s", goldenLine, g[0] ? g : "(end of file)\n", line);
+    }
+    goldenDiff++;
+  }
+}
+
+/**
+ * \brief account for lines of the golden file beyond the output.
+ * \return amount of differing lines.
+ */
+static
+unsigned long htloop_golden_end(void)
+{
+  char g[TRACE_LINE];
+
+  while (fgets(g, sizeof(g), golden) != NULL) {
+    goldenLine++;
+    if (goldenDiff < GOLDEN_SHOW) {
+      printf("line %lu:\n- %s+ (end of output)\n", goldenLine, g);
+    }
+    goldenDiff++;
+  }
+
+  return goldenDiff;
+}
+
+static
+void htloop_cmd(unsigned char cmd, unsigned char arg)
+{
+  unsigned char data[256];
+  int len = 1;
+
+  data[0] = arg;
+  wbus_server_process(&server, cmd, data, &len);
+}
+
+static
+void htloop_print(double t)
+{
+  heater_status_t st = heater_state.volatile_data.status;
+  char line[TRACE_LINE];
+  int i, n;
+
+  n = sprintf(line, "%10.2f %-9s", t, (st >= 0 && st < HT_LAST) ? status_name[st] : "?");
+  for (i=0; i<NUM_SENSOR; i++) {
+    n += sprintf(line+n, " %5u", heater_state.volatile_data.sensor[i]);
+  }
+  n += sprintf(line+n, " |");
+  for (i=0; i<NUM_ACT; i++) {
+    n += sprintf(line+n, " %5u", heater_state.volatile_data.act[i]);
+  }
+  sprintf(line+n, "\n");
+  htloop_out(line);
+}
+
+/* Run the ramp of seq down from its full time, 0 if bit exact */
+static
+int htloop_ramp_run(heater_status_t st, const heater_seq_t *seq, const char *what)
+{
+  heater_state_t *h = &heater_state;
+  signed long ref;
+  unsigned int t;
+  int i;
+
+  h->volatile_data.status = st;
+  h->volatile_data.time = seq->time;
+  poeli_ramp_seed(h, seq);
+  for (t=h->volatile_data.time; ; t--) {
+    h->volatile_data.time = t;
+    poeli_ramp_update(h, seq);
+    for (i=0; i<NUM_ACT; i++) {
+      ref = (signed long)seq->act_step[i]*(long)t;
+      /* The product must also fit the 32 bit long of MSP430 */
+      if (ramp.acc[i] != ref || ref > 0x7fffffffL || ref < -0x7fffffffL-1) {
+        printf("%s %s act %d step %d time %u: %ld, expected %ld\n", status_name[st], what,
+               i, seq->act_step[i], t, (long)ramp.acc[i], (long)ref);
+        return -1;
+      }
+    }
+    if (t == 0) {
+      return 0;
+    }
+  }
+}
+
+static
+int htloop_ramp_check(void)
+{
+  heater_seq_t seq;
+  unsigned long ticks = 0;
+  int st, i;
+
+  for (st=0; st<HT_LAST; st++) {
+    seq = seq_bank->heater_seq[st].seq;
+    if (htloop_ramp_run(st, &seq, "data set") != 0) {
+      return -1;
+    }
+    for (i=0; i<NUM_ACT; i++) {
+      seq.act_step[i] = -seq.act_step[i];
+    }
+    if (htloop_ramp_run(st, &seq, "negated") != 0) {
+      return -1;
+    }
+    for (i=0; i<NUM_ACT; i++) {
+      seq.act_step[i] = (i & 1) ? -32768 : 32767;
+    }
+    if (htloop_ramp_run(st, &seq, "extreme") != 0) {
+      return -1;
+    }
+    ticks += 3*((unsigned long)(unsigned int)seq.time+1);
+  }
+  printf("Ramps of %d data set entries bit exact over %lu ticks\n", HT_LAST, ticks);
+
+  return 0;
+}
+
+static
+void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-r trace [-c map]] [-g golden] [-p seconds] [-m minutes] [-o seconds] [-t seconds] [-x factor] [-v] [-d]\n", name);
+  fprintf(stderr, " -r  sensors from a recorded trace instead of the plant models\n");
+  fprintf(stderr, " -c  sensor columns of a Thermo Test export, name=column[:scale[:offset]],...\n");
+  fprintf(stderr, " -g  compare output with a golden file\n");
+  fprintf(stderr, " -p  also print every given seconds, default 10 with -r\n");
+  fprintf(stderr, " -m  heating time of the switch on command, default 60\n");
+  fprintf(stderr, " -o  switch off after the given time instead\n");
+  fprintf(stderr, " -t  give up after the given simulated time, default 14400 or end of trace\n");
+  fprintf(stderr, " -x  run at factor times real time instead of as fast as possible\n");
+  fprintf(stderr, " -v  firmware debug output\n");
+  fprintf(stderr, " -d  check actuator ramps against act_step*time and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+  err_info_t errors[WBUS_SERVER_MAX_ERR];
+  heater_status_t last = HT_OFF;
+  unsigned long long ms, plantMs = 0, refreshMs = HTLOOP_REFRESH, printMs = 0;
+  unsigned long offMs = 0, limitMs = 0;
+  long periodMs = -1;
+  unsigned int due = 0;
+  int minutes = 60, started = 0, nerr = 0, ramps = 0, c, i;
+  const char *traceName = NULL;
+  char line[TRACE_LINE];
+  double factor = 0, t0;
+  struct timespec ts;
+
+  while ((c = getopt(argc, argv, "r:c:g:p:m:o:t:x:vd")) != -1) {
+    switch (c) {
+      case 'r': traceName = optarg; break;
+      case 'c':
+        if (trace_map(optarg) != 0) {
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'g':
+        golden = fopen(optarg, "r");
+        if (golden == NULL) {
+          perror(optarg);
+          return -1;
+        }
+        break;
+      case 'p': periodMs = atof(optarg)*1000; break;
+      case 'm': minutes = atoi(optarg); break;
+      case 'o': offMs = atol(optarg)*1000UL; break;
+      case 't': limitMs = atol(optarg)*1000UL; break;
+      case 'x': factor = atof(optarg); break;
+      case 'v': verbose = 1; break;
+      case 'd': ramps = 1; break;
+      default: usage(argv[0]); return -1;
+    }
+  }
+  if (minutes < 1 || minutes > 255) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  htsim_model_init(&model);
+  if (traceName != NULL) {
+    if (trace_open(traceName) != 0) {
+      return -1;
+    }
+    if (periodMs < 0) {
+      periodMs = 10000;
+    }
+  } else if (limitMs == 0) {
+    limitMs = 14400000UL;
+  }
+  poeli_calc_init();
+  wbus_server_init(&server, &heater_state, 0);
+  if (ramps) {
+    return (htloop_ramp_check() == 0) ? 0 : 1;
+  }
+#if LOG_BLOCKS > 0
+  wbus_server_log_init(&server, &heater_log, heater_log_buf, LOG_BLOCKS);
+#endif
+  memcpy(errors, server.errors, sizeof(errors));
+  heater_state.volatile_data.status = HT_OFF;
+  heater_state.volatile_data.status_sched = HT_NONE;
+  gfActive = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  t0 = ts.tv_sec + ts.tv_nsec*1e-9;
+
+  htloop_cmd(WBUS_CMD_ON_PH, minutes);
+  htloop_print(0);
+
+  for (simJiffies = 0; ; simJiffies++) {
+    ms = (unsigned long long)simJiffies*1000/JFREQ;
+
+    /* Client side: keep the command alive until switched off */
+    if (offMs != 0 && ms >= offMs) {
+      htloop_cmd(WBUS_CMD_OFF, 0);
+      offMs = 0;
+      refreshMs = ~0ULL;
+    }
+    if (ms >= refreshMs) {
+      htloop_cmd(WBUS_CMD_CHK, WBUS_CMD_ON_PH);
+      refreshMs += HTLOOP_REFRESH;
+    }
+
+    /* Plant, then the ADC completion wakes up the sensor task */
+    if (ms >= plantMs) {
+      /* Recorded sensors are only as new as their last sample */
+      if (traceName == NULL) {
+        htsim_model_step(&model, plant);
+        sensorRef = actSeq;
+      } else if (trace_read(ms) > 0) {
+        sensorRef = actSeq;
+      }
+      poeli_sensors_update();
+      plantMs += HTSIM_PERIOD;
+    }
+
+    poeli_heater_poll(&due);
+
+    if (heater_state.volatile_data.status != last) {
+      last = heater_state.volatile_data.status;
+      htloop_print(ms/1000.0);
+      if (last != HT_OFF) {
+        started = 1;
+      }
+    } else if (periodMs > 0 && ms >= printMs + periodMs) {
+      htloop_print(ms/1000.0);
+      printMs = ms;
+    }
+    if ((started && last == HT_OFF) || last == HT_LOCKED
+     || (limitMs != 0 && ms >= limitMs) || (trace.eof && ms >= trace.ms)) {
+      break;
+    }
+
+    /* Pace to a multiple of real time */
+    if (factor > 0 && (simJiffies % HEATER_PERIOD) == 0) {
+      double ahead;
+
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ahead = ms/1000.0/factor - (ts.tv_sec + ts.tv_nsec*1e-9 - t0);
+      if (ahead > 0) {
+        ts.tv_sec = (time_t)ahead;
+        ts.tv_nsec = (long)((ahead - ts.tv_sec)*1e9);
+        nanosleep(&ts, NULL);
+      }
+    }
+  }
+
+  for (i=0; i<WBUS_SERVER_MAX_ERR; i++) {
+    if (memcmp(&server.errors[i], &errors[i], sizeof(err_info_t)) != 0) {
+      sprintf(line, "error 0x%02x count %d\n", server.errors[i].code, server.errors[i].counter);
+      htloop_out(line);
+      nerr++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  fprintf(stderr, "%.0f s simulated in %.3f s\n", ms/1000.0, ts.tv_sec + ts.tv_nsec*1e-9 - t0);
+
+  if (golden != NULL) {
+    if (htloop_golden_end() != 0) {
+      printf("%lu of %lu lines differ from golden file\n", goldenDiff, goldenLine);
+      return 1;
+    }
+    return 0;
+  }
+  if (last != HT_OFF || nerr != 0) {
+    return 1;
+  }
+  return 0;
+}
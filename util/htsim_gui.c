@@ -10,13 +10,28 @@
 #include <glib.h>
 #include <glib/gprintf.h>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include "htsim_shm.h"
+
 #include <sys/time.h>
 
 
-static int shmid;
-static heater_state_t *hs;
+static htsim_shm_t *sim;
+static unsigned short sensor[HTSIM_NCHAN];
+
+/* Publish manually set sensor values as being current for latest actuators. */
+static
+void publishSensor (void)
+{
+  htsim_block_write(&sim->sensor, 0, sensor, SENSOR_HE, sim->act.seq);
+  htsim_sensor_ring(sim);
+}
+
+static
+void setSensor (int i, GtkRange *range)
+{
+  sensor[i] = (gint)gtk_range_get_value(range);
+  publishSensor();
+}
 
 G_MODULE_EXPORT void
 on_window1_delete_event(GtkWidget *widget,
@@ -29,52 +44,52 @@ on_window1_delete_event(GtkWidget *widget,
 G_MODULE_EXPORT void
 on_hscrollbar1_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[0] = (gint)gtk_range_get_value(range);
+  setSensor(0, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar2_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[1] = (gint)gtk_range_get_value(range);
+  setSensor(1, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar3_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[2] = (gint)gtk_range_get_value(range);
+  setSensor(2, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar4_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[3] = (gint)gtk_range_get_value(range);
+  setSensor(3, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar5_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[4] = (gint)gtk_range_get_value(range);
+  setSensor(4, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar6_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[5] = (gint)gtk_range_get_value(range);
+  setSensor(5, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar7_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[6] = (gint)gtk_range_get_value(range);
+  setSensor(6, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar8_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[7] = (gint)gtk_range_get_value(range);
+  setSensor(7, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar9_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[8] = (gint)gtk_range_get_value(range);
+  setSensor(8, range);
 }
 G_MODULE_EXPORT void
 on_hscrollbar10_value_changed(GtkRange *range, gpointer  user_data)
 {
-  hs->volatile_data.sensor[9] = (gint)gtk_range_get_value(range);
+  setSensor(9, range);
 }
 
 
@@ -85,13 +100,16 @@ gboolean cbUpdateAct (gpointer data)
   GtkLabel *label;
   gint i;
   gchar lname[64], val[16];
+  unsigned short act[HTSIM_NCHAN];
 
+  htsim_block_read(&sim->act, act, NULL, NULL);
   for (i=1; i<=NUM_ACT; i++) {
     g_sprintf(lname, "label%d", i);
     label = GTK_LABEL(glade_xml_get_widget(xml, lname));
-    g_sprintf(val, "%d", hs->volatile_data.act[i-1]);
+    g_sprintf(val, "%d", act[i-1]);
     gtk_label_set_text(label, val);
   }
+  publishSensor();
 
   return TRUE;
 }
@@ -103,10 +121,11 @@ void updateSensor (GladeXML *xml)
   gint i;
   gchar lname[64];
 
+  htsim_block_read(&sim->sensor, sensor, NULL, NULL);
   for (i=1; i<=NUM_SENSOR; i++) {
     g_sprintf(lname, "hscrollbar%d", i);
     range = GTK_RANGE(glade_xml_get_widget(xml, lname));
-    gtk_range_set_value(range, (gdouble)hs->volatile_data.sensor[i]);
+    gtk_range_set_value(range, (gdouble)sensor[i-1]);
   }
 }
 
@@ -125,14 +144,9 @@ main(int argc, char **argv)
 
     glade_xml_signal_autoconnect(xml);
 
-    shmid = shmget(0xb0E1, 4096, 0666 | IPC_CREAT);
-    if (shmid == -1) {
-      g_message("shmget() failed");
-      return -1;
-    }
-    hs = shmat(shmid, (void *)0, 0);
-    if ((int)hs == -1) {
-      g_message("shmat() failed");
+    sim = htsim_shm_attach();
+    if (sim == NULL) {
+      g_message("htsim_shm_attach() failed");
       return -1;
     }
 
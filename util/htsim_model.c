@@ -0,0 +1,143 @@
+/*
+ * Heater plant models.
+ *
+ * License: BSD
+ */
+
+#include "wbus_server.h"
+#include "machine.h"
+#include "htsim_model.h"
+
+static
+unsigned short model_t0(htsim_model_t *m, unsigned short d[2][16])
+{
+  static const float K1 = 0.01;
+
+  /* heat exchanger temperature */
+  if (d[1][SENSOR_HE] > 4000) {
+    m->t0 = m->t0 + K1*(110.0-m->t0)*(((float)(ACTMAX+1)-(float)d[0][ACT_CP])/(float)ACTMAX);
+  } else {
+    m->t0 = m->t0 + K1*(20.0-m->t0)*(((float)(ACTMAX+1)-(float)d[0][ACT_CP])/(float)ACTMAX);
+  }
+
+  return (int)m->t0+50;
+}
+
+static
+unsigned short model_t1(htsim_model_t *m, unsigned short d[2][16])
+{
+  static const float K1 = 0.002, K2 = 0.001;
+
+  /* heat exchanger temperature */
+  if (d[0][ACT_GKPH]) {
+    m->t1 = m->t1 + K1*(140.0-m->t1);
+  } else {
+    m->t1 = m->t1 + K2*(20.0-m->t1)*(((float)(ACTMAX+1)-(float)d[0][ACT_DP])/(float)ACTMAX);
+  }
+
+  return (int)m->t1+50;
+}
+
+static
+unsigned short model_gkph(htsim_model_t *m, unsigned short d[2][16])
+{
+  unsigned short out = 0;
+  static const float K1 = 0.01;
+
+  if (d[0][ACT_GKPH] > 0) {
+    m->gkph = m->gkph + (150.0-m->gkph)*K1;
+    out = (unsigned short)m->gkph;
+  } else {
+    m->gkph = 600.0;
+  }
+
+  return out;
+}
+
+static
+unsigned short model_gkz(htsim_model_t *m, unsigned short d[2][16])
+{
+  unsigned short out = 0;
+  static const float K1 = 0.02;
+
+  if (d[0][ACT_GKZ] > 0) {
+    m->gkz = m->gkz + (150.0-m->gkz)*K1;
+    out = (unsigned short)m->gkz;
+  } else {
+    m->gkz = 600.0;
+  }
+
+  return out;
+}
+
+static
+unsigned short model_p(htsim_model_t *m, unsigned short d[2][16])
+{
+  unsigned short out;
+
+  /* ACT is same domain as sensor value. */
+  out = d[0][ACT_CC];
+
+  return out;
+}
+
+#if 0
+static
+unsigned short model_emf_cf(htsim_model_t *m, unsigned short d[2][16])
+{
+  unsigned short out;
+
+  /* ACT is same domain as sensor value. */
+  out = d[0][ACT_CF];
+
+  return out;
+}
+#endif
+
+static
+unsigned short model_gpr(htsim_model_t *m, unsigned short d[2][16])
+{
+  int flame = 0;
+  static const float C1 = 0.0035, C2 = 0.002; /* time constants for raise and decay */
+  float stimulus = 0.0;
+
+  /* assuming succesful ingition */
+  if (d[0][ACT_DP]) {
+    flame = 1;
+  }
+
+  if (d[0][ACT_GKZ] > 0 || flame) {
+    stimulus = (float)flame + (float)d[0][ACT_GKZ]/(float)ACTMAX;
+    if (stimulus > 1.0) {
+      stimulus = 1.0;
+    }
+  }
+
+  /* cheap and dirty Seebeck voltage model */
+  m->gpr = m->gpr + C1*stimulus*(3000-m->gpr) + C2*(1.0-stimulus)*(0-m->gpr);
+
+  /* amplified and conditioned Seebeck voltage in mV (scaled ADC input) */
+  return (unsigned short)m->gpr;
+}
+
+void htsim_model_init(htsim_model_t *m)
+{
+  m->t0 = 20;
+  m->t1 = 20;
+  m->gkph = 600.0;
+  m->gkz = 600.0;
+  m->gpr = 0.0;
+}
+
+void htsim_model_step(htsim_model_t *m, unsigned short d[2][16])
+{
+  d[1][SENSOR_T0] = model_t0(m, d);
+  d[1][SENSOR_T1] = model_t1(m, d);
+  d[1][SENSOR_GKPH] = model_gkph(m, d);
+  d[1][SENSOR_GKZ] = model_gkz(m, d);
+  d[1][SENSOR_P] = model_p(m, d);
+  /* d[1][SENSOR_UNUSED0] = model_emf_cf(m, d); */
+  d[1][SENSOR_VCC] = 13800;
+  d[1][SENSOR_CAF] = d[0][ACT_CF];
+  d[1][SENSOR_GPR] = model_gpr(m, d);
+}
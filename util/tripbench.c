@@ -0,0 +1,149 @@
+/*
+ * Cost per heater tick of the sensor trip check of poeli_heater_check():
+ * the full scan of all NUM_SENSOR channels it used to do, against
+ * wbus_server_sensor_check() as built for this host.
+ * Sensors are held inside the trip values, as in normal operation.
+ *
+ * There is no MSP430 to measure on here, where the check walks the
+ * seq_trip[] mask. The cycle estimate counts the channels and mask bits
+ * each variant touches, weighted with costs from the MSP430 instruction
+ * timing, see MSP_* below.
+ *
+ * License: BSD
+ */
+
+#include "wbus_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* MSP430 cycles, from the format I/II instruction timing of the family guide:
+   per checked channel load and two compares with jumps (3+3+2+4+2); per
+   fault counter test (4+2); per mask bit up to the highest set one the test,
+   shift and loop jump; per full scan loop pass the index and pointer
+   updates, compare and jump. The masked check only tests the fault counters
+   of tripped or faulty sensors, none while all are in range. */
+#define MSP_COMPARE 14
+#define MSP_FAULT 6
+#define MSP_BIT 6
+#define MSP_LOOP 7
+
+#define BENCH_RUNS 5
+
+static int n = 1000000;
+static volatile unsigned long sink;
+
+static
+double bench_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* The check loop of poeli_heater_check() before seq_trip[], frozen here
+   for comparison */
+static __attribute__ ((noinline))
+int bench_full(heater_state_t *h)
+{
+  const heater_seq_t *seq = &seq_bank->heater_seq[h->volatile_data.status].seq;
+  unsigned short *s = h->volatile_data.sensor;
+  unsigned char *f = h->volatile_data.faults;
+  int i, trips = 0;
+
+  for (i=0; i<NUM_SENSOR; i++) {
+    if (s[i] < seq->sensor_min[i] || s[i] > seq->sensor_max[i]) {
+      f[i]++;
+      trips++;
+    } else if (f[i] > 0) {
+      f[i]--;
+    }
+  }
+  return trips;
+}
+
+static
+int bench_bits(unsigned short mask, int *top)
+{
+  int bits = 0;
+
+  *top = 0;
+  for (; mask != 0; mask >>= 1) {
+    bits += mask & 1;
+    (*top)++;
+  }
+  return bits;
+}
+
+int main(int argc, char **argv)
+{
+  wbus_server_t srv;
+  heater_state_t state;
+  unsigned short *s = state.volatile_data.sensor;
+  unsigned char *f = state.volatile_data.faults;
+  const heater_seq_t *seq;
+  double t0, tFull, tCheck, sFull = 0, sCheck = 0;
+  unsigned long cFull, cMask, scFull = 0, scMask = 0;
+  int st, r, i, bits, top;
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    n = atoi(argv[2]);
+  }
+  if (n <= 0) {
+    fprintf(stderr, "usage: %s [-n ticks]\n", argv[0]);
+    return -1;
+  }
+
+  /* Computes seq_trip[] of the compiled in data sets */
+  wbus_server_init(&srv, &state, 0);
+
+  printf("%d ticks per state, best of %d\n", n, BENCH_RUNS);
+  printf("%-6s %4s %9s %9s %9s %9s\n", "state", "trip", "ns full", "ns check", "msp full", "msp mask");
+  for (st=0; st<HT_LAST; st++) {
+    state.volatile_data.status = st;
+    seq = &seq_bank->heater_seq[st].seq;
+    for (i=0; i<NUM_SENSOR; i++) {
+      s[i] = ((unsigned long)seq->sensor_min[i] + seq->sensor_max[i])/2;
+    }
+    memset(f, 0, NUM_SENSOR);
+
+    /* Best of a few alternating runs, so noise hits both alike */
+    tFull = tCheck = 1e9;
+    for (r=0; r<BENCH_RUNS; r++) {
+      t0 = bench_now();
+      for (i=0; i<n; i++) {
+        sink += bench_full(&state);
+      }
+      t0 = bench_now() - t0;
+      if (t0 < tFull) {
+        tFull = t0;
+      }
+
+      t0 = bench_now();
+      for (i=0; i<n; i++) {
+        sink += wbus_server_sensor_check(&srv, 0xffff);
+      }
+      t0 = bench_now() - t0;
+      if (t0 < tCheck) {
+        tCheck = t0;
+      }
+    }
+
+    bits = bench_bits(seq_trip[st], &top);
+    cFull = NUM_SENSOR*(MSP_COMPARE + MSP_FAULT + MSP_LOOP);
+    cMask = top*MSP_BIT + bits*MSP_COMPARE;
+
+    printf("%-6d %4d %9.2f %9.2f %9lu %9lu\n", st, bits,
+           tFull*1e9/n, tCheck*1e9/n, cFull, cMask);
+    sFull += tFull; sCheck += tCheck;
+    scFull += cFull; scMask += cMask;
+  }
+  printf("%-6s %4s %9.2f %9.2f %9lu %9lu\n", "mean", "",
+         sFull*1e9/n/HT_LAST, sCheck*1e9/n/HT_LAST,
+         scFull/HT_LAST, scMask/HT_LAST);
+
+  return 0;
+}
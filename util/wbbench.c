@@ -0,0 +1,121 @@
+/*
+ * Time per W-Bus request through wbus_server_process(), that is the
+ * cmd_handler[] dispatch and the command handler, for the requests a
+ * W-Bus client sends most. The request copy is timed separately and
+ * subtracted.
+ *
+ * License: BSD
+ */
+
+#include "wbus_server.h"
+#include "../wbus/wbus_const.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  const char *name;
+  unsigned char cmd;
+  int len;
+  unsigned char data[8];
+} bench_frame_t;
+
+static const bench_frame_t frame[] = {
+  { "query status0",     WBUS_CMD_QUERY,  1, { QUERY_STATUS0 } },
+  { "query sensors",     WBUS_CMD_QUERY,  1, { QUERY_SENSORS } },
+  { "query state",       WBUS_CMD_QUERY,  1, { QUERY_STATE } },
+  { "query durations0",  WBUS_CMD_QUERY,  1, { QUERY_DURATIONS0 } },
+  { "mquery 3 pages",    WBUS_CMD_MQUERY, 4, { 0, 0, 0, 0xa4 } },
+  { "mquery 3 delta",    WBUS_CMD_MQUERY, 7, { 0, 0, 0, 0xa4, MQUERY_LEN_MAX, 0, 0 } },
+  { "ident device name", WBUS_CMD_IDENT,  1, { IDENT_DEV_NAME } },
+  { "ident serial",      WBUS_CMD_IDENT,  1, { IDENT_SERIAL } },
+  { "check",             WBUS_CMD_CHK,    2, { WBUS_CMD_ON_PH, 0 } },
+  { "error list",        WBUS_CMD_ERR,    1, { ERR_LIST } },
+  { "data set read",     WBUS_CMD_DATASET, 2, { DATASET_READ, HT_GLOW } },
+  { "telemetry",         WBUS_CMD_DIAG,   1, { DIAG_TELEMETRY } },
+};
+
+static int n = 1000000;
+static volatile unsigned long sink;
+
+static
+double bench_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Time of n request copies, as done before every call below */
+static
+double bench_copy(const bench_frame_t *f, unsigned char *data)
+{
+  double t0;
+  int i, len;
+
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    memcpy(data, f->data, sizeof(f->data));
+    len = f->len;
+    sink += len + data[0];
+  }
+  return bench_now() - t0;
+}
+
+static
+void bench_frame(wbus_server_t *srv, const bench_frame_t *f, double tCopy)
+{
+  unsigned char data[256];
+  double t0, t;
+  int i, len = 0, err = 0;
+
+  t0 = bench_now();
+  for (i=0; i<n; i++) {
+    memcpy(data, f->data, sizeof(f->data));
+    len = f->len;
+    err = wbus_server_process(srv, f->cmd, data, &len);
+    sink += len + data[0];
+  }
+  t = bench_now() - t0 - tCopy;
+
+  printf("%-20s 0x%02x %8.1f %6d%s\n", f->name, f->cmd, t*1e9/n, len, err ? " error" : "");
+}
+
+int main(int argc, char **argv)
+{
+  wbus_server_t srv;
+  heater_state_t state;
+  unsigned char data[256];
+  double tCopy;
+  int i;
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    n = atoi(argv[2]);
+  }
+  if (n <= 0) {
+    fprintf(stderr, "usage: %s [-n requests]\n", argv[0]);
+    return -1;
+  }
+
+  /* A heater in flame operation, like wbfarm sets them up */
+  wbus_server_init(&srv, &state, 0);
+  state.volatile_data.status = HT_BURN_H;
+  state.volatile_data.status_sched = HT_NONE;
+  state.volatile_data.sensor[SENSOR_T0] = 60+50;
+  state.volatile_data.sensor[SENSOR_T1] = 40+50;
+  state.volatile_data.sensor[SENSOR_VCC] = 12600;
+  wbus_server_snapshot(&srv);
+
+  tCopy = bench_copy(&frame[0], data);
+
+  printf("%d requests each, %.1f ns request copy subtracted\n", n, tCopy*1e9/n);
+  printf("%-20s %4s %8s %6s\n", "request", "cmd", "ns", "reply");
+  for (i=0; i<sizeof(frame)/sizeof(frame[0]); i++) {
+    bench_frame(&srv, &frame[i], tCopy);
+  }
+
+  return 0;
+}
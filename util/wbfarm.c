@@ -0,0 +1,208 @@
+/*
+ * Serve many simulated heaters from one process, e.g. to load test W-Bus
+ * gateways. Each heater is a wbus_server instance bound to its own pseudo
+ * terminal. The K-Line echo is emulated, so W-Bus clients using this
+ * library work unmodified on the slave devices.
+ *
+ * There is no control loop. A heater simply enters the state scheduled by
+ * the last command. All heaters share the compiled in data sets (read only).
+ *
+ * License: BSD
+ */
+
+#define _GNU_SOURCE
+#include "wbus_server.h"
+#include "../wbus/wbus_const.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* addr, len, cmd, up to 254 data bytes, checksum */
+#define FRAME_MAX (2+255)
+
+typedef struct {
+  wbus_server_t srv;
+  heater_state_t state;
+  int fd;                    /* pty master */
+  int slave;                 /* kept open, so the master does not hang up */
+  unsigned short rxlen;
+  unsigned char rx[FRAME_MAX];
+} farm_heater_t;
+
+static farm_heater_t *heater;
+static int nHeater = 16;
+static unsigned long nFrames, nBad;
+
+static
+int farm_open(farm_heater_t *h, int i)
+{
+  struct termios tio;
+  char *name;
+
+  h->fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (h->fd == -1 || grantpt(h->fd) != 0 || unlockpt(h->fd) != 0) {
+    perror("posix_openpt()");
+    return -1;
+  }
+  name = ptsname(h->fd);
+  h->slave = open(name, O_RDWR | O_NOCTTY);
+  if (h->slave == -1) {
+    perror(name);
+    return -1;
+  }
+  tcgetattr(h->slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(h->slave, TCSANOW, &tio);
+
+  wbus_server_init(&h->srv, &h->state, 0);
+  h->state.volatile_data.status = HT_OFF;
+  h->state.volatile_data.status_sched = HT_NONE;
+  h->state.volatile_data.sensor[SENSOR_T0] = 20+50;
+  h->state.volatile_data.sensor[SENSOR_T1] = 20+50;
+  h->state.volatile_data.sensor[SENSOR_VCC] = 12600;
+  wbus_server_snapshot(&h->srv);
+  /* Tell heaters apart by serial number */
+  h->srv.serial[5] = i>>8;
+  h->srv.serial[6] = i;
+
+  printf("heater %d: %s\n", i, name);
+
+  return 0;
+}
+
+static
+void farm_frame(farm_heater_t *h)
+{
+  unsigned char *f = h->rx;
+  unsigned char chk = 0, cmd;
+  int i, len;
+
+  for (i=0; i<h->rxlen; i++) {
+    chk ^= f[i];
+  }
+  nFrames++;
+  if (chk != 0) {
+    nBad++;
+    return;
+  }
+
+  cmd = f[2];
+  len = f[1]-2;
+  memcpy(wbdata, f+3, len);
+  wbus_server_process(&h->srv, cmd, wbdata, &len);
+
+  /* Nobody runs the heater sequence, just assimilate scheduled states */
+  if (h->state.volatile_data.status_sched != HT_NONE) {
+    h->state.volatile_data.status = (h->state.volatile_data.status_sched == HT_STOP) ? HT_OFF : h->state.volatile_data.status_sched;
+    h->state.volatile_data.status_sched = HT_NONE;
+  }
+
+  f[0] = (WBUS_HADDR<<4) | (f[0]>>4);
+  f[1] = len+2;
+  f[2] = cmd | 0x80;
+  memcpy(f+3, wbdata, len);
+  chk = 0;
+  for (i=0; i<len+3; i++) {
+    chk ^= f[i];
+  }
+  f[len+3] = chk;
+  if (write(h->fd, f, len+4) != len+4) {
+    perror("write()");
+  }
+}
+
+static
+void farm_receive(farm_heater_t *h)
+{
+  unsigned char buf[64];
+  int n, i;
+
+  n = read(h->fd, buf, sizeof(buf));
+  if (n <= 0) {
+    return;
+  }
+  /* K-Line echo */
+  if (write(h->fd, buf, n) != n) {
+    perror("write()");
+  }
+
+  for (i=0; i<n; i++) {
+    /* Wait for a frame addressed to a heater */
+    if (h->rxlen == 0 && (buf[i] & 0x0f) != WBUS_HADDR) {
+      continue;
+    }
+    h->rx[h->rxlen++] = buf[i];
+    if (h->rxlen >= 2 && h->rx[1] < 2) {
+      /* Implausible length, resynchronize */
+      h->rxlen = 0;
+      continue;
+    }
+    if (h->rxlen >= 2 && h->rxlen == h->rx[1]+2) {
+      farm_frame(h);
+      h->rxlen = 0;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct pollfd *pfd;
+  struct rlimit rl;
+  int i, n;
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    nHeater = atoi(argv[2]);
+  }
+  if (nHeater <= 0) {
+    fprintf(stderr, "usage: %s [-n heaters]\n", argv[0]);
+    return -1;
+  }
+
+  /* Two file descriptors per heater */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  heater = calloc(nHeater, sizeof(farm_heater_t));
+  pfd = calloc(nHeater, sizeof(struct pollfd));
+  if (heater == NULL || pfd == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  for (i=0; i<nHeater; i++) {
+    if (farm_open(&heater[i], i) != 0) {
+      return -1;
+    }
+    pfd[i].fd = heater[i].fd;
+    pfd[i].events = POLLIN;
+  }
+  printf("%d heaters, %d bytes each\n", nHeater, (int)sizeof(farm_heater_t));
+  fflush(stdout);
+
+  while (1) {
+    n = poll(pfd, nHeater, 10000);
+    if (n < 0) {
+      perror("poll()");
+      break;
+    }
+    if (n == 0) {
+      printf("%lu frames, %lu bad\n", nFrames, nBad);
+      fflush(stdout);
+      continue;
+    }
+    for (i=0; i<nHeater; i++) {
+      if (pfd[i].revents & POLLIN) {
+        farm_receive(&heater[i]);
+      }
+    }
+  }
+
+  return 0;
+}
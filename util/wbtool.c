@@ -1,8 +1,10 @@
 #include "wbus.h"
 #include "machine.h"
+#include "../wbus/wbus_const.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 typedef enum {
 	CMD_HELP = 1,
@@ -18,9 +20,191 @@ typedef enum {
 	CMD_MONITOR,
 	CMD_MONITOR_SINGLE,
 	CMD_EEPROM_RD,
-	CMD_EEPROM_WR
+	CMD_EEPROM_WR,
+	CMD_TELEMETRY,
+	CMD_LOG
 } wbtool_cmd; 
 
+#define BE16(p) (((p)[0]<<8) | (p)[1])
+#define BE32(p) (((unsigned long)(p)[0]<<24) | ((unsigned long)(p)[1]<<16) | ((unsigned long)(p)[2]<<8) | (p)[3])
+
+/* Print firmware telemetry, see DIAG_TELEMETRY. Sensor update rate over tim seconds. */
+static int wbtool_telemetry(HANDLE_WBUS wbus, int tim)
+{
+	unsigned char d[256];
+	unsigned long jfreq, pfreq, snap0;
+	int err, len, i, n;
+
+	/* The rate needs at least one second between the two snapshots */
+	if (tim < 1) {
+		tim = 1;
+	}
+
+	d[0] = DIAG_TELEMETRY; len = 1;
+	err = wbus_io(wbus, WBUS_CMD_DIAG, d, NULL, 0, d, &len, 0);
+	if (err || len < 20 || d[0] != DIAG_TELEMETRY) {
+		printf("Device has no telemetry\n");
+		return -1;
+	}
+	snap0 = BE32(&d[13]);
+	sleep(tim);
+	d[0] = DIAG_TELEMETRY; len = 1;
+	err = wbus_io(wbus, WBUS_CMD_DIAG, d, NULL, 0, d, &len, 0);
+	if (err || len < 20 || len < 20+2*d[19]) {
+		return -1;
+	}
+
+	jfreq = BE32(&d[1]);
+	printf("W-Bus: %d truncated frames, %d checksum errors, %d answers, max latency %lu ms\n",
+	       BE16(&d[5]), BE16(&d[7]), BE16(&d[9]), (BE16(&d[11])*1000UL)/jfreq);
+	printf("Sensor updates: %lu (%.1f per second)\n", BE32(&d[13]), (float)(BE32(&d[13])-snap0)/tim);
+	printf("Missed deadlines: %d\n", BE16(&d[17]));
+	for (i=0, n=20; i<d[19]; i++, n+=2) {
+		if (BE16(&d[n]) != 0) {
+			printf("Sensor faults in state %d: %d\n", i, BE16(&d[n]));
+		}
+	}
+	for (; n+3 <= len; n+=3) {
+		if (d[n] == 0) {
+			printf("Unknown commands: %d frames\n", BE16(&d[n+1]));
+		} else {
+			printf("Command 0x%02x: %d frames\n", d[n], BE16(&d[n+1]));
+		}
+	}
+
+	/* Scheduler statistics, if the firmware was built with KERNEL_PROFILE */
+	d[0] = DIAG_SCHED_CLOCK; len = 1;
+	err = wbus_io(wbus, WBUS_CMD_DIAG, d, NULL, 0, d, &len, 0);
+	if (err || len < 6 || d[0] != DIAG_SCHED_CLOCK) {
+		return 0;
+	}
+	n = d[1];
+	pfreq = BE32(&d[2]);
+	for (i=0; i<n; i++) {
+		d[0] = DIAG_SCHED; d[1] = i; len = 2;
+		err = wbus_io(wbus, WBUS_CMD_DIAG, d, NULL, 0, d, &len, 0);
+		if (err || len < 26) {
+			break;
+		}
+		printf("Task %d: %lu dispatches, %lu ms run time, max slice %lu us, max latency %lu us, stack %d/%d\n", i,
+		       BE32(&d[2]), (unsigned long)(BE32(&d[6])*1000.0/pfreq), (unsigned long)(BE32(&d[10])*1000000.0/pfreq),
+		       (unsigned long)(BE32(&d[18])*1000000.0/pfreq), BE16(&d[22]), BE16(&d[24]));
+	}
+
+	return 0;
+}
+
+static unsigned long wbtool_varint(const unsigned char *p, int *i)
+{
+	unsigned long v = 0;
+	int s = 0;
+
+	do {
+		v |= (unsigned long)(p[*i] & 0x7f) << s;
+		s += 7;
+	} while (p[(*i)++] & 0x80);
+
+	return v;
+}
+
+/* Download the heater state log, see WBUS_CMD_LOG, and print one line per record:
+   time in seconds, heater status, sensors, actuators. */
+static int wbtool_log(HANDLE_WBUS wbus)
+{
+	unsigned char d[256], blk[256+LOG_CHUNK];
+	unsigned short val[64];
+	unsigned long first, last, b, rec, jfreq, pfreq, mask, z;
+	int err, len, fill, bsize, size, period, nsen, nch, frozen, i, n, c, h;
+
+	d[0] = LOG_INFO; len = 1;
+	err = wbus_io(wbus, WBUS_CMD_LOG, d, NULL, 0, d, &len, 0);
+	if (err || len < 30 || d[0] != LOG_INFO) {
+		printf("Device has no log\n");
+		return -1;
+	}
+	/* Keep the log still while downloading */
+	frozen = d[13] & LOG_FROZEN;
+	if (!frozen) {
+		d[0] = LOG_FREEZE; d[1] = 1; len = 2;
+		wbus_io(wbus, WBUS_CMD_LOG, d, NULL, 0, d, &len, 0);
+		d[0] = LOG_INFO; len = 1;
+		err = wbus_io(wbus, WBUS_CMD_LOG, d, NULL, 0, d, &len, 0);
+		if (err || len < 30) {
+			return -1;
+		}
+	}
+	first = BE32(&d[1]);
+	last = BE32(&d[5]);
+	fill = BE16(&d[9]);
+	bsize = BE16(&d[11]);
+	period = BE16(&d[14]);
+	jfreq = BE32(&d[16]);
+	pfreq = BE32(&d[24]);
+	nsen = d[28];
+	nch = nsen + d[29] + 1;
+	if (bsize > 256 || nch > 64 || jfreq == 0 || pfreq == 0) {
+		return -1;
+	}
+	printf("# %lu blocks, longest record %lu us%s\n", fill ? last-first+1 : 0,
+	       (unsigned long)(BE32(&d[20])*1000000.0/pfreq), (d[13] & LOG_FAULT) ? ", stopped by error" : "");
+	printf("# time status sensor[0..%d] act[0..%d]\n", nsen-1, nch-nsen-2);
+
+	for (b=first; fill != 0 && b-first <= last-first; b++) {
+		size = (b == last) ? fill : bsize;
+		memset(blk, 0, sizeof(blk));
+		for (i=0; i<size; i+=n) {
+			d[0] = LOG_READ;
+			d[1] = b>>24; d[2] = b>>16; d[3] = b>>8; d[4] = b;
+			d[5] = i; len = 6;
+			err = wbus_io(wbus, WBUS_CMD_LOG, d, NULL, 0, d, &len, 0);
+			n = len-6;
+			if (err || n <= 0) {
+				break;
+			}
+			memcpy(&blk[i], &d[6], n);
+		}
+		if (i < size) {
+			printf("# block %lu incomplete\n", b);
+			continue;
+		}
+
+		rec = blk[0] | (blk[1]<<8) | ((unsigned long)blk[2]<<16) | ((unsigned long)blk[3]<<24);
+		memset(val, 0, sizeof(val));
+		for (i=4; i<size && blk[i] != 0; ) {
+			h = blk[i++];
+			if (h < 0x80) {
+				n = h;
+			} else {
+				n = 1;
+				mask = h & 0x3f;
+				if (h & 0x40) {
+					mask |= wbtool_varint(blk, &i) << 6;
+				}
+				for (c=0; mask != 0; c++, mask >>= 1) {
+					if (mask & 1) {
+						z = wbtool_varint(blk, &i);
+						val[c] += (z & 1) ? -(long)((z+1)>>1) : (long)(z>>1);
+					}
+				}
+			}
+			for (; n > 0; n--, rec++) {
+				printf("%.3f %d", (double)rec*period/jfreq, val[nch-1]);
+				for (c=0; c<nch-1; c++) {
+					printf(" %d", val[c]);
+				}
+				printf("\n");
+			}
+		}
+	}
+
+	if (!frozen) {
+		d[0] = LOG_FREEZE; d[1] = 0; len = 2;
+		wbus_io(wbus, WBUS_CMD_LOG, d, NULL, 0, d, &len, 0);
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	HANDLE_WBUS wbus;
@@ -34,7 +218,7 @@ int main(int argc, char **argv)
 	char text[1024];
 	unsigned char eeprom_data_wr[2];
 	
-	while ((opt = getopt(argc, argv, "ideEsPSVmcD:t:T:v:g:W:")) != -1)
+	while ((opt = getopt(argc, argv, "ideEsPSVmcHLD:t:T:v:g:W:")) != -1)
 	{
 		switch (opt) {
 		case 'i':
@@ -64,6 +248,12 @@ int main(int argc, char **argv)
 		case 'm':
 			cmd = CMD_MONITOR;
 			break;
+		case 'H':
+			cmd = CMD_TELEMETRY;
+			break;
+		case 'L':
+			cmd = CMD_LOG;
+			break;
 		case 'g':
 			cmd = CMD_MONITOR_SINGLE;
 			sensor =  atoi(optarg);
@@ -110,6 +300,8 @@ int main(int argc, char **argv)
 			" -D serial port device\n"
 			" -m scan sensors\n"
 			" -g <i> read single sensor with index i \n"
+			" -H firmware health telemetry, -T tim sensor rate interval\n"
+			" -L download heater state log\n"
 			" -t n test subsystem n (1..15)\n"
 			"   Known subsystems: CF=1 FP=2(freq) GP=3 CP=4 VF=5 SV=9 FPW=15 (CC=14)\n"
 			"   -T tim Use time tim for the test\n"
@@ -200,15 +392,21 @@ int main(int argc, char **argv)
 		case CMD_MONITOR:
 			{
 			int i;
-			wb_sensor_t s;
-			for (i=0; i<20; i++)
+			wb_sensor_t s[WB_NUM_SENSORS];
+			wbus_sensors_read(wbus, s, (1UL<<WB_NUM_SENSORS)-1);
+			for (i=0; i<WB_NUM_SENSORS; i++)
 			{
-			  wbus_sensor_read(wbus, &s, i);
-			  wbus_sensor_print(text, &s);
+			  wbus_sensor_print(text, &s[i]);
 			  printf("sensor[%d] %s\n", i, text);
 			}
 			}
 			break;
+		case CMD_TELEMETRY:
+			wbtool_telemetry(wbus, tim);
+			break;
+		case CMD_LOG:
+			wbtool_log(wbus);
+			break;
 		case CMD_MONITOR_SINGLE:
 			{
 			wb_sensor_t s;
@@ -243,15 +441,14 @@ int main(int argc, char **argv)
 		  break;
 		} 
 		{
-		  wb_sensor_t s;
-		  wbus_sensor_read(wbus, &s, 3);
-		  wbus_sensor_print(text, &s);
+		  static wb_sensor_cache_t c;
+		  wb_sensor_t *s = c.page;
+		  wbus_sensors_poll(wbus, &c, (1UL<<3) | (1UL<<5) | (1UL<<7));
+		  wbus_sensor_print(text, &s[3]);
 		  printf("%s\n", text);
-		  wbus_sensor_read(wbus, &s, 5);
-		  wbus_sensor_print(text, &s);
+		  wbus_sensor_print(text, &s[5]);
 		  printf("%s\n", text);
-		  wbus_sensor_read(wbus, &s, 7);
-		  wbus_sensor_print(text, &s);
+		  wbus_sensor_print(text, &s[7]);
 		  printf("%s\n", text);
 		}
 		printf(" running...\n");
@@ -19,8 +19,16 @@
 struct WBUS
 {
   HANDLE_RS232 rs232;
+  unsigned char mquery;  /* multi page query support of device, MQUERY_* below */
+  unsigned char rejected; /* last reply acknowledged another command, e.g. 0x7f */
+  unsigned int rx_time;  /* when the last request was received (host) */
+  wb_link_stats_t stats;
 };
 
+#define MQUERY_UNKNOWN 0
+#define MQUERY_YES     1
+#define MQUERY_NO      2
+
 /*
  * \param buf pointer to ACK message part
  * \param len length of data
@@ -133,6 +141,7 @@ static int wbus_msg_recv( HANDLE_WBUS wbus,
   unsigned char chksum;
   int len;
   
+  wbus->rejected = 0;
   /* Read address header */
   do {
     if (rs232_read(wbus->rs232, buf, 1) != 1) {
@@ -162,6 +171,7 @@ static int wbus_msg_recv( HANDLE_WBUS wbus,
       PRINTF("wbus_msg_recv(): No addr/len error\n");
     }
 #endif
+    wbus->stats.rx_len_err++;
     return -1;
   }
 
@@ -173,6 +183,7 @@ static int wbus_msg_recv( HANDLE_WBUS wbus,
     if (buf[2] != (*cmd|0x80)) {
       PRINTF("wbus_msg_recv() Request %x was rejected\n", *cmd);
       /* Message reject happens. Do not be too picky about that. */
+      wbus->rejected = 1;
       *dlen = 0;
       return 0;
     }
@@ -195,6 +206,7 @@ static int wbus_msg_recv( HANDLE_WBUS wbus,
     for (;skip>0; skip--) {
       if (rs232_read(wbus->rs232, buf, 1) != 1) {
         PRINTF("wbus_msg_recv() Read error on data skip\n");
+        wbus->stats.rx_len_err++;
         return -1;
       }
       chksum = checksum(buf, 1, chksum);
@@ -202,6 +214,7 @@ static int wbus_msg_recv( HANDLE_WBUS wbus,
     if (len > 0) {
       if (rs232_read(wbus->rs232, data, len) != len) {
         PRINTF("wbus_msg_recv() Read error. len=%d skip=%d cmd=0x%x buf[1]=0x%x\n", len, skip, *cmd, buf[1]);
+        wbus->stats.rx_len_err++;
         return -1;
       }
       chksum = checksum(data, len, chksum);
@@ -212,14 +225,13 @@ static int wbus_msg_recv( HANDLE_WBUS wbus,
     *dlen = 0;
   }
   
-  /* Read and verify checksum */
-  rs232_read(wbus->rs232, buf, 1);
-  /*
-  if (*buf != chksum) {
+  /* Read and verify checksum. Mismatches are only counted, not rejected. */
+  if (rs232_read(wbus->rs232, buf, 1) != 1) {
+    wbus->stats.rx_len_err++;
+  } else if (*buf != chksum) {
     PRINTF("wbus_msg_recv() Checksum error\n");
-    return -1;
+    wbus->stats.rx_chk_err++;
   }
-  */
   
   return 0;
 }
@@ -303,7 +315,7 @@ int wbus_host_listen( HANDLE_WBUS wbus,
     rs232_blocking(wbus->rs232, 1);
     err = wbus_msg_recv(wbus, addr, cmd, data, len, 0);
   } while (err);
-
+  wbus->rx_time = machine_getJiffies();
     
   return err;
 }
@@ -317,6 +329,15 @@ int wbus_host_answer( HANDLE_WBUS wbus,
                       unsigned char *data,
                       int len)
 {
+  unsigned int lat;
+
+  lat = machine_getJiffies() - wbus->rx_time;
+  wbus->stats.lat = lat;
+  if (lat > wbus->stats.lat_max) {
+    wbus->stats.lat_max = lat;
+  }
+  wbus->stats.tx++;
+
   addr = (WBUS_HADDR<<4) | (addr>>4); 
   //PRINTF("sending %x %x %x %x %x ... \n", addr, len+3, cmd, data[0], data[1] );
   return wbus_msg_send(wbus, addr, cmd|0x80, data, len, NULL, 0);
@@ -452,6 +473,156 @@ int wbus_sensor_read(HANDLE_WBUS wbus, HANDLE_WBSENSOR sensor, int idx)
   return err;
 }
 
+/*
+ * Fetch *pages with multi page queries. If ver is not NULL, the delta form
+ * is used and only pages changed after *ver are fetched. *ver is then
+ * updated to the version of the device, or 0 if it does not know the delta
+ * form. On return *pages holds what is left to be read one by one.
+ */
+static
+int wbus_mquery(HANDLE_WBUS wbus, HANDLE_WBSENSOR sensor, unsigned long *pages, unsigned short *ver)
+{
+  unsigned char buf[MQUERY_LEN_MAX];
+  unsigned long left;
+  unsigned short since = 0, nver = 0;
+  int err, len, i, q, first = 1;
+
+  if (ver != NULL) {
+    since = *ver;
+  }
+  while (*pages != 0) {
+    buf[0] = *pages>>24;
+    buf[1] = *pages>>16;
+    buf[2] = *pages>>8;
+    buf[3] = *pages;
+    buf[4] = sizeof(buf);
+    len = 5;
+    if (ver != NULL) {
+      buf[5] = since>>8;
+      buf[6] = since;
+      len = 7;
+    }
+    err = wbus_io(wbus, WBUS_CMD_MQUERY, buf, NULL, 0, buf, &len, 0);
+    left = *pages;
+    i = 4;
+    if (err == 0 && len >= 4) {
+      left = ((unsigned long)buf[0]<<24) | ((unsigned long)buf[1]<<16)
+           | ((unsigned long)buf[2]<<8) | (unsigned long)buf[3];
+      if ((left & MQUERY_DELTA) && len >= 6) {
+        if (first) {
+          nver = (buf[4]<<8) | buf[5];
+        }
+        i = 6;
+      }
+      left &= ~MQUERY_DELTA;
+    }
+    if (left == *pages) {
+      if (err == 0 && wbus->rejected) {
+        /* Stock heater, it answered with a reject */
+        PRINTF("Multi page query not supported\n");
+        wbus->mquery = MQUERY_NO;
+        return 0;
+      }
+      if (wbus->mquery == MQUERY_UNKNOWN) {
+        /* Timeout or garbled answer, read the pages one by one this time
+           and ask again next time. */
+        PRINTF("Multi page query unanswered\n");
+        return 0;
+      }
+      PRINTF("Multi page query failed\n");
+      return -1;
+    }
+    wbus->mquery = MQUERY_YES;
+
+    for (; i+2 <= len && i+2+buf[i+1] <= len; i += 2+buf[i+1]) {
+      q = buf[i];
+      if (q < WB_NUM_SENSORS && buf[i+1] <= sizeof(sensor[q].value)) {
+        sensor[q].idx = q;
+        sensor[q].length = buf[i+1];
+        memcpy(sensor[q].value, &buf[i+2], buf[i+1]);
+      }
+    }
+    *pages = left;
+    first = 0;
+  }
+  if (ver != NULL) {
+    *ver = nver;
+  }
+
+  return 0;
+}
+
+static
+void wbus_sensors_clear(HANDLE_WBSENSOR sensor, unsigned long pages)
+{
+  int q;
+
+  for (q=0; q<WB_NUM_SENSORS; q++) {
+    if (pages & (1UL<<q)) {
+      sensor[q].length = 0;
+      sensor[q].idx = 0xff;
+    }
+  }
+}
+
+static
+void wbus_sensors_single(HANDLE_WBUS wbus, HANDLE_WBSENSOR sensor, unsigned long pages)
+{
+  int q;
+
+  for (q=0; q<WB_NUM_SENSORS && pages != 0; q++) {
+    if (pages & (1UL<<q)) {
+      wbus_sensor_read(wbus, &sensor[q], q);
+      pages &= ~(1UL<<q);
+    }
+  }
+}
+
+int wbus_sensors_read(HANDLE_WBUS wbus, HANDLE_WBSENSOR sensor, unsigned long pages)
+{
+  pages &= (1UL<<WB_NUM_SENSORS)-1;
+  wbus_sensors_clear(sensor, pages);
+
+  if (wbus->mquery != MQUERY_NO) {
+    if (wbus_mquery(wbus, sensor, &pages, NULL) != 0) {
+      return -1;
+    }
+  }
+  wbus_sensors_single(wbus, sensor, pages);
+
+  return 0;
+}
+
+int wbus_sensors_poll(HANDLE_WBUS wbus, HANDLE_WBSENSOR_CACHE c, unsigned long pages)
+{
+  unsigned long left;
+
+  pages &= (1UL<<WB_NUM_SENSORS)-1;
+  /* The version only applies to the pages fetched along with it */
+  if ((pages & ~c->valid) != 0) {
+    c->version = 0;
+  }
+  if (c->version == 0) {
+    wbus_sensors_clear(c->page, pages);
+  }
+  c->valid = 0;
+
+  left = pages;
+  if (wbus->mquery != MQUERY_NO) {
+    if (wbus_mquery(wbus, c->page, &left, &c->version) != 0) {
+      c->version = 0;
+      return -1;
+    }
+  }
+  if (left != 0) {
+    c->version = 0;
+    wbus_sensors_single(wbus, c->page, left);
+  }
+  c->valid = pages;
+
+  return 0;
+}
+
 #define BOOL(x) (((x)!=0)?1:0)
 
 void wbus_sensor_print(char *str, HANDLE_WBSENSOR s)
@@ -787,14 +958,19 @@ int wbus_data_set_store(HANDLE_WBUS wbus, void *seq, unsigned char idx)
 {
   int err = 0;
   int len = 2;
-  unsigned char tmp[2];
+  unsigned char tmp[2], rep[255];
 
   tmp[0] = DATASET_WRITE;
   tmp[1] = idx;
 
   wbus_init(wbus);
   
-  err = wbus_io(wbus, WBUS_CMD_DATASET, tmp, seq, 96, NULL, &len, 96+2);
+  err = wbus_io(wbus, WBUS_CMD_DATASET, tmp, seq, 96, rep, &len, 2);
+  /* The entry is echoed only if it was written */
+  if (err == 0 && len == 0) {
+    PRINTF("Data set entry %d not written\n", idx);
+    err = -1;
+  }
 
   return err;
 }
@@ -815,6 +991,8 @@ int wbus_open(HANDLE_WBUS *pWbus, unsigned char dev_idx)
 #else
   wbus = &_wbus[dev_idx];
 #endif
+  wbus->mquery = MQUERY_UNKNOWN;
+  memset(&wbus->stats, 0, sizeof(wbus->stats));
   err = rs232_open(&wbus->rs232, dev_idx, 2400, RS232_FMT_8E1);
     
   if (err == 0)
@@ -827,6 +1005,11 @@ int wbus_open(HANDLE_WBUS *pWbus, unsigned char dev_idx)
   return err;
 }
 
+wb_link_stats_t *wbus_link_stats(HANDLE_WBUS wbus)
+{
+  return &wbus->stats;
+}
+
 void wbus_close(HANDLE_WBUS wbus)
 {
   if (wbus == NULL)
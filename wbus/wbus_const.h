@@ -84,6 +84,9 @@
 #define WBUS_CMD_CO2CAL  0x57 /* CO2 calibration */
 
 #define WBUS_CMD_DATASET 0x58 /* (Not Webasto) data set related commands */
+#define WBUS_CMD_DIAG    0x59 /* (Not Webasto) firmware diagnostics */
+#define WBUS_CMD_MQUERY  0x5a /* (Not Webasto) several query pages at once */
+#define WBUS_CMD_LOG     0x5b /* (Not Webasto) heater state log download */
 
 /* 0x50 Command parameters */
 /* Status flags. Bitmasks below. STAxy_desc means status "x", byte offset "y", flag called 2desc" */
@@ -245,6 +248,7 @@
 #define QUERY_COUNTERS2	0x0c
 #define		STA3_SCPH	0	/*!< 2 bytes, parking heater start counter  */
 #define		STA3_SCSH	2	/*!< 2 bytes, supplemtal heater start counter */
+#define		STA3_SCO	4	/*!< 2 bytes, other start counter */
 #define		STA34_FD	0x00	/*!< Flame detected  */
 
 #define QUERY_STATUS2	0x0f
@@ -331,7 +335,66 @@
 /* Dataset commands are custom and proprietary to this library */
 #define DATASET_COUNT	0x01 /* Amount of data set entries. */
 #define DATASET_READ    0x02 /* Read given data set entry. */
-#define DATASET_WRITE   0x03 /* Write given data set entry. */
+#define DATASET_WRITE   0x03 /* Write given data set entry. Returns the entry if it was written,
+                                only the index if not (invalid index, no persistent storage). */
+
+/* Diagnostic commands are custom and proprietary to this library. Multi byte
+   values are big endian. DIAG_SCHED* only if built with KERNEL_PROFILE. */
+#define DIAG_SCHED_CLOCK 0x01 /* Returns 1 byte amount of tasks, 4 bytes profiling clock in Hz */
+#define DIAG_SCHED       0x02 /* 1 byte task index. Returns task index, 4 bytes each: dispatches,
+                                 run time, max slice, wakeups, max wakeup latency (clock ticks),
+                                 2 bytes each: stack usage, stack size (int units) */
+#define DIAG_SCHED_RESET 0x03 /* Clear scheduler statistics */
+#define DIAG_TELEMETRY   0x04 /* Returns 4 bytes jiffies frequency in Hz, 2 bytes each: truncated frames,
+                                 checksum errors, answers sent, max answer latency (jiffies), then
+                                 4 bytes sensor updates, 2 bytes missed deadlines, 1 byte amount of
+                                 heater states n, n times 2 bytes sensor faults in that state, then
+                                 for each command received 1 byte command (0 for unknown ones) and
+                                 2 bytes amount of frames. */
+#define DIAG_TELEMETRY_RESET 0x05 /* Clear telemetry counters */
+
+/* Multi page query is custom and proprietary to this library. Request: 4 bytes
+   bitmap of query pages (big endian, bit n is page n), optional 1 byte maximum
+   reply length. Reply: 4 bytes bitmap of the requested pages which did not
+   fit (ask again for those), then index, length and data of each page.
+   Unknown pages are left out.
+   Delta form: the request has 2 more bytes, a page version (big endian, 0 for
+   none). Only pages changed after that version are sent. The reply then has
+   MQUERY_DELTA set in the bitmap, followed by 2 bytes current page version,
+   then the pages as above. Keep the version of the first reply of a request
+   and use the same since value for the continuation requests. */
+#define MQUERY_LEN_MAX 32
+#define MQUERY_DELTA (1UL<<31) /* reply bitmap flag: delta form supported */
+
+/* Heater state log commands are custom and proprietary to this library. The
+   log is a ring of blocks with increasing block numbers, multi byte values
+   of the commands are big endian. */
+#define LOG_INFO   0x01 /* Returns 4 bytes each: oldest and newest block number, 2 bytes each: bytes used
+                           in newest block, block size, 1 byte flags (LOG_FROZEN, LOG_FAULT), 2 bytes
+                           record period in jiffies, 4 bytes jiffies frequency in Hz, 4 bytes longest
+                           record time and 4 bytes its clock in Hz, 1 byte each: amount of sensors,
+                           amount of actuators. Only the first byte if there is no log. */
+#define LOG_READ   0x02 /* 4 bytes block number, 1 byte offset. Returns the same followed by up to
+                           LOG_CHUNK bytes of the block, no data if the block is gone. */
+#define LOG_RESET  0x03 /* Clear log and resume recording */
+#define LOG_FREEZE 0x04 /* 1 byte: 1 stop recording, 0 continue. Stop before downloading. */
+#define LOG_CHUNK  64
+#define LOG_FROZEN 0x01 /* not recording */
+#define LOG_FAULT  0x02 /* stopped by an error, shortly after it was recorded */
+/*
+ Log block: 4 bytes number of its first record (LSB first), then one record
+ per heater iteration until a 0 byte or the end of the block. Iterations
+ pause while the heater is off and idle. Record header byte h:
+   h = 0:     end of block
+   h < 0x80:  previous record repeated h times
+   h >= 0x80: changed channels. Bits 0..5 flag channels 0..5, bit 6 set
+              means a varint with the flags of channels 6 and up follows.
+              Then the difference of each changed channel to its previous
+              value as zig zag varint. The first record of a block is
+              relative to all channels being 0.
+ Channels: sensors 0..NUM_SENSOR-1, actuators 0..NUM_ACT-1, heater status.
+ Varints have 7 bits per byte LSB first, bit 7 set if more bytes follow.
+ */
 
 /* 053 operational info indexes */
 #define OPINFO_LIMITS 02
@@ -7,6 +7,7 @@
 #include "wbus.h"
 #include "wbus_const.h"
 #include "machine.h"
+#include "kernel.h"
 
 #include <string.h>
 
@@ -56,7 +57,7 @@ static const htdevid_t id[] =
 };
 
 static
-void handle_ident(unsigned char *data, int *plen)
+int handle_ident(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
 {
   int i;
 
@@ -65,11 +66,12 @@ void handle_ident(unsigned char *data, int *plen)
     
   if (i >= 0 && i < 13) {
     *plen = id[i].size+1;
-    memcpy(data+1, id[i].pData, id[i].size);
+    memcpy(data+1, (id[i].pData == id_serial) ? srv->serial : id[i].pData, id[i].size);
   } else {
     PRINTF("Unhandled ident\n");
     data[0] = 0x7f;
   }
+  return 0;
 }
 
 /* DEVICE OPERATING DATA */
@@ -157,6 +159,7 @@ void handle_ident(unsigned char *data, int *plen)
 __attribute__ ((section (".flashrw")))
 #endif
 __attribute__ ((aligned(512)))
+FLASH_EMU
 union seq_d seq_data = {
  {
   { /* HT_OFF 0 */
@@ -322,35 +325,29 @@ union seq_d seq_data = {
  } 
 }; 
 
+/* Second data set bank. Erased at first, see dataset_write() */
 static
-void dataset_read(heater_seqmem_t * seq, heater_status_t s)
-{ 
-  memcpy(seq, &seq_data.heater_seq[s], sizeof(heater_seq_t));
-}
-
-static
-void dataset_write(heater_seqmem_t * seq, heater_status_t s)
-{  
-  /* Temporal buffer for flash segment write. static because
-     it wont fit on the task stack */
-  int addr = (int)(unsigned char *)&seq_data.heater_seq[s]; 
-  int offset;
-  unsigned char *base;
-
-  base = (unsigned char *)((addr) & (~(int)0x1ff));
-  offset = addr & 0x1ff;
-
-  /* prepare memory segment */
-  memmove(wbdata+offset, seq, sizeof(heater_seq_t));
-  /* copy other flash data that should not be changed */
-  memcpy(wbdata, (unsigned char*)base, offset);
-  memcpy(wbdata+offset+sizeof(heater_seqmem_t), (unsigned char*)base+offset+sizeof(heater_seqmem_t), 512-offset-sizeof(heater_seqmem_t));
-  /* Write segment back to flash */
-  flash_write(base, wbdata, 512); 
-}
+#ifdef __MSP430__
+__attribute__ ((section (".flashrw_b")))
+#endif
+__attribute__ ((aligned(512)))
+FLASH_EMU
+union seq_d seq_data_b = {
+  .force_size = { [0 ... sizeof(union seq_d)-1] = 0xff }
+};
 
+union seq_d *seq_bank = &seq_data;
+unsigned short seq_trip[HT_LAST];
+unsigned short seq_lock[HT_LAST];
+unsigned char seq_gen;
 
-static const unsigned char q4[] = { 0x00, 0x06, 0x03, 0x00 }; /* Fuel type, max heat time / 10, ventilation time factor */
+/* Constant query pages, sent as they are */
+static const unsigned char q_opinfo0[] = { 0x00, 0x06, 0x03 }; /* Fuel type, max heat time / 10, ventilation time factor */
+static const unsigned char q_opinfo1[] = { 0x78, 0x6e, 0x00 };
+static const unsigned char q_durations0[] = { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11,
+                                             12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23 };
+static const unsigned char q_durations1[] = { 1, 2, 3, 4, 5, 6 };
+static const unsigned char q_zero[7] = { 0 };
 
 /* Translate wb_server state into WBus state */
 static
@@ -415,136 +412,308 @@ unsigned char ht_state2wb_state(heater_state_t *s)
 }
 
 static
-void handle_query(unsigned char *data, int *plen, heater_state_t *s)
+void query_status1(unsigned char *data, wbus_server_t *srv)
 {
-  int q;
+  heater_state_t *s = srv->state;
   unsigned short *acts = s->volatile_data.act;
+
+  data[0] = 0;
+  if (acts[ACT_CF] != 0)
+    data[0] |= STA10_CF;
+  if (acts[ACT_GKZ] != 0)
+    data[0] |= STA10_GP;
+  if (acts[ACT_DP] != 0)
+    data[0] |= STA10_FP;
+  if (acts[ACT_CP] != 0)
+    data[0] |= STA10_CP;
+  if (acts[ACT_VF] != 0)
+    data[0] |= STA10_VF;
+  if (acts[ACT_GKPH] != 0)
+    data[0] |= STA10_NSH;
+  if (s->volatile_data.sensor[SENSOR_FD] != 0)
+    data[0] |= STA10_FI;
+}
+
+static
+void query_sensors(unsigned char *data, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
   unsigned short *sensors = s->volatile_data.sensor;
 
-  q = data[0];
-  /*PRINTF("Query %d\n", q);*/
-  data++;
- 
-  switch (q) {
-    case QUERY_STATUS0:
-      data[0]=0; data[1]=0; data[2]=0; data[3]=0; data[4]=0; *plen=6;
-      break;
-    case QUERY_STATUS1:
-      data[0] = 0;
-      if (acts[ACT_CF] != 0)
-        data[0] |= STA10_CF;
-      if (acts[ACT_GKZ] != 0)
-        data[0] |= STA10_GP;
-      if (acts[ACT_DP] != 0)
-        data[0] |= STA10_FP;
-      if (acts[ACT_CP] != 0)
-        data[0] |= STA10_CP;
-      if (acts[ACT_VF] != 0)
-        data[0] |= STA10_VF;
-      if (acts[ACT_GKPH] != 0)
-        data[0] |= STA10_NSH;
-      if (sensors[SENSOR_FD] != 0)
-        data[0] |= STA10_FI;
-      *plen = 2;
-      break;
-    case QUERY_OPINFO0:
-      memcpy(data, q4, 4);
-      *plen = 4;
-      break;
-    case QUERY_SENSORS:
-      data[SEN_TEMP] = (unsigned char)sensors[SENSOR_T0];
-      VOLT2WORD(data[SEN_VOLT], sensors[SENSOR_VCC]);
-      data[SEN_FD] = sensors[SENSOR_FD]; /* Flag */
-      //WATT2WORD(data[SEN_HE], sensors[SENSOR_HE]);
+  data[SEN_TEMP] = (unsigned char)sensors[SENSOR_T0];
+  VOLT2WORD(data[SEN_VOLT], sensors[SENSOR_VCC]);
+  data[SEN_FD] = sensors[SENSOR_FD]; /* Flag */
+  //WATT2WORD(data[SEN_HE], sensors[SENSOR_HE]);
 #if (ACTMAX_LD2 != 2)
-      WATT2WORD(data[SEN_HE], (sensors[SENSOR_P]>>ACTMAX_LD2)*10);
+  WATT2WORD(data[SEN_HE], (sensors[SENSOR_P]>>ACTMAX_LD2)*10);
 #else
-      WATT2WORD(data[SEN_HE], (sensors[SENSOR_P]<<1) + (sensors[SENSOR_P]>>1));
+  WATT2WORD(data[SEN_HE], (sensors[SENSOR_P]<<1) + (sensors[SENSOR_P]>>1));
 #endif
-      OHM2WORD(data[SEN_GPR], sensors[SENSOR_GPR]); /* Flame detector */
-      *plen = 9;
-      break;
-    case QUERY_COUNTERS1:
-      HOUR2WORD(data[0], s->static_data.working_duration.hours);
-      data[2] = s->static_data.working_duration.minutes;
-      HOUR2WORD(data[3], s->static_data.operating_duration.hours);
-      data[5] = s->static_data.operating_duration.minutes;
-      SWAP(&data[6], s->static_data.counter);
-      *plen = 9;
-      break; 
-    case QUERY_STATE:
-      data[OP_STATE] = ht_state2wb_state(s);
-      data[OP_STATE_N] = 0;
-      data[DEV_STATE] = 0;
-      data[4] = 0; data[5] = 0; data[6] = 0;
-      *plen = 7;
-      break;
-    case QUERY_DURATIONS0:
-      { 
-        int i;
-        
-        for (i=0; i<24; i++) data[i] = i;
-      }
-      *plen = 25;
-      break;
-    case QUERY_DURATIONS1:
-      data[0] = 1; data[1] = 2; data[2] = 3; data[3] = 4; data[4] = 5; data[5] = 6;
-      *plen = 7;
-      break;
-    case QUERY_COUNTERS2:
-      SWAP(&data[STA3_SCPH], s->static_data.counter);
-      SWAP(&data[STA3_SCSH], 0);
-      SWAP(&data[STA34_FD], 0); /* ??? */
-      *plen = 7;
-      break;
-    case QUERY_STATUS2:
-      /* data[STA2_GP] = acts[ACT_GKZ]>>(ACTMAX_LD2-1); */
-      data[STA2_GP] = mult_u16xu16h(sensors[SENSOR_GKZ], 65536/100); /* in 10mA, scaled to A */
-      data[STA2_FP] = acts[ACT_DP];
-      /* data[STA2_CAF] = acts[ACT_CF]>>(ACTMAX_LD2-1); */
+  OHM2WORD(data[SEN_GPR], sensors[SENSOR_GPR]); /* Flame detector */
+}
+
+static
+void query_counters1(unsigned char *data, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  HOUR2WORD(data[0], s->static_data.working_duration.hours);
+  data[2] = s->static_data.working_duration.minutes;
+  HOUR2WORD(data[3], s->static_data.operating_duration.hours);
+  data[5] = s->static_data.operating_duration.minutes;
+  SWAP(&data[6], s->static_data.counter);
+}
+
+static
+void query_state(unsigned char *data, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  data[OP_STATE] = ht_state2wb_state(s);
+  data[OP_STATE_N] = 0;
+  data[DEV_STATE] = 0;
+  data[3] = 0; data[4] = 0; data[5] = 0;
+}
+
+static
+void query_counters2(unsigned char *data, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  SWAP(&data[STA3_SCPH], s->static_data.counter);
+  SWAP(&data[STA3_SCSH], 0);
+  SWAP(&data[STA3_SCO], 0);
+}
+
+static
+void query_status2(unsigned char *data, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+  unsigned short *acts = s->volatile_data.act;
+  unsigned short *sensors = s->volatile_data.sensor;
+
+  /* data[STA2_GP] = acts[ACT_GKZ]>>(ACTMAX_LD2-1); */
+  data[STA2_GP] = mult_u16xu16h(sensors[SENSOR_GKZ], 65536/100); /* in 10mA, scaled to A */
+  data[STA2_FP] = acts[ACT_DP];
+  /* data[STA2_CAF] = acts[ACT_CF]>>(ACTMAX_LD2-1); */
 #if 0
-      /* CAF as percentage (WBUS code WB_CODE_CAVR bit not set) */
-      data[STA2_CAF] = sensors[SENSOR_CAF]; /* percentage */
-      data[STA2_U0] = 0;
+  /* CAF as percentage (WBUS code WB_CODE_CAVR bit not set) */
+  data[STA2_CAF] = sensors[SENSOR_CAF]; /* percentage */
+  data[STA2_U0] = 0;
 #else
-      /* CAF as RPM (WBUS code WB_CODE_CAVR bit set) */
-      RPM2WORD(data[STA2_CAF], sensors[SENSOR_CAF]); /* RPM */
+  /* CAF as RPM (WBUS code WB_CODE_CAVR bit set) */
+  RPM2WORD(data[STA2_CAF], sensors[SENSOR_CAF]); /* RPM */
 #endif
-      data[STA2_CP] = acts[ACT_CP]>>(ACTMAX_LD2-1);
-      *plen = 6;
-      break;
-    case QUERY_OPINFO1:
-      data[0] = 0x78;
-      data[1] = 0x6e;
-      data[2] = 0x00;
-      *plen = 4;
-      break;
-    case QUERY_DURATIONS2:
-      /* Ventilation duration mms */
-      data[0] = 0; data[1] = 0; data[2] = 0;
-      *plen = 4;
-      break;
-    case QUERY_FPW:
-      /* Note: sensors[SENSOR_GKPH] is scaled by factor 10 of real value. */
+  data[STA2_CP] = acts[ACT_CP]>>(ACTMAX_LD2-1);
+}
+
+static
+void query_fpw(unsigned char *data, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+  unsigned short *sensors = s->volatile_data.sensor;
+
+  /* Note: sensors[SENSOR_GKPH] is scaled by factor 10 of real value. */
 #if 0
-      /* Be WBUS 3.3 compliant and return fuel prewarming heater resistance. */
-      OHM2WORD(data[FPW_R], (acts[ACT_GKPH]>0) ? div_u32_u16(sensors[SENSOR_VCC]*100L, sensors[SENSOR_GKPH]) : 0);
+  /* Be WBUS 3.3 compliant and return fuel prewarming heater resistance. */
+  OHM2WORD(data[FPW_R], (s->volatile_data.act[ACT_GKPH]>0) ? div_u32_u16(sensors[SENSOR_VCC]*100L, sensors[SENSOR_GKPH]) : 0);
 #else
-      /* Display fuel prewarming temperature (more useful, but not WBUS 3.3 compliant) */
-      OHM2WORD(data[FPW_R], (signed)sensors[SENSOR_T1] - 50);
+  /* Display fuel prewarming temperature (more useful, but not WBUS 3.3 compliant) */
+  OHM2WORD(data[FPW_R], (signed)sensors[SENSOR_T1] - 50);
 #endif
-      /* 10*65536*65536/1000000 = 42949.67296 */
-      WATT2WORD(data[FPW_P], mult_u16xu16h(mult_u16xu16h(sensors[SENSOR_GKPH], sensors[SENSOR_VCC]), 42950));
-      *plen = 5;
-      break;
-    case 20:
-      data[0] = 0; data[1] = 0; data[2] = 0; data[3] = 0; data[4] = 0; data[5] = 0; data[6] = 0;
-      *plen = 8;
-      break;
-    default:
-      PRINTF("Unknown query code %d\n", q);
-      break;
-  }   
+  /* 10*65536*65536/1000000 = 42949.67296 */
+  WATT2WORD(data[FPW_P], mult_u16xu16h(mult_u16xu16h(sensors[SENSOR_GKPH], sensors[SENSOR_VCC]), 42950));
+}
+
+/*
+ * Sensor dependent pages, pre-encoded by wbus_server_snapshot() into the
+ * buffer not being read and then published by switching snap_cur.
+ */
+#define SNAP_SENSORS 0
+#define SNAP_STATUS2 8
+#define SNAP_FPW     13
+#define SNAP_SIZE    WBUS_SERVER_SNAP_SIZE
+
+void wbus_server_snapshot(wbus_server_t *srv)
+{
+  unsigned char *b = srv->snap[(srv->snap_cur == 0) ? 1 : 0];
+
+  query_sensors(b+SNAP_SENSORS, srv);
+  query_status2(b+SNAP_STATUS2, srv);
+  query_fpw(b+SNAP_FPW, srv);
+  srv->snap_cur = (b == srv->snap[0]) ? 0 : 1;
+  srv->tm.snapshots++;
+}
+
+/* Copy page from current snapshot or encode live values if there is none */
+static
+void query_snap(unsigned char *data, wbus_server_t *srv, int off, int size,
+                void (*fill)(unsigned char *data, wbus_server_t *srv))
+{
+  signed char cur = srv->snap_cur;
+
+  if (cur < 0) {
+    fill(data, srv);
+  } else {
+    memcpy(data, &srv->snap[cur][off], size);
+  }
+}
+
+static
+void query_sensors_snap(unsigned char *data, wbus_server_t *srv)
+{
+  query_snap(data, srv, SNAP_SENSORS, SNAP_STATUS2-SNAP_SENSORS, query_sensors);
+}
+
+static
+void query_status2_snap(unsigned char *data, wbus_server_t *srv)
+{
+  query_snap(data, srv, SNAP_STATUS2, SNAP_FPW-SNAP_STATUS2, query_status2);
+}
+
+static
+void query_fpw_snap(unsigned char *data, wbus_server_t *srv)
+{
+  query_snap(data, srv, SNAP_FPW, SNAP_SIZE-SNAP_FPW, query_fpw);
+}
+
+/* Query page: either constant data or a function filling in size bytes */
+typedef struct {
+  const unsigned char *pData;
+  void (*fill)(unsigned char *data, wbus_server_t *srv);
+  unsigned char size;
+} htpage_t;
+
+/* Indexed by query page number. Unknown pages have size 0. */
+static const htpage_t query_page[] =
+{
+  [QUERY_STATUS0]    = { q_zero, NULL, 5 },
+  [QUERY_STATUS1]    = { NULL, query_status1, 1 },
+  [QUERY_OPINFO0]    = { q_opinfo0, NULL, sizeof(q_opinfo0) },
+  [QUERY_SENSORS]    = { NULL, query_sensors_snap, SNAP_STATUS2-SNAP_SENSORS },
+  [QUERY_COUNTERS1]  = { NULL, query_counters1, 8 },
+  [QUERY_STATE]      = { NULL, query_state, 6 },
+  [QUERY_DURATIONS0] = { q_durations0, NULL, sizeof(q_durations0) },
+  [QUERY_DURATIONS1] = { q_durations1, NULL, sizeof(q_durations1) },
+  [QUERY_COUNTERS2]  = { NULL, query_counters2, 6 },
+  [QUERY_STATUS2]    = { NULL, query_status2_snap, SNAP_FPW-SNAP_STATUS2 },
+  [QUERY_OPINFO1]    = { q_opinfo1, NULL, sizeof(q_opinfo1) },
+  [QUERY_DURATIONS2] = { q_zero, NULL, 3 },
+  [QUERY_FPW]        = { NULL, query_fpw_snap, SNAP_SIZE-SNAP_FPW },
+  [20]               = { q_zero, NULL, 7 }
+};
+
+#define NUM_PAGES (int)(sizeof(query_page)/sizeof(query_page[0]))
+
+/* wbus_server_t is sized for this table */
+typedef char page_ver_check[(NUM_PAGES == WBUS_SERVER_PAGES) ? 1 : -1];
+typedef char page_copy_check[(1+8+6+6+SNAP_SIZE-SNAP_SENSORS == WBUS_SERVER_PAGE_COPY) ? 1 : -1];
+
+/* Encode page q into buf and track its version. off is the offset of the
+   page in srv->page_copy. Comparing is done lazily here, when somebody
+   asks, so updating the heater state costs nothing. */
+static
+void page_track(wbus_server_t *srv, int q, int off, unsigned char *buf)
+{
+  const htpage_t *p = &query_page[q];
+
+  p->fill(buf, srv);
+  if (memcmp(srv->page_copy+off, buf, p->size) != 0) {
+    memcpy(srv->page_copy+off, buf, p->size);
+    if (++srv->page_ver_cur == 0) {
+      srv->page_ver_cur = 1;
+    }
+    srv->page_ver[q] = srv->page_ver_cur;
+  }
+}
+
+static
+int handle_query(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
+{
+  const htpage_t *p;
+  int q;
+
+  q = data[0];
+  /*PRINTF("Query %d\n", q);*/
+
+  if (q >= NUM_PAGES || query_page[q].size == 0) {
+    PRINTF("Unknown query code %d\n", q);
+    return 0;
+  }
+  p = &query_page[q];
+  if (p->pData != NULL) {
+    memcpy(data+1, p->pData, p->size);
+  } else {
+    p->fill(data+1, srv);
+  }
+  *plen = p->size+1;
+
+  return 0;
+}
+
+static
+int handle_mquery(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
+{
+  const htpage_t *p;
+  unsigned long pages, left = 0;
+  unsigned short since = 0;
+  int q, n, max, off = 0, delta = 0, all = 1;
+
+  pages = ((unsigned long)data[0]<<24) | ((unsigned long)data[1]<<16)
+        | ((unsigned long)data[2]<<8) | (unsigned long)data[3];
+  max = MQUERY_LEN_MAX;
+  if (*plen > 4 && data[4] < max) {
+    max = data[4];
+  }
+  n = 4;
+  if (*plen >= 7) {
+    delta = 1;
+    since = (data[5]<<8) | data[6];
+    /* A version from the future means we restarted meanwhile, send all */
+    all = (since == 0 || (signed short)(since - srv->page_ver_cur) > 0);
+    n = 6;
+  }
+
+  for (q=0; q<NUM_PAGES; q++) {
+    p = &query_page[q];
+    if (p->fill != NULL) {
+      off += p->size;
+    }
+    if (!(pages & (1UL<<q)) || p->size == 0) {
+      continue;
+    }
+    if (delta && p->fill != NULL) {
+      /* Encode in place, it is dropped again if unchanged or too big */
+      page_track(srv, q, off - p->size, data+n+2);
+    }
+    if (!all && (signed short)(srv->page_ver[q] - since) <= 0) {
+      continue;
+    }
+    if (n+2+p->size > max) {
+      left |= 1UL<<q;
+      continue;
+    }
+    data[n] = q;
+    data[n+1] = p->size;
+    if (p->pData != NULL) {
+      memcpy(data+n+2, p->pData, p->size);
+    } else if (!delta) {
+      p->fill(data+n+2, srv);
+    }
+    n += 2+p->size;
+  }
+  if (delta) {
+    left |= MQUERY_DELTA;
+    data[4] = srv->page_ver_cur>>8;
+    data[5] = srv->page_ver_cur;
+  }
+  data[0] = left>>24;
+  data[1] = left>>16;
+  data[2] = left>>8;
+  data[3] = left;
+  *plen = n;
+
+  return 0;
 }
 
 static
@@ -554,7 +723,7 @@ __attribute__ ((section (".infomem")))
 unsigned char opinfo[] = { 0x2c, 0x24, 0x25, 0x1c, 0x30, 0xd4, 0xfa, 0x40, 0x74, 0x00, 0x00, 0x63, 0x9c, 0x05 };
 
 static
-void handle_opinfo(unsigned char *data, int *plen, heater_state_t *s)
+int handle_opinfo(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
 {
   PRINTF("Operation info %d\n", data[0]);
   
@@ -565,277 +734,1205 @@ void handle_opinfo(unsigned char *data, int *plen, heater_state_t *s)
   } else {
     PRINTF("Unhandled opinfo index\n");
   }
+  return 0;
 }
 
 
-#define MAX_ERR 11
+#define MAX_ERR WBUS_SERVER_MAX_ERR
+
+/* Initial error list entry of new instances */
+static const err_info_t err_default =
+  { ERR_NOSTART, 0x03, 1, { WB_STATE_PH, WB_DSTATE_STFL }, 68, { 0x30, 0xd4 }, { 0, 1 }, 3 };
+
+/*
+ * Flash journal for error events and counter checkpoints. Records are
+ * appended into erased flash of the active segment:
+ *   type, len, seq (LSB, MSB), len bytes payload, crc8, pad to even size.
+ * Each segment starts with a snapshot of the whole persistent state from
+ * HEAD to SYNC. When a segment is full, the next one is erased and gets a
+ * new snapshot (compaction). Segments are used round robin to spread wear.
+ * At boot the newest segment with complete snapshot is replayed.
+ */
+#define JOURNAL_SEG 512
+#ifndef JOURNAL_SEGS
+#define JOURNAL_SEGS 2
+#endif
+
+#define JREC_FREE     0xff  /* erased flash */
+#define JREC_HEAD     0x01  /* first record of segment, its seq orders segments */
+#define JREC_SYNC     0x02  /* end of snapshot */
+#define JREC_ERROR    0x03  /* err_info_t */
+#define JREC_ERR_DEL  0x04  /* error list cleared */
+#define JREC_COUNTERS 0x05  /* heater_static_t */
+#define JREC_SEQ_BANK 0x06  /* seq_commit_t, data set bank header */
+
+#define JREC_SIZE(len) (((len)+6) & ~1)
+#define JREC_MAX (sizeof(heater_static_t) > sizeof(err_info_t) ? sizeof(heater_static_t) : sizeof(err_info_t))
 
 static
 #ifdef __MSP430__
-__attribute__ ((section (".infomem")))
+__attribute__ ((section (".journal")))
 #endif
-union {
-  err_info_t ht_errors[MAX_ERR]; 
-  unsigned char fill[128];
-} union_error = {
-  {
-  { ERR_NOSTART, 0x03, 1, { WB_STATE_PH, WB_DSTATE_STFL }, 68, { 0x30, 0xd4 }, { 0, 1 }, 3 }
-  }
+__attribute__ ((aligned(JOURNAL_SEG)))
+FLASH_EMU
+unsigned char journal[JOURNAL_SEGS][JOURNAL_SEG] = {
+  [0 ... JOURNAL_SEGS-1] = { [0 ... JOURNAL_SEG-1] = JREC_FREE }
 };
 
+static unsigned char jSeg;          /* active segment */
+static unsigned short jPos;         /* write offset in active segment */
+static unsigned short jSeq;         /* next record sequence number */
+static wbus_server_t *jSrv;         /* the persistent instance */
+static heater_static_t jCounters;   /* last stored counters */
+
+/* Data set bank header. A bank is valid if its contents match crc. The
+   valid bank with the highest generation is used, generation 0 means
+   the bank was never written. */
+typedef struct {
+  unsigned short gen;
+  unsigned short crc;
+  unsigned char bank;
+} seq_commit_t;
+
+static union seq_d * const seq_banks[2] = { &seq_data, &seq_data_b };
+static seq_commit_t seqCommit[2];
+
 static
-int error_makelist(unsigned char *data)
+unsigned char crc8(const unsigned char *p, int n)
 {
+  unsigned char crc = 0;
   int i;
-  
-  for (i=0; i<MAX_ERR; i++)
-  {
-    if (union_error.ht_errors[i].code != 0) {
-      data[2+i*2] = union_error.ht_errors[i].code;
-      data[3+i*2] = union_error.ht_errors[i].counter;
-    } else {
-      break;
+
+  while (n--) {
+    crc ^= *p++;
+    for (i=0; i<8; i++) {
+      crc = (crc & 0x80) ? (crc<<1) ^ 0x07 : (crc<<1);
     }
   }
-  data[1] = i;
-  return i*2+2;
+  return crc;
 }
 
+/* \return payload length, -1 on free space or -2 if corrupt */
 static
-int error_makeinfo(unsigned char *data)
+int journal_check(const unsigned char *r, int room)
 {
-  int i;
-  
-  for (i=0; i<MAX_ERR; i++)
-  {
-    if (union_error.ht_errors[i].code == data[1]) {
-      memcpy(data+1, &union_error.ht_errors[i], sizeof(err_info_t));
-      break;
-    }
+  int len;
+
+  if (room < JREC_SIZE(0) || r[0] == JREC_FREE) {
+    return -1;
   }
-  return 12;
+  len = r[1];
+  if (JREC_SIZE(len) > room || crc8(r, len+4) != r[len+4]) {
+    return -2;
+  }
+  return len;
 }
 
+static
+void journal_write(unsigned char type, const void *payload, int len)
+{
+  unsigned short buf[JREC_SIZE(JREC_MAX)/2];
+  unsigned char *r = (unsigned char *)buf;
+
+  r[0] = type;
+  r[1] = len;
+  r[2] = jSeq;
+  r[3] = jSeq>>8;
+  memcpy(r+4, payload, len);
+  r[len+4] = crc8(r, len+4);
+  r[len+5] = 0xff;
+
+  flash_program(&journal[jSeg][jPos], r, JREC_SIZE(len));
+  jPos += JREC_SIZE(len);
+  jSeq++;
+}
 
-void wbus_error_add(heater_state_t *state, unsigned char code, unsigned char n, unsigned char *tmp)
+/* Write complete current state into the next segment */
+static
+void journal_compact(void)
 {
-  err_info_t *e = (err_info_t*)tmp;
-  unsigned short *s = state->volatile_data.sensor;
   int i;
- 
-  /* code, stat, counter, op_state, temp, volts, hours, minutes */
-  for (i=0; i<MAX_ERR; i++)
-  {
-    if (union_error.ht_errors[i].code == 0 || union_error.ht_errors[i].code == code)
-    {
-      memcpy(e, union_error.ht_errors, sizeof(union_error.ht_errors));
-      e[i].code = code;
-      e[i].flags = 3;
-      e[i].counter++;
-      e[i].op_state[0] = ht_state2wb_state(state);
-      e[i].op_state[1] = n;
-      e[i].temp = s[SENSOR_T0];
-      VOLT2WORD(e[i].volt[0], s[SENSOR_VCC]);
-      e[i].hour[1] = state->static_data.working_duration.hours;
-      e[i].minute = state->static_data.working_duration.minutes;
-
-      flash_write(union_error.ht_errors, e, sizeof(union_error.ht_errors));
-      break;
-    } 
+
+  jSeg = (jSeg+1) % JOURNAL_SEGS;
+  jPos = 0;
+  flash_write(journal[jSeg], NULL, 0);
+
+  jCounters = jSrv->state->static_data;
+  journal_write(JREC_HEAD, NULL, 0);
+  journal_write(JREC_COUNTERS, &jCounters, sizeof(jCounters));
+  for (i=0; i<MAX_ERR && jSrv->errors[i].code != 0; i++) {
+    journal_write(JREC_ERROR, &jSrv->errors[i], sizeof(err_info_t));
+  }
+  for (i=0; i<2; i++) {
+    if (seqCommit[i].gen != 0) {
+      journal_write(JREC_SEQ_BANK, &seqCommit[i], sizeof(seq_commit_t));
+    }
   }
+  journal_write(JREC_SYNC, NULL, 0);
 }
 
+/* Append record. RAM state must be updated already, compaction stores it. */
 static
-void handle_error(unsigned char *data, int *plen, heater_state_t *s)
+void journal_append(unsigned char type, const void *payload, int len)
 {
-  int ecmd;
-  
-  ecmd = data[0];
-  
-  /* PRINTF("Error cmd %d\n", ecmd); */
-  
-  switch (ecmd) {
-    case ERR_LIST:
-      *plen = error_makelist(data);
-      break;
-    case ERR_READ:
-      *plen = error_makeinfo(data);
-      break;
-    case ERR_DEL:
-      /* Erase flash page containing error codes */
-      flash_write((void*)union_error.ht_errors, NULL, sizeof(union_error.ht_errors));
-      break;
+  if (jPos + JREC_SIZE(len) > JOURNAL_SEG) {
+    journal_compact();
+  } else {
+    journal_write(type, payload, len);
   }
 }
 
-int wbus_server_process(unsigned char cmd, unsigned char *data, int *len, heater_state_t *s)
+/* \return non zero if segment starts with a complete snapshot */
+static
+int journal_segment_valid(int seg)
 {
-  int err = 0;
+  const unsigned char *r = journal[seg];
+  int pos = 0, len;
 
-  /* PRINTF("len = %d cmd = %x idx = %x\n", *len, cmd, data[0]); */
+  if (journal_check(r, JOURNAL_SEG) != 0 || r[0] != JREC_HEAD) {
+    return 0;
+  }
+  while ((len = journal_check(r+pos, JOURNAL_SEG-pos)) >= 0) {
+    if (r[pos] == JREC_SYNC) {
+      return 1;
+    }
+    pos += JREC_SIZE(len);
+  }
+  return 0;
+}
 
-  switch (cmd) {
-    case WBUS_CMD_OFF:
-      if (s->volatile_data.status != HT_OFF 
-       && s->volatile_data.status != HT_COOLDOWN
-       && s->volatile_data.status != HT_STOP)
-      {
-        s->volatile_data.time = 0;
-        s->volatile_data.cmd_refresh_time = 0;
-        if (s->volatile_data.status == HT_VENT) {
-          s->volatile_data.status_sched = HT_OFF;
-        } else {
-          s->volatile_data.status_sched = HT_STOP;
+static
+void journal_replay(wbus_server_t *srv)
+{
+  const unsigned char *r;
+  unsigned short seq = 0;
+  int seg, best = -1, len, i;
+
+  jSrv = srv;
+
+  for (seg=0; seg<JOURNAL_SEGS; seg++) {
+    if (!journal_segment_valid(seg)) {
+      continue;
+    }
+    r = journal[seg];
+    if (best < 0 || (signed short)((r[2] | (r[3]<<8)) - seq) > 0) {
+      best = seg;
+      seq = r[2] | (r[3]<<8);
+    }
+  }
+
+  if (best < 0) {
+    /* Nothing stored yet, start out with current state */
+    PRINTF("Initializing flash journal\n");
+    jSeg = JOURNAL_SEGS-1;
+    journal_compact();
+    return;
+  }
+
+  /* The snapshot contains all errors, compiled in defaults are discarded */
+  memset(srv->errors, 0, sizeof(srv->errors));
+  jSeg = best;
+  jPos = 0;
+  r = journal[best];
+  while ((len = journal_check(r+jPos, JOURNAL_SEG-jPos)) >= 0) {
+    switch (r[jPos]) {
+      case JREC_ERROR:
+        for (i=0; i<MAX_ERR && len == sizeof(err_info_t); i++) {
+          if (srv->errors[i].code == 0 || srv->errors[i].code == r[jPos+4]) {
+            memcpy(&srv->errors[i], r+jPos+4, sizeof(err_info_t));
+            break;
+          }
         }
-      }
-      *len = 1;
-      break;
-    case WBUS_CMD_ON:
-    case WBUS_CMD_ON_PH:
-    case WBUS_CMD_ON_SH:
-    case WBUS_CMD_ON_VENT:
-      if (s->volatile_data.status == HT_OFF) {
-        s->volatile_data.time = 0;
-        s->volatile_data.status_sched = (cmd == WBUS_CMD_ON_VENT) ? HT_VENT : HT_START;
-        s->volatile_data.wbus_time = data[0] * (60*JFREQ/HEATER_PERIOD);
-        s->volatile_data.cmd_refresh_time = MSEC2PERIODS(CMD_REFRESH_PERIOD);
-        s->volatile_data.cmd_refresh = cmd;
-      }
-      break;
-    case WBUS_CMD_CP:
-    case WBUS_CMD_BOOST:
-      /* ToDo */
-      break;
-    case WBUS_CMD_U1:
-      PRINTF("0x38 (unknown)\n");
-      *len = 7;
-      data[0] = 0xb8;
-      data[1] = 0x0b;
-      data[2] = 0x00;
-      data[3] = 0x00;
-      data[4] = 0x00;
-      data[5] = 0x03;
-      data[6] = 0xdd;
-      err = 1;
-      break;
-    case WBUS_CMD_X:
-      switch (data[0]) {
-        case CMD_X_FP:
-        PRINTF("Fuel priming %d seconds\n", ((data[1]<<8)+data[2])<<1);
-        if (s->volatile_data.status == HT_OFF) {
-          s->volatile_data.act[ACT_DP] = 40; /* Set dosing pump to 2 Hz */
-          s->volatile_data.status_sched = HT_TEST;
-          s->volatile_data.wbus_time = ((((int)data[1]<<9)+((int)data[2]<<1))) * (JFREQ/HEATER_PERIOD);
-          s->volatile_data.time = 0;
+        break;
+      case JREC_ERR_DEL:
+        memset(srv->errors, 0, sizeof(srv->errors));
+        break;
+      case JREC_COUNTERS:
+        if (len == sizeof(heater_static_t)) {
+          memcpy(&jCounters, r+jPos+4, sizeof(heater_static_t));
+          srv->state->static_data = jCounters;
         }
         break;
-        case CMD_X_VCAL:
-          PRINTF("Voltage calibration %f Volt\n", ((data[1]<<8)+data[2])/1000.f);
-          break;
-        case CMD_X_FCAL:
-          PRINTF("Flame detector calibration %d\n", (data[1]<<8)+data[2]);
-          break;
-      }
-      break;
-    case WBUS_CMD_CHK:
-      if (s->volatile_data.cmd_refresh == data[0]) {
-        s->volatile_data.cmd_refresh_time = MSEC2PERIODS(CMD_REFRESH_PERIOD);
-        data[0] = 0;
-      } else {
-        data[0] = 1;
-      }
-      *len = 1;
-      break;
-    case WBUS_CMD_TEST:
-      if (s->volatile_data.status == HT_OFF) {
-        unsigned short *acts = s->volatile_data.act;
-        unsigned short tmp;
-        
-        s->volatile_data.status_sched = HT_TEST;
-        s->volatile_data.wbus_time = data[1] * (JFREQ/HEATER_PERIOD);
-        s->volatile_data.time = 0;
-
-        tmp = ((unsigned short)data[2]<<8) | (unsigned short)data[3];
-        switch (data[0]) {
-          case WBUS_TEST_CF:  acts[ACT_CF]  = tmp; break;
-          case WBUS_TEST_FP:  acts[ACT_DP]  = tmp; break;
-          case WBUS_TEST_GP:  acts[ACT_GKZ] = tmp<<(ACTMAX_LD2-1); break;
-          case WBUS_TEST_CP:  acts[ACT_CP]  = tmp<<(ACTMAX_LD2-1); break;
-          case WBUS_TEST_VF:  acts[ACT_VF]  = 100<<ACTMAX_LD2; break;
-          case WBUS_TEST_SV:  acts[ACT_AUX] = 100<<ACTMAX_LD2; break;
-          case WBUS_TEXT_NAC: acts[ACT_CC]  = tmp<<(ACTMAX_LD2-1); break;
-          case WBUS_TEST_NSH: acts[ACT_GKPH] = 100<<ACTMAX_LD2; break;
-          case WBUS_TEST_FPW: acts[ACT_GKPH] = tmp<<ACTMAX_LD2; break;
+      case JREC_SEQ_BANK:
+        if (len == sizeof(seq_commit_t)) {
+          seq_commit_t c;
+
+          memcpy(&c, r+jPos+4, sizeof(seq_commit_t));
+          if (c.bank < 2) {
+            seqCommit[c.bank] = c;
+          }
         }
+        break;
+    }
+    seq = r[jPos+2] | (r[jPos+3]<<8);
+    jPos += JREC_SIZE(len);
+  }
+  jSeq = seq+1;
+  if (len == -2) {
+    /* Interrupted write, continue in a fresh segment */
+    PRINTF("Flash journal record at %d corrupt\n", jPos);
+    jPos = JOURNAL_SEG;
+  }
+}
+
+/*
+ * Data sets are kept in two flash banks. dataset_write() builds the new
+ * contents in the bank not in use, copying unchanged records from the
+ * current one, and then commits it with a JREC_SEQ_BANK journal record
+ * carrying a new generation and the CRC of the bank. A power cut before
+ * the commit record is complete leaves the previous bank in use. Only
+ * segments whose contents differ are erased and reprogrammed.
+ */
+#define SEQ_PER_SEG (512/sizeof(heater_seqmem_t))
+
+static
+unsigned short dataset_crc(const union seq_d *d)
+{
+  const unsigned char *p;
+  unsigned short crc = 0xffff;
+  int i, n, k;
+
+  for (i=0; i<HT_LAST; i++) {
+    p = d->heater_seq[i].fill;
+    for (n=sizeof(heater_seq_t); n>0; n--) {
+      crc ^= (unsigned short)*p++ << 8;
+      for (k=0; k<8; k++) {
+        crc = (crc & 0x8000) ? (crc<<1) ^ 0x1021 : (crc<<1);
       }
-      if (s->volatile_data.status == HT_TEST && data[0] == 0) {
-        s->volatile_data.status_sched = HT_OFF;
-        s->volatile_data.time = 0;
-      }
-      break;
-    case WBUS_CMD_QUERY:
-      handle_query(data, len, s);
-      break;
-    case WBUS_CMD_IDENT:
-      handle_ident(data, len);
-      break;
-    case WBUS_CMD_OPINFO:
-      handle_opinfo(data, len, s);
-      break;
-    case WBUS_CMD_ERR:
-      handle_error(data, len, s);
-      break;
-    case WBUS_CMD_CO2CAL:
-      switch (data[0]) {
-        case CO2CAL_READ:
-          PRINTF("Read CO2 calibration value\n");
-          data[1] = s->static_data.co2_cal; data[2] = 0x00; data[3] = 0xff;
-          *len = 4;
-          break;
-        case CO2CAL_WRITE:
-          PRINTF("Set CO2 calibration value to %02x\n", data[1]);
-          *len = 1;
-          s->static_data.co2_cal = data[1];
-          break;
-        default:
-          PRINTF("Unknown CO2 calibration (0x57) index, %d, length %d\n", data[0], *len);
-          break;
-      }
-      break;
-    case WBUS_CMD_DATASET:
-      switch (data[0]) {
-        case DATASET_COUNT:
-          data[1] = HT_LAST;
-          *len = 2;
-          break;
-        case DATASET_READ:
-          dataset_read((heater_seqmem_t*)&data[2], data[1]);
-          *len = sizeof(heater_seq_t)+2;
-          break;
-        case DATASET_WRITE:
-          PRINTF("data set write %d\n", data[1]);
-          dataset_write((heater_seqmem_t*)&data[2], data[1]);
-          *len = sizeof(heater_seq_t)+2;
-          break;
-      }
-      break;
-    default:
-      PRINTF("0x%02x (unknown), len=%d, param1=%d, param2=%d\n", cmd, *len, data[0], data[1]);
-      break;
+    }
   }
-  
-  return err;
+  return crc;
 }
 
-void wbus_server_init(heater_state_t *s)
+/* Pick newest bank which holds what its header says. Fall back to the
+   compiled in defaults of seq_data if none. */
+static
+void dataset_select(void)
 {
-  s->static_data.working_duration.seconds = 0;  
-  s->static_data.working_duration.minutes = 0;  
-  s->static_data.working_duration.hours = 0;  
-  s->static_data.operating_duration.seconds = 0;
-  s->static_data.operating_duration.minutes = 0;
+  int b, i;
+
+  b = ((signed short)(seqCommit[1].gen - seqCommit[0].gen) > 0) ? 1 : 0;
+  for (i=0; i<2; i++, b ^= 1) {
+    if (seqCommit[b].gen != 0 && dataset_crc(seq_banks[b]) == seqCommit[b].crc) {
+      seq_bank = seq_banks[b];
+      return;
+    }
+    if (seqCommit[b].gen != 0) {
+      PRINTF("Data set bank %d corrupt\n", b);
+    }
+  }
+  seq_bank = &seq_data;
+}
+
+/* Largest value sensor i can have in state s */
+static
+unsigned short dataset_sensor_top(int s, int i)
+{
+  if ((i == SENSOR_HE || i == SENSOR_FD) && (SENSOR_VIRTUAL_OFF & (1<<s))) {
+    return 0;
+  }
+  /* Flame detector is a flag */
+  if (i == SENSOR_FD) {
+    return 1;
+  }
+  return 0xffff;
+}
+
+/* A trip from state s into s is a no-op if s loops on itself and neither
+   counts faults nor records an error. A pending state request is taken a
+   bit earlier by such a trip, the next iteration takes it anyway. Not so
+   in states whose time is set by W-Bus, each entry shortens it. */
+static
+int dataset_trip_noop(const heater_seq_t *seq, int s, int i, heater_status_t next)
+{
+  switch (s) {
+    case HT_VENT:
+    case HT_BURN_L:
+    case HT_BURN_H:
+    case HT_TEST:
+    case HT_RAMPUP:
+    case HT_RAMPDOWN:
+      return 0;
+    default:
+      break;
+  }
+  return next == s && seq->status_next == s && seq->max_faults == 0
+      && (seq->fault_mask & (1<<i)) != 0;
+}
+
+/* Sensors which can trip something, see seq_trip. Redo after each change
+   of seq_bank. */
+static
+void dataset_trip_update(void)
+{
+  const heater_seq_t *seq;
+  int s, i;
+
+  seq_gen++;
+  for (s=0; s<HT_LAST; s++) {
+    seq = &seq_bank->heater_seq[s].seq;
+    seq_trip[s] = 0;
+    seq_lock[s] = 0;
+    for (i=0; i<NUM_SENSOR; i++) {
+      if (seq->sensor_min[i] != 0 && !dataset_trip_noop(seq, s, i, seq->on_sensor_min[i])) {
+        seq_trip[s] |= 1<<i;
+        if (seq->on_sensor_min[i] == HT_LOCKED) {
+          seq_lock[s] |= 1<<i;
+        }
+      }
+      if (seq->sensor_max[i] < dataset_sensor_top(s, i)
+          && !dataset_trip_noop(seq, s, i, seq->on_sensor_max[i]))
+      {
+        seq_trip[s] |= 1<<i;
+        if (seq->on_sensor_max[i] == HT_LOCKED) {
+          seq_lock[s] |= 1<<i;
+        }
+      }
+    }
+  }
+}
+
+/* Bitmask of the sensors in mask which are out of range */
+static
+unsigned short sensor_trips(const unsigned short *s, const heater_seq_t *seq, unsigned short mask)
+{
+  unsigned short t = 0;
+  int i;
+
+#ifdef __MSP430__
+  /* Skip the sensors not in mask, the compares are what costs */
+  for (i=0; mask != 0; i++, mask >>= 1) {
+    if ((mask & 1) && (s[i] < seq->sensor_min[i] || s[i] > seq->sensor_max[i])) {
+      t |= 1<<i;
+    }
+  }
+  return t;
+#else
+  /* Compares are cheaper than walking the mask on hosts */
+  for (i=0; i<NUM_SENSOR; i++) {
+    if (s[i] < seq->sensor_min[i] || s[i] > seq->sensor_max[i]) {
+      t |= 1<<i;
+    }
+  }
+  return t & mask;
+#endif
+}
+
+int wbus_server_sensor_check(wbus_server_t *srv, unsigned short mask)
+{
+  heater_state_t *h = srv->state;
+  heater_status_t st = h->volatile_data.status;
+  const heater_seq_t *seq = &seq_bank->heater_seq[st].seq;
+  const unsigned short *s = h->volatile_data.sensor;
+  unsigned char *f = h->volatile_data.faults;
+  unsigned short trips;
+  int i;
+
+  /* Fault counters of sensors which can not trip stay 0, as they are
+     cleared on each state change. So those can be skipped entirely. */
+  mask &= seq_trip[st];
+  trips = sensor_trips(s, seq, mask);
+  /* Sensors in range with a fault counter of 0 have nothing to do. This
+     is the usual case, only the few others get walked. */
+  mask &= trips | srv->faulty;
+  for (i=0; mask != 0; i++, mask >>= 1, trips >>= 1) {
+    if (!(mask & 1)) {
+      continue;
+    }
+    if (trips & 1) {
+      f[i]++;
+      srv->tm.faults[st]++;
+      srv->faulty |= 1<<i;
+      if (f[i] > seq->max_faults) {
+        return i;
+      }
+    } else if (f[i] > 0) {
+      f[i]--;
+    } else {
+      /* Cleared by a state change */
+      srv->faulty &= ~(1<<i);
+    }
+  }
+
+  return -1;
+}
+
+static
+void dataset_read(heater_seqmem_t * seq, heater_status_t s)
+{ 
+  memcpy(seq, &seq_bank->heater_seq[s], sizeof(heater_seq_t));
+}
+
+static
+void dataset_write(heater_seqmem_t * seq, heater_status_t s)
+{  
+  union seq_d *dst;
+  const heater_seqmem_t *src;
+  int b, cur, i, first;
+
+  if (memcmp(&seq_bank->heater_seq[s], seq, sizeof(heater_seq_t)) == 0) {
+    return;
+  }
+
+  cur = (seq_bank == seq_banks[1]) ? 1 : 0;
+  b = cur ^ 1;
+  dst = seq_banks[b];
+
+  for (first=0; first<HT_LAST; first+=SEQ_PER_SEG) {
+    /* Leave segment alone if it holds the wanted contents already */
+    for (i=first; i<first+SEQ_PER_SEG; i++) {
+      src = (i == s) ? seq : &seq_bank->heater_seq[i];
+      if (memcmp(&dst->heater_seq[i], src, sizeof(heater_seq_t)) != 0) {
+        break;
+      }
+    }
+    if (i == first+SEQ_PER_SEG) {
+      continue;
+    }
+    flash_write(&dst->heater_seq[first], NULL, 0);
+    for (i=first; i<first+SEQ_PER_SEG; i++) {
+      src = (i == s) ? seq : &seq_bank->heater_seq[i];
+      flash_program(&dst->heater_seq[i], src, sizeof(heater_seq_t));
+    }
+  }
+
+  seqCommit[b].gen = seqCommit[cur].gen + 1;
+  if (seqCommit[b].gen == 0) {
+    seqCommit[b].gen = 1;
+  }
+  seqCommit[b].crc = dataset_crc(dst);
+  seqCommit[b].bank = b;
+  journal_append(JREC_SEQ_BANK, &seqCommit[b], sizeof(seq_commit_t));
+  seq_bank = dst;
+  dataset_trip_update();
+}
+
+static
+int error_makelist(wbus_server_t *srv, unsigned char *data)
+{
+  int i;
+  
+  for (i=0; i<MAX_ERR; i++)
+  {
+    if (srv->errors[i].code != 0) {
+      data[2+i*2] = srv->errors[i].code;
+      data[3+i*2] = srv->errors[i].counter;
+    } else {
+      break;
+    }
+  }
+  data[1] = i;
+  return i*2+2;
+}
+
+static
+int error_makeinfo(wbus_server_t *srv, unsigned char *data)
+{
+  int i;
+  
+  for (i=0; i<MAX_ERR; i++)
+  {
+    if (srv->errors[i].code == data[1]) {
+      memcpy(data+1, &srv->errors[i], sizeof(err_info_t));
+      break;
+    }
+  }
+  return 12;
+}
+
+
+void wbus_error_add(wbus_server_t *srv, unsigned char code, unsigned char n)
+{
+  heater_state_t *state = srv->state;
+  err_info_t *e;
+  unsigned short *s = state->volatile_data.sensor;
+  int i;
+ 
+  /* code, stat, counter, op_state, temp, volts, hours, minutes */
+  for (i=0; i<MAX_ERR; i++)
+  {
+    if (srv->errors[i].code == 0 || srv->errors[i].code == code)
+    {
+      e = &srv->errors[i];
+      e->code = code;
+      e->flags = 3;
+      e->counter++;
+      e->op_state[0] = ht_state2wb_state(state);
+      e->op_state[1] = n;
+      e->temp = s[SENSOR_T0];
+      VOLT2WORD(e->volt[0], s[SENSOR_VCC]);
+      e->hour[1] = state->static_data.working_duration.hours;
+      e->minute = state->static_data.working_duration.minutes;
+
+      if (srv == jSrv) {
+        journal_append(JREC_ERROR, e, sizeof(err_info_t));
+      }
+      break;
+    } 
+  }
+
+  /* Keep what led to the error, and a bit of the aftermath */
+  if (srv->log != NULL && srv->log->post == 0 && !(srv->log->flags & LOG_FROZEN)) {
+    srv->log->post = WBUS_SERVER_LOG_POST;
+    srv->log->flags |= LOG_FAULT;
+  }
+}
+
+void wbus_server_store(wbus_server_t *srv)
+{
+  if (srv == jSrv && memcmp(&jCounters, &srv->state->static_data, sizeof(heater_static_t)) != 0) {
+    jCounters = srv->state->static_data;
+    journal_append(JREC_COUNTERS, &jCounters, sizeof(heater_static_t));
+  }
+}
+
+static
+int handle_error(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
+{
+  int ecmd;
+  
+  ecmd = data[0];
+  
+  /* PRINTF("Error cmd %d\n", ecmd); */
+  
+  switch (ecmd) {
+    case ERR_LIST:
+      *plen = error_makelist(srv, data);
+      break;
+    case ERR_READ:
+      *plen = error_makeinfo(srv, data);
+      break;
+    case ERR_DEL:
+      memset(srv->errors, 0, sizeof(srv->errors));
+      if (srv == jSrv) {
+        journal_append(JREC_ERR_DEL, NULL, 0);
+      }
+      break;
+  }
+  return 0;
+}
+
+static
+void put_u32(unsigned char *d, unsigned long v)
+{
+  d[0] = v>>24;
+  d[1] = v>>16;
+  d[2] = v>>8;
+  d[3] = v;
+}
+
+static int tm_cmds(unsigned char *d, wbus_server_t *srv);
+
+static
+int diag_telemetry(unsigned char *data, wbus_server_t *srv)
+{
+  wbus_server_tm_t *tm = &srv->tm;
+  wb_link_stats_t l;
+  int i, n;
+
+  memset(&l, 0, sizeof(l));
+  if (tm->link != NULL) {
+    l = *tm->link;
+  }
+  put_u32(&data[1], JFREQ);
+  data[5] = l.rx_len_err>>8; data[6] = l.rx_len_err;
+  data[7] = l.rx_chk_err>>8; data[8] = l.rx_chk_err;
+  data[9] = l.tx>>8; data[10] = l.tx;
+  data[11] = l.lat_max>>8; data[12] = l.lat_max;
+  put_u32(&data[13], tm->snapshots);
+  data[17] = tm->deadlines>>8; data[18] = tm->deadlines;
+  data[19] = HT_LAST;
+  for (i=0, n=20; i<HT_LAST; i++, n+=2) {
+    data[n] = tm->faults[i]>>8;
+    data[n+1] = tm->faults[i];
+  }
+
+  return n + tm_cmds(&data[n], srv);
+}
+
+static
+int handle_diag(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
+{
+#ifdef KERNEL_PROFILE
+  kernel_prof_t p;
+  int n;
+#endif
+
+  switch (data[0]) {
+    case DIAG_TELEMETRY:
+      *plen = diag_telemetry(data, srv);
+      break;
+    case DIAG_TELEMETRY_RESET:
+      memset(srv->tm.rx, 0, sizeof(srv->tm.rx));
+      srv->tm.snapshots = 0;
+      srv->tm.deadlines = 0;
+      memset(srv->tm.faults, 0, sizeof(srv->tm.faults));
+      if (srv->tm.link != NULL) {
+        memset(srv->tm.link, 0, sizeof(wb_link_stats_t));
+      }
+      *plen = 1;
+      break;
+#ifdef KERNEL_PROFILE
+    case DIAG_SCHED_CLOCK:
+      for (n=0; kernel_stack_size(n) >= 0; n++) ;
+      data[1] = n;
+      put_u32(&data[2], PFREQ);
+      *plen = 6;
+      break;
+    case DIAG_SCHED:
+      if (kernel_profile_get(data[1], &p) != 0) {
+        *plen = 2;
+        break;
+      }
+      put_u32(&data[2], p.dispatches);
+      put_u32(&data[6], p.run_time);
+      put_u32(&data[10], p.max_slice);
+      put_u32(&data[14], p.wakeups);
+      put_u32(&data[18], p.max_latency);
+      n = kernel_stack_usage(data[1]);
+      data[22] = n>>8; data[23] = n;
+      n = kernel_stack_size(data[1]);
+      data[24] = n>>8; data[25] = n;
+      *plen = 26;
+      break;
+    case DIAG_SCHED_RESET:
+      kernel_profile_reset();
+      *plen = 1;
+      break;
+#endif
+  }
+  return 0;
+}
+
+/* Heater state log, format see WBUS_CMD_LOG */
+
+typedef char log_block_check[(WBUS_SERVER_LOG_BLOCK <= 256 && WBUS_SERVER_LOG_CH <= 32) ? 1 : -1];
+
+/* header, channel flags, 3 bytes per channel */
+#define LOG_REC_MAX (1+4+3*WBUS_SERVER_LOG_CH)
+
+static const unsigned short log_zero[WBUS_SERVER_LOG_CH];
+
+static
+unsigned char *log_block(wbus_server_log_t *log, unsigned long b)
+{
+  unsigned short i;
+
+  i = log->cur + log->nblk - (unsigned short)(log->last - b);
+  if (i >= log->nblk) {
+    i -= log->nblk;
+  }
+  return log->buf + i*WBUS_SERVER_LOG_BLOCK;
+}
+
+static
+int log_varint(unsigned char *d, unsigned long v)
+{
+  int n = 0;
+
+  while (v >= 0x80) {
+    d[n++] = v | 0x80;
+    v >>= 7;
+  }
+  d[n++] = v;
+
+  return n;
+}
+
+/* Encode channels v which differ from base. Returns 0 if none does. */
+static
+int log_encode(unsigned char *d, const unsigned short *v, const unsigned short *base)
+{
+  unsigned long mask = 0;
+  signed long dv;
+  int i, n = 1;
+
+  for (i=0; i<WBUS_SERVER_LOG_CH; i++) {
+    if (v[i] != base[i]) {
+      mask |= 1UL<<i;
+    }
+  }
+  if (mask == 0) {
+    return 0;
+  }
+  d[0] = 0x80 | (mask & 0x3f);
+  if (mask >> 6) {
+    d[0] |= 0x40;
+    n += log_varint(&d[1], mask >> 6);
+  }
+  for (i=0; mask != 0; i++, mask >>= 1) {
+    if (mask & 1) {
+      dv = (signed long)v[i] - base[i];
+      n += log_varint(&d[n], (dv >= 0) ? ((unsigned long)dv<<1) : ((unsigned long)(-dv)<<1)-1);
+    }
+  }
+
+  return n;
+}
+
+/* Terminate the newest block, the next record starts a new one. */
+static
+void log_close(wbus_server_log_t *log)
+{
+  if (log->fill == 0) {
+    return;
+  }
+  if (log->fill < WBUS_SERVER_LOG_BLOCK) {
+    log_block(log, log->last)[log->fill] = 0;
+  }
+  log->fill = WBUS_SERVER_LOG_BLOCK;
+  log->rep = 0;
+}
+
+void wbus_server_log_init(wbus_server_t *srv, wbus_server_log_t *log, unsigned char *buf, int nblk)
+{
+  memset(log, 0, sizeof(wbus_server_log_t));
+  log->buf = buf;
+  log->nblk = nblk;
+  srv->log = log;
+}
+
+void wbus_server_log(wbus_server_t *srv)
+{
+  wbus_server_log_t *log = srv->log;
+  heater_state_t *s = srv->state;
+  unsigned short v[WBUS_SERVER_LOG_CH];
+  unsigned char rec[LOG_REC_MAX], *b;
+  unsigned int t0;
+  int n;
+
+  if (log == NULL) {
+    return;
+  }
+  if (log->flags & LOG_FROZEN) {
+    log->tick++;
+    return;
+  }
+  t0 = machine_getProfClock();
+
+  memcpy(v, s->volatile_data.sensor, sizeof(s->volatile_data.sensor));
+  memcpy(&v[NUM_SENSOR], s->volatile_data.act, sizeof(s->volatile_data.act));
+  v[WBUS_SERVER_LOG_CH-1] = s->volatile_data.status;
+
+  n = log_encode(rec, v, log->prev);
+  b = log_block(log, log->last);
+  if (n == 0 && log->rep != 0 && b[log->rep] < 0x7f) {
+    b[log->rep]++;
+  } else {
+    if (n == 0) {
+      rec[0] = 1;
+      n = 1;
+    }
+    if (log->fill == 0 || log->fill + n > WBUS_SERVER_LOG_BLOCK) {
+      /* Start a new block, dropping the oldest one if needed. */
+      if (log->fill != 0) {
+        log_close(log);
+        log->last++;
+        if (++log->cur >= log->nblk) {
+          log->cur = 0;
+        }
+        if (log->last - log->first >= log->nblk) {
+          log->first++;
+        }
+      }
+      b = log_block(log, log->last);
+      b[0] = log->tick;
+      b[1] = log->tick>>8;
+      b[2] = log->tick>>16;
+      b[3] = log->tick>>24;
+      log->fill = 4;
+      n = log_encode(rec, v, log_zero);
+      if (n == 0) {
+        rec[0] = 0x80;
+        n = 1;
+      }
+    }
+    memcpy(b + log->fill, rec, n);
+    log->rep = (rec[0] < 0x80) ? log->fill : 0;
+    log->fill += n;
+  }
+  memcpy(log->prev, v, sizeof(v));
+  log->tick++;
+
+  if (log->post != 0 && --log->post == 0) {
+    log->flags |= LOG_FROZEN;
+  }
+
+  t0 = machine_getProfClock() - t0;
+  if (t0 > log->rec_max) {
+    log->rec_max = t0;
+  }
+}
+
+static
+int handle_log(unsigned char cmd, unsigned char *data, int *plen, wbus_server_t *srv)
+{
+  wbus_server_log_t *log = srv->log;
+  unsigned long b;
+  int n;
+
+  if (log == NULL) {
+    *plen = 1;
+    return 0;
+  }
+
+  switch (data[0]) {
+    case LOG_INFO:
+      put_u32(&data[1], log->first);
+      put_u32(&data[5], log->last);
+      data[9] = log->fill>>8; data[10] = log->fill;
+      data[11] = WBUS_SERVER_LOG_BLOCK>>8; data[12] = WBUS_SERVER_LOG_BLOCK & 0xff;
+      data[13] = log->flags;
+      data[14] = HEATER_PERIOD>>8; data[15] = HEATER_PERIOD & 0xff;
+      put_u32(&data[16], JFREQ);
+      put_u32(&data[20], log->rec_max);
+      put_u32(&data[24], PFREQ);
+      data[28] = NUM_SENSOR;
+      data[29] = NUM_ACT;
+      *plen = 30;
+      break;
+    case LOG_READ:
+      b = ((unsigned long)data[1]<<24) | ((unsigned long)data[2]<<16) | ((unsigned long)data[3]<<8) | data[4];
+      n = 0;
+      if (log->fill != 0 && b - log->first <= log->last - log->first) {
+        n = ((b == log->last) ? log->fill : WBUS_SERVER_LOG_BLOCK) - data[5];
+        if (n > LOG_CHUNK) {
+          n = LOG_CHUNK;
+        }
+        if (n < 0) {
+          n = 0;
+        }
+        memcpy(&data[6], log_block(log, b) + data[5], n);
+      }
+      *plen = 6 + n;
+      break;
+    case LOG_RESET:
+      wbus_server_log_init(srv, log, log->buf, log->nblk);
+      *plen = 1;
+      break;
+    case LOG_FREEZE:
+      if (data[1] != 0) {
+        log->flags |= LOG_FROZEN;
+      } else if (log->flags & LOG_FROZEN) {
+        /* Ticks went by unrecorded, continue in a new block */
+        log_close(log);
+        log->flags = 0;
+        log->post = 0;
+      }
+      *plen = 2;
+      break;
+  }
+  return 0;
+}
+
+static
+int handle_off(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  if (s->volatile_data.status != HT_OFF 
+   && s->volatile_data.status != HT_COOLDOWN
+   && s->volatile_data.status != HT_STOP)
+  {
+    s->volatile_data.time = 0;
+    s->volatile_data.cmd_refresh_time = 0;
+    if (s->volatile_data.status == HT_VENT) {
+      s->volatile_data.status_sched = HT_OFF;
+    } else {
+      s->volatile_data.status_sched = HT_STOP;
+    }
+  }
+  *len = 1;
+  return 0;
+}
+
+static
+int handle_on(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  if (s->volatile_data.status == HT_OFF) {
+    s->volatile_data.time = 0;
+    s->volatile_data.status_sched = (cmd == WBUS_CMD_ON_VENT) ? HT_VENT : HT_START;
+    s->volatile_data.wbus_time = data[0] * (60*JFREQ/HEATER_PERIOD);
+    s->volatile_data.cmd_refresh_time = MSEC2PERIODS(CMD_REFRESH_PERIOD);
+    s->volatile_data.cmd_refresh = cmd;
+  }
+  return 0;
+}
+
+static
+int handle_nop(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  /* ToDo */
+  return 0;
+}
+
+static const unsigned char u1_reply[] = { 0xb8, 0x0b, 0x00, 0x00, 0x00, 0x03, 0xdd };
+
+static
+int handle_u1(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  PRINTF("0x38 (unknown)\n");
+  memcpy(data, u1_reply, sizeof(u1_reply));
+  *len = sizeof(u1_reply);
+  return 1;
+}
+
+static
+int handle_x(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  switch (data[0]) {
+    case CMD_X_FP:
+    PRINTF("Fuel priming %d seconds\n", ((data[1]<<8)+data[2])<<1);
+    if (s->volatile_data.status == HT_OFF) {
+      s->volatile_data.act[ACT_DP] = 40; /* Set dosing pump to 2 Hz */
+      s->volatile_data.status_sched = HT_TEST;
+      s->volatile_data.wbus_time = ((((int)data[1]<<9)+((int)data[2]<<1))) * (JFREQ/HEATER_PERIOD);
+      s->volatile_data.time = 0;
+    }
+    break;
+    case CMD_X_VCAL:
+      PRINTF("Voltage calibration %f Volt\n", ((data[1]<<8)+data[2])/1000.f);
+      break;
+    case CMD_X_FCAL:
+      PRINTF("Flame detector calibration %d\n", (data[1]<<8)+data[2]);
+      break;
+  }
+  return 0;
+}
+
+static
+int handle_chk(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  if (s->volatile_data.cmd_refresh == data[0]) {
+    s->volatile_data.cmd_refresh_time = MSEC2PERIODS(CMD_REFRESH_PERIOD);
+    data[0] = 0;
+  } else {
+    data[0] = 1;
+  }
+  *len = 1;
+  return 0;
+}
+
+static
+int handle_test(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  if (s->volatile_data.status == HT_OFF) {
+    unsigned short *acts = s->volatile_data.act;
+    unsigned short tmp;
+    
+    s->volatile_data.status_sched = HT_TEST;
+    s->volatile_data.wbus_time = data[1] * (JFREQ/HEATER_PERIOD);
+    s->volatile_data.time = 0;
+
+    tmp = ((unsigned short)data[2]<<8) | (unsigned short)data[3];
+    switch (data[0]) {
+      case WBUS_TEST_CF:  acts[ACT_CF]  = tmp; break;
+      case WBUS_TEST_FP:  acts[ACT_DP]  = tmp; break;
+      case WBUS_TEST_GP:  acts[ACT_GKZ] = tmp<<(ACTMAX_LD2-1); break;
+      case WBUS_TEST_CP:  acts[ACT_CP]  = tmp<<(ACTMAX_LD2-1); break;
+      case WBUS_TEST_VF:  acts[ACT_VF]  = 100<<ACTMAX_LD2; break;
+      case WBUS_TEST_SV:  acts[ACT_AUX] = 100<<ACTMAX_LD2; break;
+      case WBUS_TEXT_NAC: acts[ACT_CC]  = tmp<<(ACTMAX_LD2-1); break;
+      case WBUS_TEST_NSH: acts[ACT_GKPH] = 100<<ACTMAX_LD2; break;
+      case WBUS_TEST_FPW: acts[ACT_GKPH] = tmp<<ACTMAX_LD2; break;
+    }
+  }
+  if (s->volatile_data.status == HT_TEST && data[0] == 0) {
+    s->volatile_data.status_sched = HT_OFF;
+    s->volatile_data.time = 0;
+  }
+  return 0;
+}
+
+static
+int handle_co2cal(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  heater_state_t *s = srv->state;
+
+  switch (data[0]) {
+    case CO2CAL_READ:
+      PRINTF("Read CO2 calibration value\n");
+      data[1] = s->static_data.co2_cal; data[2] = 0x00; data[3] = 0xff;
+      *len = 4;
+      break;
+    case CO2CAL_WRITE:
+      PRINTF("Set CO2 calibration value to %02x\n", data[1]);
+      *len = 1;
+      s->static_data.co2_cal = data[1];
+      wbus_server_store(srv);
+      break;
+    default:
+      PRINTF("Unknown CO2 calibration (0x57) index, %d, length %d\n", data[0], *len);
+      break;
+  }
+  return 0;
+}
+
+static
+int handle_dataset(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv)
+{
+  switch (data[0]) {
+    case DATASET_COUNT:
+      data[1] = HT_LAST;
+      *len = 2;
+      break;
+    case DATASET_READ:
+      if (data[1] >= HT_LAST) {
+        *len = 2;
+        break;
+      }
+      dataset_read((heater_seqmem_t*)&data[2], data[1]);
+      *len = sizeof(heater_seq_t)+2;
+      break;
+    case DATASET_WRITE:
+      PRINTF("data set write %d\n", data[1]);
+      /* Shared data sets are stored by the persistent instance only. The
+         entry is echoed if it was written, otherwise just its index. */
+      if (data[1] >= HT_LAST || srv != jSrv) {
+        *len = 2;
+        return 1;
+      }
+      dataset_write((heater_seqmem_t*)&data[2], data[1]);
+      *len = sizeof(heater_seq_t)+2;
+      break;
+  }
+  return 0;
+}
+
+/* Command handlers return non zero if the reply is to be sent as error */
+typedef int (*cmd_handler_t)(unsigned char cmd, unsigned char *data, int *len, wbus_server_t *srv);
+
+#define CMD_FIRST WBUS_CMD_OFF
+#define CMD_LAST  WBUS_CMD_LOG
+
+/* Indexed by command code minus CMD_FIRST. NULL for unknown commands. */
+static const cmd_handler_t cmd_handler[CMD_LAST-CMD_FIRST+1] =
+{
+  [WBUS_CMD_OFF-CMD_FIRST]      = handle_off,
+  [WBUS_CMD_ON-CMD_FIRST]       = handle_on,
+  [WBUS_CMD_ON_PH-CMD_FIRST]    = handle_on,
+  [WBUS_CMD_ON_SH-CMD_FIRST]    = handle_on,
+  [WBUS_CMD_ON_VENT-CMD_FIRST]  = handle_on,
+  [WBUS_CMD_CP-CMD_FIRST]       = handle_nop,
+  [WBUS_CMD_BOOST-CMD_FIRST]    = handle_nop,
+  [WBUS_CMD_U1-CMD_FIRST]       = handle_u1,
+  [WBUS_CMD_X-CMD_FIRST]        = handle_x,
+  [WBUS_CMD_CHK-CMD_FIRST]      = handle_chk,
+  [WBUS_CMD_TEST-CMD_FIRST]     = handle_test,
+  [WBUS_CMD_QUERY-CMD_FIRST]    = handle_query,
+  [WBUS_CMD_IDENT-CMD_FIRST]    = handle_ident,
+  [WBUS_CMD_OPINFO-CMD_FIRST]   = handle_opinfo,
+  [WBUS_CMD_ERR-CMD_FIRST]      = handle_error,
+  [WBUS_CMD_CO2CAL-CMD_FIRST]   = handle_co2cal,
+  [WBUS_CMD_DATASET-CMD_FIRST]  = handle_dataset,
+  [WBUS_CMD_DIAG-CMD_FIRST]     = handle_diag,
+  [WBUS_CMD_MQUERY-CMD_FIRST]   = handle_mquery,
+  [WBUS_CMD_LOG-CMD_FIRST]      = handle_log,
+};
+
+/* Frame counter slot of a command. Known commands get their own slot. */
+static
+int tm_slot(unsigned char cmd)
+{
+  int i, slot = 0;
+
+  if (cmd < CMD_FIRST || cmd > CMD_LAST || cmd_handler[cmd-CMD_FIRST] == NULL) {
+    return WBUS_SERVER_TM_CMDS-1;
+  }
+  for (i=0; i<cmd-CMD_FIRST; i++) {
+    if (cmd_handler[i] != NULL) {
+      slot++;
+    }
+  }
+
+  return (slot < WBUS_SERVER_TM_CMDS-1) ? slot : WBUS_SERVER_TM_CMDS-1;
+}
+
+/* Encode command and frame count of each received command into d. */
+static
+int tm_cmds(unsigned char *d, wbus_server_t *srv)
+{
+  int i, slot = 0, n = 0;
+
+  for (i=0; i<=CMD_LAST-CMD_FIRST && slot < WBUS_SERVER_TM_CMDS-1; i++) {
+    if (cmd_handler[i] == NULL) {
+      continue;
+    }
+    if (srv->tm.rx[slot] != 0) {
+      d[n] = CMD_FIRST+i;
+      d[n+1] = srv->tm.rx[slot]>>8;
+      d[n+2] = srv->tm.rx[slot];
+      n += 3;
+    }
+    slot++;
+  }
+  if (srv->tm.rx[WBUS_SERVER_TM_CMDS-1] != 0) {
+    d[n] = 0;
+    d[n+1] = srv->tm.rx[WBUS_SERVER_TM_CMDS-1]>>8;
+    d[n+2] = srv->tm.rx[WBUS_SERVER_TM_CMDS-1];
+    n += 3;
+  }
+
+  return n;
+}
+
+int wbus_server_process(wbus_server_t *srv, unsigned char cmd, unsigned char *data, int *len)
+{
+  cmd_handler_t h = NULL;
+
+  /* PRINTF("len = %d cmd = %x idx = %x\n", *len, cmd, data[0]); */
+
+  srv->tm.rx[tm_slot(cmd)]++;
+
+  if (cmd >= CMD_FIRST && cmd <= CMD_LAST) {
+    h = cmd_handler[cmd-CMD_FIRST];
+  }
+  if (h == NULL) {
+    PRINTF("0x%02x (unknown), len=%d, param1=%d, param2=%d\n", cmd, *len, data[0], data[1]);
+    return 0;
+  }
+
+  return h(cmd, data, len, srv);
+}
+
+void wbus_server_init(wbus_server_t *srv, heater_state_t *s, int flags)
+{
+  int i;
+
+  memset(srv, 0, sizeof(wbus_server_t));
+  srv->state = s;
+  srv->flags = flags;
+  srv->snap_cur = -1;
+  srv->faulty = 0xffff;
+  memcpy(srv->serial, id_serial, sizeof(srv->serial));
+  srv->errors[0] = err_default;
+  /* Every page is newer than "none" */
+  srv->page_ver_cur = 1;
+  for (i=0; i<WBUS_SERVER_PAGES; i++) {
+    srv->page_ver[i] = 1;
+  }
+
+  s->static_data.working_duration.seconds = 0;  
+  s->static_data.working_duration.minutes = 0;  
+  s->static_data.working_duration.hours = 0;  
+  s->static_data.operating_duration.seconds = 0;
+  s->static_data.operating_duration.minutes = 0;
   s->static_data.operating_duration.hours = 0;
   s->static_data.counter = 0;
   s->static_data.co2_cal = 0x80;
+
+  if (flags & WBUS_SERVER_PERSISTENT) {
+    journal_replay(srv);
+    dataset_select();
+  }
+  dataset_trip_update();
 }
 